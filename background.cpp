@@ -22,72 +22,228 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <cmath>
 
 #include "background.h"
+#include "calibration.h"
+#include "threadpool.h"
 
 
 /*
  *	Update self generated darkcal file
+ *	Non-hits are summed in the worker's own array and added to the shared background 
+ *	every bgRecalc frames, see publishPersistentBackground()
  */
 void updatePersistentBackground(tThreadInfo *threadInfo, cGlobal *global, int hit){
-	float	gmd;
-	// Add current (uncorrected) image to self darkcal
-	if (!hit) {	
+	
+	if (hit)
+		return;
+	
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	if (workerData->bgSum == NULL)
+		workerData->bgSum = (float*) calloc(global->pix_nn, sizeof(float));
+	
+	// Add current (uncorrected) image to this worker's sum
+	float	*sum = workerData->bgSum;
+	for(long i=0;i<global->pix_nn;i++)
+		sum[i] += threadInfo->corrected_data[i];
+	workerData->bgGMD += (threadInfo->gmd21+threadInfo->gmd22)/2;
+	workerData->bgFrames++;
+	
+	// Publish from bgRecalc frames on (see snapshot.h)
+	if (workerData->bgFrames >= global->bgRecalc)
+		publishPersistentBackground(workerData, global, workerData->bgFrames >= 2*global->bgRecalc);
+}
+
+
+/*
+ *	Add the frames summed by one worker to the running background (M = bgMemory) and publish it as a new version
+ */
+void publishPersistentBackground(tWorkerData *workerData, cGlobal *global, int wait){
+	
+	if (wait)
 		pthread_mutex_lock(&global->selfdark_mutex);
-		for(long i=0;i<global->pix_nn;i++){
-			global->selfdark[i] = ( threadInfo->corrected_data[i] + (global->bgMemory-1)*global->selfdark[i]) / global->bgMemory;
-		}
-		gmd = (threadInfo->gmd21+threadInfo->gmd22)/2;
-		global->avgGMD = ( gmd + (global->bgMemory-1)*global->avgGMD) / global->bgMemory;
-		pthread_mutex_unlock(&global->selfdark_mutex);
+	else if (pthread_mutex_trylock(&global->selfdark_mutex))
+		return;
+	
+	int		pinned;
+	float	n = workerData->bgFrames;
+	float	decay = pow((global->bgMemory-1.0)/global->bgMemory, (double) n);
+	float	*sum = workerData->bgSum;
+	
+	// Only one thread publishes at a time (selfdark_mutex), so the current version cannot change under us
+	const float	*selfdark = (const float*) pinSnapshot(&global->selfdarkSnapshot, &pinned);
+	float		*update = (float*) beginSnapshotUpdate(&global->selfdarkSnapshot);
+	for(long i=0;i<global->pix_nn;i++){
+		update[i] = decay*selfdark[i] + (1-decay)*(sum[i]/n);
+		sum[i] = 0;
+	}
+	unpinSnapshot(&global->selfdarkSnapshot, pinned);
+	publishSnapshot(&global->selfdarkSnapshot);
+	
+	global->avgGMD = decay*global->avgGMD + (1-decay)*(workerData->bgGMD/n);
+	workerData->bgGMD = 0;
+	workerData->bgFrames = 0;
+	
+	pthread_mutex_unlock(&global->selfdark_mutex);
+}
+
+
+/*
+ *	Inner products used to scale the background to the current frame
+ *	Pixels above the hitfinder threshold are left out; sums are kept in double precision
+ */
+static void backgroundProductsScalar(const float *frame, const float *background, float adc, long start, long end, double *top, double *s1){
+	
+	for(long i=start; i<end; i++){
+		float v1 = background[i];
+		float v2 = frame[i];
+		if(v2 > adc)
+			continue;
+		*top += v1*v2;
+		*s1 += v1*v1;
+	}
+}
+
+#ifdef SIMD_HAVE_SSE2
+static void backgroundProductsSSE2(const float *frame, const float *background, float adc, long n, double *top, double *s1){
+	
+	const __m128	threshold = _mm_set1_ps(adc);
+	__m128d			sumTop = _mm_setzero_pd();
+	__m128d			sumS1 = _mm_setzero_pd();
+	double			result[2];
+	long			i = 0;
+	
+	for(; i+4<=n; i+=4){
+		__m128 v2 = _mm_loadu_ps(frame+i);
+		__m128 use = _mm_cmple_ps(v2, threshold);
+		__m128 v1 = _mm_and_ps(_mm_loadu_ps(background+i), use);
+		__m128 p12 = _mm_mul_ps(v1, v2);
+		__m128 p11 = _mm_mul_ps(v1, v1);
+		sumTop = _mm_add_pd(sumTop, _mm_add_pd(_mm_cvtps_pd(p12), _mm_cvtps_pd(_mm_movehl_ps(p12, p12))));
+		sumS1 = _mm_add_pd(sumS1, _mm_add_pd(_mm_cvtps_pd(p11), _mm_cvtps_pd(_mm_movehl_ps(p11, p11))));
 	}
+	_mm_storeu_pd(result, sumTop);
+	*top += result[0] + result[1];
+	_mm_storeu_pd(result, sumS1);
+	*s1 += result[0] + result[1];
+	backgroundProductsScalar(frame, background, adc, i, n, top, s1);
+}
+#endif
 
+#ifdef SIMD_HAVE_AVX2
+__attribute__((target("avx2")))
+static void backgroundProductsAVX2(const float *frame, const float *background, float adc, long n, double *top, double *s1){
+	
+	const __m256	threshold = _mm256_set1_ps(adc);
+	__m256d			sumTop = _mm256_setzero_pd();
+	__m256d			sumS1 = _mm256_setzero_pd();
+	double			result[4];
+	long			i = 0;
+	
+	for(; i+8<=n; i+=8){
+		__m256 v2 = _mm256_loadu_ps(frame+i);
+		__m256 use = _mm256_cmp_ps(v2, threshold, _CMP_LE_OQ);
+		__m256 v1 = _mm256_and_ps(_mm256_loadu_ps(background+i), use);
+		__m256 p12 = _mm256_mul_ps(v1, v2);
+		__m256 p11 = _mm256_mul_ps(v1, v1);
+		sumTop = _mm256_add_pd(sumTop, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(p12)), _mm256_cvtps_pd(_mm256_extractf128_ps(p12, 1))));
+		sumS1 = _mm256_add_pd(sumS1, _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(p11)), _mm256_cvtps_pd(_mm256_extractf128_ps(p11, 1))));
+	}
+	_mm256_storeu_pd(result, sumTop);
+	*top += result[0] + result[1] + result[2] + result[3];
+	_mm256_storeu_pd(result, sumS1);
+	*s1 += result[0] + result[1] + result[2] + result[3];
+	backgroundProductsScalar(frame, background, adc, i, n, top, s1);
 }
+#endif
+
+
+/*
+ *	frame -= factor*background
+ */
+static void backgroundSubtractScalar(float *frame, const float *background, float factor, long start, long end){
+	for(long i=start; i<end; i++)
+		frame[i] = frame[i] - (factor*background[i]);
+}
+
+#ifdef SIMD_HAVE_SSE2
+static void backgroundSubtractSSE2(float *frame, const float *background, float factor, long n){
+	
+	const __m128	f = _mm_set1_ps(factor);
+	long			i = 0;
+	
+	for(; i+4<=n; i+=4)
+		_mm_storeu_ps(frame+i, _mm_sub_ps(_mm_loadu_ps(frame+i), _mm_mul_ps(f, _mm_loadu_ps(background+i))));
+	backgroundSubtractScalar(frame, background, factor, i, n);
+}
+#endif
+
+#ifdef SIMD_HAVE_AVX2
+__attribute__((target("avx2")))
+static void backgroundSubtractAVX2(float *frame, const float *background, float factor, long n){
+	
+	const __m256	f = _mm256_set1_ps(factor);
+	long			i = 0;
+	
+	for(; i+8<=n; i+=8)
+		_mm256_storeu_ps(frame+i, _mm256_sub_ps(_mm256_loadu_ps(frame+i), _mm256_mul_ps(f, _mm256_loadu_ps(background+i))));
+	backgroundSubtractScalar(frame, background, factor, i, n);
+}
+#endif
 
 
 /*
  *	Subtract self generated darkcal file
+ *	Uses the latest published version of the background, which cannot change while we use it
  */
 void subtractPersistentBackground(tThreadInfo *threadInfo, cGlobal *global){
 	
-	float	top = 0;
-	float	s1 = 0;
-	float	s2 = 0;
-	float	v1, v2;
-	float	factor;
-	
+	int		pinned;
+	float	factor = 1;
+	float	*data = threadInfo->corrected_data;
+	long	n = global->pix_nn;
 	
+	const float	*selfdark = (const float*) pinSnapshot(&global->selfdarkSnapshot, &pinned);
 	
 	// Find appropriate scaling factor 
+	// Simple inner product gives cos(theta), which is always less than zero
+	// Want ( (a.b)/|b| ) * (b/|b|)
 	if(global->scaleBackground) {
-		for(long i=0;i<global->pix_nn;i++){
-			//v1 = pow(global->selfdark[i], 0.25);
-			//v2 = pow(threadInfo->corrected_data[i], 0.25);
-			v1 = global->selfdark[i];
-			v2 = threadInfo->corrected_data[i];
-			if(v2 > global->hitfinder.ADC)
-				continue;
-			
-			// Simple inner product gives cos(theta), which is always less than zero
-			// Want ( (a.b)/|b| ) * (b/|b|)
-			top += v1*v2;
-			s1 += v1*v1;
-			s2 += v2*v2;
-		}
-		factor = top/s1;
+		double	top = 0;
+		double	s1 = 0;
+		float	adc = global->hitfinder.ADC;
+		
+#ifdef SIMD_HAVE_AVX2
+		if (global->simdLevel == SIMD_AVX2) 
+			backgroundProductsAVX2(data, selfdark, adc, n, &top, &s1);
+		else
+#endif
+#ifdef SIMD_HAVE_SSE2
+		if (global->simdLevel == SIMD_SSE2)
+			backgroundProductsSSE2(data, selfdark, adc, n, &top, &s1);
+		else
+#endif
+			backgroundProductsScalar(data, selfdark, adc, 0, n, &top, &s1);
+		
+		// No background yet
+		if (s1 > 0)
+			factor = top/s1;
 	}
-	else 
-		factor=1;
 	
 	
 	// Do the weighted subtraction
-	// Watch out for integer wraparound! Not a problem anymore since corrected_data is float
-	float diff;
-	for(long i=0;i<global->pix_nn;i++) {
-		diff = threadInfo->corrected_data[i] - (factor*global->selfdark[i]);	
-		//if(diff < -32766) diff = -32767;
-		//if(diff > 32766) diff = 32767;
-		threadInfo->corrected_data[i] = diff;
-	}	
+#ifdef SIMD_HAVE_AVX2
+	if (global->simdLevel == SIMD_AVX2) 
+		backgroundSubtractAVX2(data, selfdark, factor, n);
+	else
+#endif
+#ifdef SIMD_HAVE_SSE2
+	if (global->simdLevel == SIMD_SSE2)
+		backgroundSubtractSSE2(data, selfdark, factor, n);
+	else
+#endif
+		backgroundSubtractScalar(data, selfdark, factor, 0, n);
+	
+	unpinSnapshot(&global->selfdarkSnapshot, pinned);
 }
-
@@ -28,6 +28,7 @@
  *	Function prototypes
  */
 void updatePersistentBackground(tThreadInfo*, cGlobal*, int);
+void publishPersistentBackground(tWorkerData*, cGlobal*, int);
 void subtractPersistentBackground(tThreadInfo*, cGlobal*);
 
 #endif
@@ -0,0 +1,227 @@
+/*
+ *  calibration.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "calibration.h"
+
+
+/*
+ *	Static detector corrections (darkcal, gain, bad pixel mask) in one pass over the frame.
+ *
+ *	Each stage reproduces the arithmetic of the original per-stage loops exactly:
+ *	- darkcal: raw values are integers below 2^16, so subtracting the truncated darkcal in float
+ *	  and clamping to +/-32767 gives the same value as the old int32_t/int16_t round trip
+ *	- gain and bad pixel mask are applied as two separate float multiplications, in that order
+ *	The kernels are instantiated for every combination of stages so that disabled stages cost nothing.
+ */
+typedef void (*tStaticCorrectionKernel)(float*, const float*, const float*, const float*, long);
+
+
+template <int DARK, int GAIN, int MASK>
+static inline void staticCorrectionsRange(float *data, const float *dark, const float *gain, const float *mask, long start, long end){
+
+	for(long i=start; i<end; i++) {
+		float x = data[i];
+		if (DARK) {
+			x -= dark[i];
+			if (x < -32767.f) x = -32767.f;
+			if (x > 32767.f) x = 32767.f;
+		}
+		if (GAIN)
+			x *= gain[i];
+		if (MASK)
+			x *= mask[i];
+		data[i] = x;
+	}
+}
+
+template <int DARK, int GAIN, int MASK>
+static void staticCorrectionsScalar(float *data, const float *dark, const float *gain, const float *mask, long n){
+	staticCorrectionsRange<DARK,GAIN,MASK>(data, dark, gain, mask, 0, n);
+}
+
+
+#ifdef SIMD_HAVE_SSE2
+template <int DARK, int GAIN, int MASK>
+static void staticCorrectionsSSE2(float *data, const float *dark, const float *gain, const float *mask, long n){
+
+	const __m128 lo = _mm_set1_ps(-32767.f);
+	const __m128 hi = _mm_set1_ps(32767.f);
+	long i = 0;
+
+	for(; i+4<=n; i+=4) {
+		__m128 x = _mm_loadu_ps(data+i);
+		if (DARK) {
+			x = _mm_sub_ps(x, _mm_loadu_ps(dark+i));
+			x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+		}
+		if (GAIN)
+			x = _mm_mul_ps(x, _mm_loadu_ps(gain+i));
+		if (MASK)
+			x = _mm_mul_ps(x, _mm_loadu_ps(mask+i));
+		_mm_storeu_ps(data+i, x);
+	}
+	staticCorrectionsRange<DARK,GAIN,MASK>(data, dark, gain, mask, i, n);
+}
+#endif
+
+
+#ifdef SIMD_HAVE_AVX2
+template <int DARK, int GAIN, int MASK>
+__attribute__((target("avx2")))
+static void staticCorrectionsAVX2(float *data, const float *dark, const float *gain, const float *mask, long n){
+
+	const __m256 lo = _mm256_set1_ps(-32767.f);
+	const __m256 hi = _mm256_set1_ps(32767.f);
+	long i = 0;
+
+	for(; i+8<=n; i+=8) {
+		__m256 x = _mm256_loadu_ps(data+i);
+		if (DARK) {
+			x = _mm256_sub_ps(x, _mm256_loadu_ps(dark+i));
+			x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+		}
+		if (GAIN)
+			x = _mm256_mul_ps(x, _mm256_loadu_ps(gain+i));
+		if (MASK)
+			x = _mm256_mul_ps(x, _mm256_loadu_ps(mask+i));
+		_mm256_storeu_ps(data+i, x);
+	}
+	staticCorrectionsRange<DARK,GAIN,MASK>(data, dark, gain, mask, i, n);
+}
+#endif
+
+
+// Kernel tables indexed by the CORRECT_* stage flags
+#define STATIC_CORRECTION_KERNELS(k) { k<0,0,0>, k<1,0,0>, k<0,1,0>, k<1,1,0>, k<0,0,1>, k<1,0,1>, k<0,1,1>, k<1,1,1> }
+
+static const tStaticCorrectionKernel staticCorrectionsScalarTable[8] = STATIC_CORRECTION_KERNELS(staticCorrectionsScalar);
+#ifdef SIMD_HAVE_SSE2
+static const tStaticCorrectionKernel staticCorrectionsSSE2Table[8] = STATIC_CORRECTION_KERNELS(staticCorrectionsSSE2);
+#endif
+#ifdef SIMD_HAVE_AVX2
+static const tStaticCorrectionKernel staticCorrectionsAVX2Table[8] = STATIC_CORRECTION_KERNELS(staticCorrectionsAVX2);
+#endif
+
+
+/*
+ *	Find the best instruction set supported by both the compiler and the CPU we are running on
+ */
+int detectSIMD(void){
+
+#ifdef SIMD_HAVE_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return SIMD_AVX2;
+#endif
+#ifdef SIMD_HAVE_SSE2
+	return SIMD_SSE2;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+
+/*
+ *	Apply the requested static corrections (CORRECT_* flags) that are enabled in the ini file
+ *	Uses the tables built by cGlobal::createCalibrationTables()
+ */
+void applyStaticCorrections(tThreadInfo *threadInfo, cGlobal *global, int stages){
+
+	if (!global->useDarkcalSubtraction) stages &= ~CORRECT_DARKCAL;
+	if (!global->useGaincal) stages &= ~CORRECT_GAIN;
+	if (!global->useBadPixelMask) stages &= ~CORRECT_BADPIXEL;
+	if (stages == 0)
+		return;
+
+	tStaticCorrectionKernel kernel = staticCorrectionsScalarTable[stages];
+#ifdef SIMD_HAVE_SSE2
+	if (global->simdLevel == SIMD_SSE2)
+		kernel = staticCorrectionsSSE2Table[stages];
+#endif
+#ifdef SIMD_HAVE_AVX2
+	if (global->simdLevel == SIMD_AVX2)
+		kernel = staticCorrectionsAVX2Table[stages];
+#endif
+
+	kernel(threadInfo->corrected_data, global->darkcalOffset, global->gaincal, global->badpixelFactor, global->pix_nn);
+}
+
+
+/*
+ *	Attenuation correction
+ *	The product is formed in double precision and rounded back to float, as in the original loop
+ */
+static void attenuationScalar(float *data, double factor, long start, long end){
+	for(long i=start; i<end; i++)
+		data[i] *= factor;
+}
+
+#ifdef SIMD_HAVE_SSE2
+static void attenuationSSE2(float *data, double factor, long n){
+
+	const __m128d f = _mm_set1_pd(factor);
+	long i = 0;
+
+	for(; i+4<=n; i+=4) {
+		__m128 x = _mm_loadu_ps(data+i);
+		__m128 lo = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(x), f));
+		__m128 hi = _mm_cvtpd_ps(_mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(x, x)), f));
+		_mm_storeu_ps(data+i, _mm_movelh_ps(lo, hi));
+	}
+	attenuationScalar(data, factor, i, n);
+}
+#endif
+
+#ifdef SIMD_HAVE_AVX2
+__attribute__((target("avx2")))
+static void attenuationAVX2(float *data, double factor, long n){
+
+	const __m256d f = _mm256_set1_pd(factor);
+	long i = 0;
+
+	for(; i+8<=n; i+=8) {
+		__m256 x = _mm256_loadu_ps(data+i);
+		__m128 lo = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(x)), f));
+		__m128 hi = _mm256_cvtpd_ps(_mm256_mul_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(x, 1)), f));
+		_mm256_storeu_ps(data+i, _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1));
+	}
+	attenuationScalar(data, factor, i, n);
+}
+#endif
+
+void applyAttenuationCorrection(tThreadInfo *threadInfo, cGlobal *global){
+
+#ifdef SIMD_HAVE_AVX2
+	if (global->simdLevel == SIMD_AVX2) {
+		attenuationAVX2(threadInfo->corrected_data, threadInfo->attenuation, global->pix_nn);
+		return;
+	}
+#endif
+#ifdef SIMD_HAVE_SSE2
+	if (global->simdLevel == SIMD_SSE2) {
+		attenuationSSE2(threadInfo->corrected_data, threadInfo->attenuation, global->pix_nn);
+		return;
+	}
+#endif
+	attenuationScalar(threadInfo->corrected_data, threadInfo->attenuation, 0, global->pix_nn);
+}
@@ -0,0 +1,56 @@
+/*
+ *  calibration.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+ 
+#ifndef _calibration_h
+#define _calibration_h
+
+#include "setup.h"
+#include "worker.h"
+
+/*
+ *	Instruction sets used by the vectorised kernels (cGlobal::simdLevel)
+ */
+#define SIMD_NONE		0
+#define SIMD_SSE2		1
+#define SIMD_AVX2		2
+
+// SSE2 is part of the x86_64 baseline; AVX2 kernels are compiled with function target
+// attributes and selected at runtime, which needs gcc 4.9 or later
+#if defined(__SSE2__)
+#define SIMD_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(SIMD_HAVE_SSE2) && defined(__GNUC__) && !defined(__clang__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define SIMD_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+/*
+ *	Stages of applyStaticCorrections()
+ */
+#define CORRECT_DARKCAL		1
+#define CORRECT_GAIN		2
+#define CORRECT_BADPIXEL	4
+
+/*
+ *	Function prototypes
+ */
+int detectSIMD(void);
+void applyStaticCorrections(tThreadInfo*, cGlobal*, int);
+void applyAttenuationCorrection(tThreadInfo*, cGlobal*);
+
+#endif
@@ -57,7 +57,15 @@ using std::string;
 
 #include "setup.h"
 #include "worker.h"
+#include "threadpool.h"
 #include "attenuation.h"
+#include "geometry.h"
+#include "hdf5writer.h"
+#include "hitfinder.h"
+#include "framelog.h"
+#include "statistics.h"
+#include "xcca.h"
+#include "correlation.h"
 
 
 static cGlobal		global;
@@ -155,13 +163,22 @@ void beginjob() {
 	global.readDarkcal(global.darkcalFile);
 	global.readBadpixelMask(global.badpixelFile);
 	global.readGaincal(global.gaincalFile);
+	global.createCalibrationTables();
+	global.createAssemblyMap();
 	global.readPeakmask(global.hitfinder.peaksearchFile);
 	global.readIcemask(global.icefinder.peaksearchFile);
 	global.readWatermask(global.waterfinder.peaksearchFile);
 	global.readBackgroundmask(global.backgroundfinder.peaksearchFile);
+	prepareHitfinders(&global);
+	preparePrescreen(&global);
 	if (global.useAttenuationCorrection >= 0) global.readAttenuations(global.attenuationFile);
 	if (global.usePixelStatistics) global.readPixels(global.pixelFile);
-	if (global.useCorrelation) global.createLookupTable();	// <-- important that this is done after detector geometry is determined
+	if (global.useCorrelation) initPolarMap(&global);
+	if (global.useCorrelation == 2) createXCCAPlans(&global);
+	allocateFrameBuffers(&global);
+	startWriterThread(&global);
+	startFrameLog(&global);
+	startWorkerThreads(&global);
 }
 
 
@@ -449,24 +466,12 @@ void event() {
 	
 	
 	/*
-	 *	Energy calibration
-	 */
-	if (global.useEnergyCalibration && photonEnergyeV == photonEnergyeV) { // Check if photonEnergyeV is NAN
-		if (global.nEnergies >= global.energyCapacity) global.expandEnergyCapacity();
-		global.energies[global.nEnergies] = photonEnergyeV;
-		global.wavelengths[global.nEnergies++] = wavelengthA;
-		if (photonEnergyeV > global.Emax) global.Emax = photonEnergyeV;
-		if (photonEnergyeV < global.Emin) global.Emin = photonEnergyeV;
-		if (wavelengthA > global.Lmax) global.Lmax = wavelengthA;
-		if (wavelengthA < global.Lmin) global.Lmin = wavelengthA;
-	}
-	
-	
-	/*
-	 *	Create a new threadInfo structure in which to place all information
+	 *	Take a threadInfo structure from the frame buffer pool in which to place all information
+	 *	(waits for a worker to return one if all buffers are in use)
 	 */
 	tThreadInfo	*threadInfo;
-	threadInfo = (tThreadInfo*) malloc(sizeof(tThreadInfo));
+	threadInfo = getFrameBuffer(&global);
+	threadInfo->cspad_fail = 0;
 		
 	
 	/*
@@ -516,11 +521,6 @@ void event() {
 	
 	threadInfo->pGlobal = &global;
 	
-	for(int quadrant=0; quadrant<4; quadrant++) {
-		threadInfo->quad_data[quadrant] = (uint16_t*) calloc(ROWS*COLS*16, sizeof(uint16_t));
-		memset(threadInfo->quad_data[quadrant], 0, ROWS*COLS*16*sizeof(uint16_t));
-	}
-	
 	
 	/*
 	 *	Check if the list contains the event if the listfinder is enabled
@@ -532,7 +532,7 @@ void event() {
 	}
 	
 	/*
-	 *	Copy raw cspad image data into worker thread structure for processing
+	 *	Unpack raw cspad image data into worker thread structure for processing
 	 */
 	Pds::CsPad::ElementIterator iter;
 	fail=getCspadData(DetInfo::CxiDs1, iter);
@@ -563,23 +563,20 @@ void event() {
 			if(global.flushInterval != 0 && (global.nprocessedframes%global.flushInterval) == 0) {
 				cout << "Preparing for HDF5 memory flush..." << endl;
 				// Wait for threads to finish before flushing
-				while(global.nActiveThreads > 0) {
-					printf("\twaiting for %i worker threads to terminate\n", (int)global.nActiveThreads);
-					usleep(100000);
-				}
-				flushHDF5();
+				waitForWorkerThreads(&global);
+				waitForWriterThread(&global);
+				flushHDF5(&global);
 			}
 		}
 		
-		// cleanup allocated arrays
-		for(int quadrant=0; quadrant<4; quadrant++) 
-			free(threadInfo->quad_data[quadrant]);
-		free(threadInfo);
+		// return frame buffer to the pool
+		releaseFrameBuffer(threadInfo, &global);
 		
 		return;
 	} else {
 		nevents++;
 		const Pds::CsPad::ElementHeader* element;
+		unsigned	sectionsRead[4] = {0, 0, 0, 0};		// bit mask of the 2x1 sections received for each quadrant
 
 		// loop over elements (quadrants)
 		while(( element=iter.next() )) {  
@@ -599,50 +596,43 @@ void event() {
 				//threadInfo->quad_temperature[quadrant] = temperature;
 				
 				
-				// Read 2x1 "sections" into data array in DAQ format, i.e., 2x8 array of asics (two bytes / pixel)
+				// Read 2x1 "sections" straight into the raw data format (8*ROWS x 8*COLS floats)
+				// Each section column of 2*ROWS pixels is contiguous in both layouts, so only the row offset has to be computed
 				const Pds::CsPad::Section* s;
 				unsigned section_id;
 				while(( s=iter.next(section_id) )) {  
 					//printf("\tQuadrant %d, Section %d  { %04x %04x %04x %04x }\n", quadrant, section_id, s->pixel[0][0], s->pixel[0][1], s->pixel[0][2], s->pixel[0][3]);
-					memcpy(&threadInfo->quad_data[quadrant][section_id*2*ROWS*COLS],s->pixel[0],2*ROWS*COLS*sizeof(uint16_t));
+					float *section = &threadInfo->corrected_data[quadrant*2*ROWS + section_id*COLS*8*ROWS];
+					for(unsigned col=0; col<COLS; col++) {
+						const uint16_t *in = s->pixel[col];
+						float *out = &section[col*8*ROWS];
+						for(unsigned row=0; row<2*ROWS; row++) 
+							out[row] = (float) in[row];
+					}
+					sectionsRead[quadrant] |= 1 << section_id;
 				}
 			}
 		}
+		
+		// Sections that were not read out have to be zero (frame buffers are recycled from previous frames)
+		for(int quadrant=0; quadrant<4; quadrant++) {
+			for(unsigned section_id=0; section_id<8; section_id++) {
+				if (sectionsRead[quadrant] & (1 << section_id)) continue;
+				float *section = &threadInfo->corrected_data[quadrant*2*ROWS + section_id*COLS*8*ROWS];
+				for(unsigned col=0; col<COLS; col++) 
+					memset(&section[col*8*ROWS], 0, 2*ROWS*sizeof(float));
+			}
+		}
 	}//if (fail)
 	
 	
 	
 	/*
-	 *	Spawn worker thread to process this frame
-	 *	Threads are created detached so we don't have to wait for anything to happen before returning
-	 *		(each thread is responsible for cleaning up its own threadInfo structure when done)
+	 *	Hand this frame over to the worker thread pool
+	 *	Blocks while the job queue is full, so we never get more than nThreads frames ahead of the workers
+	 *		(the worker is responsible for cleaning up the threadInfo structure when done)
 	 */
-	pthread_t		thread;
-	pthread_attr_t	threadAttribute;
-	int				returnStatus;
-	
-
-	// Avoid fork-bombing the system: wait until we have a spare thread in the thread pool
-	while(global.nActiveThreads >= global.nThreads) {
-		usleep(100);
-	}
-	
-	
-	// Increment threadpool counter
-	pthread_mutex_lock(&global.nActiveThreads_mutex);
-	global.nActiveThreads += 1;
-	threadInfo->threadNum = ++global.threadCounter;
-	pthread_mutex_unlock(&global.nActiveThreads_mutex);
-	
-	// Set detached state
-	pthread_attr_init(&threadAttribute);
-	//pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_JOINABLE);
-	pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_DETACHED);
-	
-	// Create a new worker thread for this data frame
-	returnStatus = pthread_create(&thread, &threadAttribute, worker, (void *)threadInfo); 
-	pthread_attr_destroy(&threadAttribute);
-	//pthread_detach(thread);
+	queueWorkerJob(threadInfo, &global);
 	global.nprocessedframes += 1;
 	
 	
@@ -661,11 +651,9 @@ void event() {
 	if(global.flushInterval != 0 && (global.nprocessedframes%global.flushInterval) == 0) {
 		cout << "Preparing for HDF5 memory flush..." << endl;
 		// Wait for threads to finish before flushing
-		while(global.nActiveThreads > 0) {
-			printf("\twaiting for %i worker threads to terminate\n", (int)global.nActiveThreads);
-			usleep(100000);
-		}
-		flushHDF5();
+		waitForWorkerThreads(&global);
+		waitForWriterThread(&global);
+		flushHDF5(&global);
 	}
 	
 }
@@ -691,11 +679,20 @@ void endjob()
 	printf("User analysis endjob() routine called.\n");
 
 
-	// Wait for threads to finish
-	while(global.nActiveThreads > 0) {
-		printf("Waiting for %i worker threads to terminate\n", (int)global.nActiveThreads);
-		usleep(100000);
-	}
+	// Wait for threads to finish and shut down the worker thread pool
+	stopWorkerThreads(&global);
+	stopFrameLog(&global);
+	stopWriterThread(&global);
+	freeFrameBuffers(&global);
+	closeHDF5RunFile(&global);
+	free(global.hdf5RunFile);
+	printHDF5Statistics(&global);
+	
+	
+	// Collect the powder sums of all worker threads (and correlate the frames still waiting in a batch)
+	flushCorrelationBatches(&global);
+	mergePowders(&global);
+	freeWorkerData(&global);
 	
 	
 	// Calculate center correction from regular powder pattern
@@ -769,6 +766,10 @@ void endjob()
 	
 	// Hitrate?
 	printf("%i files processed, %i hits (%2.2f%%)\n",(int)global.nprocessedframes, (int)global.nhits, 100.*( global.nhits / (float) global.nprocessedframes));
+	if (global.prescreen && global.nPrescreenChecked) 
+		printf("%i frames rejected by the pre-screen, %i of %i checked were hits (%2.2f%% missed)\n", (int)global.nPrescreenRejected, (int)global.nPrescreenMissed, (int)global.nPrescreenChecked, 100.*( global.nPrescreenMissed / (float) global.nPrescreenChecked));
+	else if (global.prescreen)
+		printf("%i frames rejected by the pre-screen, none checked\n", (int)global.nPrescreenRejected);
 
 	
 	// Cleanup
@@ -778,16 +779,16 @@ void endjob()
 	free(global.powderAssembled);
 	free(global.powderRaw);
 	free(global.powderAverage);
-	free(global.powderCorrelation);
+	freeCorrelationSum(global.powderCorrelation);
 	free(global.powderVariance);
 	free(global.iceAssembled);
 	free(global.iceRaw);
 	free(global.iceAverage);
-	free(global.iceCorrelation);
+	freeCorrelationSum(global.iceCorrelation);
 	free(global.waterAssembled);
 	free(global.waterRaw);
 	free(global.waterAverage);
-	free(global.waterCorrelation);
+	freeCorrelationSum(global.waterCorrelation);
 	free(global.pix_x);
 	free(global.pix_y);
 	free(global.pix_z);
@@ -795,13 +796,33 @@ void endjob()
 	free(global.quad_dx);
 	free(global.quad_dy);
 	free(global.hotpixelmask);
-	free(global.selfdark);
+	if (global.useAutoHotpixel)
+		freeSnapshot(&global.hotpixelSnapshot);
+	if (global.useSubtractPersistentBackground)
+		freeSnapshot(&global.selfdarkSnapshot);
+	if (global.usePolarizationCorrection || global.useSolidAngleCorrection || global.useCorrelation)
+		freeGeometryCache(&global);
 	free(global.gaincal);
 	free(global.badpixelmask);
+	free(global.darkcalOffset);
+	free(global.badpixelFactor);
+	free(global.assemblyStart);
+	free(global.assemblySource);
+	free(global.assemblyWeight);
 	free(global.hitfinder.peakmask);
 	free(global.icefinder.peakmask);
 	free(global.waterfinder.peakmask);
 	free(global.backgroundfinder.peakmask);
+	free(global.hitfinder.peakmaskBits);
+	free(global.icefinder.peakmaskBits);
+	free(global.waterfinder.peakmaskBits);
+	free(global.backgroundfinder.peakmaskBits);
+	free(global.listfinder.peakmaskBits);
+	freeStatistics(&global);
+	destroyXCCAPlans(&global);
+	if (global.useCorrelation) freePolarMap(&global);
+	free(global.prescreenPixels);
+	free(global.prescreenThreshold);
 	
 	delete[] global.filterThicknesses;
 	delete[] global.possibleThicknesses;
@@ -809,34 +830,26 @@ void endjob()
 	delete[] global.attenuations;
 	delete[] global.changedAttenuationEvents;
 	delete[] global.totalThicknesses;
-	delete[] global.energies;
-	delete[] global.intensities;
-	delete[] global.hits;
 	delete[] global.pixels;
 	delete[] global.pixelXYList;	
-	delete[] global.wavelengths;
 	delete[] global.phi;
 	delete[] global.angularAvg_i;
 	delete[] global.angularAvgQ;
 	delete[] global.angularAvgQcal;
-	delete[] global.correlationLUT;
 	
 	pthread_mutex_destroy(&global.nActiveThreads_mutex);
 	pthread_mutex_destroy(&global.powdersumraw_mutex);
 	pthread_mutex_destroy(&global.powdersumassembled_mutex);
-	pthread_mutex_destroy(&global.powdersumcorrelation_mutex);
 	pthread_mutex_destroy(&global.powdersumvariance_mutex);
 	pthread_mutex_destroy(&global.icesumraw_mutex);
 	pthread_mutex_destroy(&global.icesumassembled_mutex);
-	pthread_mutex_destroy(&global.icesumcorrelation_mutex);
 	pthread_mutex_destroy(&global.watersumraw_mutex);
 	pthread_mutex_destroy(&global.watersumassembled_mutex);
-	pthread_mutex_destroy(&global.watersumcorrelation_mutex);
 	pthread_mutex_destroy(&global.correlation_mutex);
 	pthread_mutex_destroy(&global.correlationFFT_mutex);
 	pthread_mutex_destroy(&global.pixelcenter_mutex);
+	pthread_mutex_destroy(&global.geometry_mutex);
 	pthread_mutex_destroy(&global.image_mutex);	
-	pthread_mutex_destroy(&global.intensities_mutex);
 	pthread_mutex_destroy(&global.selfdark_mutex);
 	pthread_mutex_destroy(&global.hotpixel_mutex);
 	pthread_mutex_destroy(&global.nhits_mutex);
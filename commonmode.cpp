@@ -26,6 +26,7 @@
 #include <hdf5.h>
 #include <cmath>
 #include <iostream>
+#include <algorithm>
 using std::cout;
 using std::endl;
 using std::cerr;
@@ -35,237 +36,309 @@ using std::cerr;
 #include "peakdetect.h"
 #include "point.h"
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 
 /*
- *	Subtract common mode on each 2x1 module
+ *	Size of the full (debug) histograms saved by cmSaveHistograms
  */
-void cmModuleSubtract(tThreadInfo *threadInfo, cGlobal *global){
+static const int	cmHistOffset = 65535;
+static const long	cmHistLength = 65536+cmHistOffset;
 
-	DEBUGL2_ONLY printf("cmModuleSubtract\n");
+
+/*
+ *	Scratch space used for one ASIC (or sub-module) at a time.
+ *	Each thread allocates its own on first use and keeps it for the following frames, 
+ *	so that no memory is allocated or zeroed per frame beyond what fits in the cache.
+ */
+typedef struct {
+	float		*values;		// copy of the pixel values, reordered by the quantile selection
+	uint16_t	*hist;			// histogram over cmStart..cmStop
+	int			*histX;			// ADU value of each bin in hist
+	long		nhist;
+	int			histStart;
+} tCommonModeScratch;
+
+static __thread tCommonModeScratch *cmScratch = NULL;
+
+static tCommonModeScratch *getCommonModeScratch(int start, int stop){
 	
-	long		e;
-	long		counter;
-//	uint16_t	value;
-	long		median;
-	char		filename[1024];
+	if (cmScratch == NULL) {
+		cmScratch = (tCommonModeScratch*) calloc(1, sizeof(tCommonModeScratch));
+		cmScratch->values = (float*) calloc(ROWS*COLS, sizeof(float));
+	}
 	
-	// Create histogram array
-	int			noffset = 65535;
-	long		nhist = 65536+noffset;
-	uint16_t	*histograms;
-	//histogram = (uint16_t*) calloc(nhist, sizeof(uint16_t));
-	histograms = (uint16_t*) calloc(64*nhist, sizeof(uint16_t)); //histograms = (uint16_t*) calloc(32*nhist, sizeof(uint16_t));
+	long nhist = stop-start+1;
+	if (nhist > 0 && (cmScratch->nhist != nhist || cmScratch->histStart != start)) {
+		free(cmScratch->hist);
+		free(cmScratch->histX);
+		cmScratch->hist = (uint16_t*) calloc(nhist, sizeof(uint16_t));
+		cmScratch->histX = (int*) calloc(nhist, sizeof(int));
+		for (long i=0; i<nhist; i++)
+			cmScratch->histX[i] = start+i;
+		cmScratch->nhist = nhist;
+		cmScratch->histStart = start;
+	}
+	return cmScratch;
+}
+
+
+/*
+ *	Value of the (threshold+1)-th smallest pixel, rounded to whole ADUs.
+ *	This is the first histogram bin at which the cumulative count exceeds threshold, found 
+ *	in O(n) with a selection algorithm instead of a scan over a 131071-bin histogram.
+ *	Returns 0 and leaves quantile unchanged if there are not enough pixels.
+ *	Reorders values.
+ */
+static int cmQuantile(float *values, long n, float threshold, long *quantile){
 	
-	// Peak detection parameters
+	long k = 0;
+	if (threshold > 0)
+		k = (long) floor(threshold);
+	if (k >= n)
+		return 0;
+	
+	std::nth_element(values, values+k, values+n);
+	*quantile = (long) round(values[k]);
+	return 1;
+}
+
+
+/*
+ *	Record the median in the first empty marker bin of a saved histogram 
+ */
+static void cmMarkHistogram(uint16_t *histogram, long bin){
+	
+	if (histogram[0] == 0) histogram[0] = bin;
+	else {
+		cout << "1st element of histogram non-zero! Save median to 11th element." << endl;
+		if (histogram[10] == 0) histogram[10] = bin;
+		else {
+			cout << "11th element of histogram non-zero! Save median to 101st element." << endl;
+			if (histogram[100] == 0) histogram[100] = bin;
+			else cout << "101st element of histogram non-zero! Aborting save of median..." << endl;
+		}
+	}
+}
+
+
+/*
+ *	Common mode of one ASIC from the zero-photon peak of its intensity histogram (algorithm 1)
+ *	Only the cmStart..cmStop window that the peak finder looks at is histogrammed
+ */
+static void cmModulePeak(tThreadInfo *threadInfo, cGlobal *global, long mi, long mj, uint16_t *histogram){
+	
+	long		e;
 	int			peakfinderStart = global->cmStart;
 	int			peakfinderStop = global->cmStop;
 	float		peakfinderDelta = global->cmDelta;
 	int			nPeakfinder = peakfinderStop-peakfinderStart+1;
+	float		*data = threadInfo->corrected_data;
 	
-	// Loop over each ASIC (8x8 array)
-	for(long mi=0; mi<8; mi++){ //for(long mi=0; mi<4; mi++){
-		for(long mj=0; mj<8; mj++){
-
-			// Zero histogram
-			//memset(histogram, 0, nhist*sizeof(uint16_t));
-			
-			// Loop over pixels within an ASIC
-			for(int i=0; i<ROWS; i++){ //for(long i=0; i<2*ROWS; i++){
-				for(int j=0; j<COLS; j++){
-					e = (j + mj*COLS) * (8*ROWS);
-					e += i + mi*ROWS; //e += i + mi*2*ROWS;
-					//histogram[int(round(threadInfo->corrected_data[e])+noffset)] += 1;
-					histograms[int(round(threadInfo->corrected_data[e])+noffset)+mj*nhist+mi*8*nhist]++;
-				}
-			}
-			
-			if (global->cmModule == 1) {
-				// NEW COMMON-MODE ALGORITHM BASED ON PEAK DETECTION
-				if (peakfinderStart < peakfinderStop && noffset+peakfinderStart >= 0 && noffset+peakfinderStop < nhist && peakfinderDelta > 0) { // sanity check
-					uint16_t *peakfinderHist = (uint16_t*) calloc(nPeakfinder, sizeof(uint16_t));
-					int *peakfinderHistX = (int*) calloc(nPeakfinder, sizeof(int));
-					for (long i=0; i<nPeakfinder; i++) {
-						peakfinderHist[i] = histograms[i+noffset+peakfinderStart+mj*nhist+mi*8*nhist];
-						peakfinderHistX[i] = peakfinderStart+i;
-					}
-					
-					PeakDetect peakfinder(peakfinderHistX, peakfinderHist, nPeakfinder);
-					peakfinder.findAll(peakfinderDelta);
-					
-					Point *min, *max;
-					if (peakfinder.maxima->size() > 0) {
-						for (int k=0; k<peakfinder.maxima->size(); k++) {
-							min = peakfinder.minima->get(k);
-							max = peakfinder.maxima->get(k);
-							DEBUGL2_ONLY cout << "max->getX()-min->getX() = " << max->getX()-min->getX() << ", max->getY()-peakfinderHist[max->getX()-peakfinderStart-1] = " << max->getY()-peakfinderHist[max->getX()-peakfinderStart-1] << ", max->getY()-peakfinderHist[max->getX()-peakfinderStart+1] = " << max->getY()-peakfinderHist[max->getX()-peakfinderStart+1] << endl;
-							if (max->getX()-min->getX() > 4) { //if (max->getX()-min->getX() > 2 && max->getY()-peakfinderHist[max->getX()-peakfinderStart-1] < peakfinderDelta && max->getY()-peakfinderHist[max->getX()-peakfinderStart+1] < peakfinderDelta) {
-								int commonmode = max->getX();
-								for (int i=0; i<ROWS; i++) { //for (int i=0; i<2*ROWS; i++) {
-									for (int j=0; j<COLS; j++) {
-										e = (j + mj*COLS) * (8*ROWS);
-										e += i + mi*ROWS; //e += i + mi*2*ROWS;
-										threadInfo->corrected_data[e] -= commonmode;
-									}
-								}
-								DEBUGL1_ONLY printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
-								DEBUGL1_ONLY cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): " << commonmode << endl; //DEBUGL1_ONLY cout << "Commonmode (Q" << mi << ", S" << mj << "): " << commonmode << endl;
-								break;
-							} else if (k == peakfinder.maxima->size()-1) {
-								// June data
-								//cout << "Commonmode (Q" << mi << ", S" << mj << "): N/A" << endl;
-								// Feb data (ASICs missing)
-								if ((mi != 0 || mj != 5) && (mi != 1 || mj != 5) && (mi != 5 || mj != 3) && (mi != 6 || mj != 4) && (mi != 7 || mj != 4) && (mi != 6 || mj != 6) && (mi != 7 || mj != 6)) { //if ((mi != 0 || mj != 5) && (mi != 3 || mj != 4) && (mi != 3 || mj != 6)) {
-									printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
-									cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): N/A" << endl; //cout << "Commonmode (Q" << mi << ", S" << mj << "): N/A" << endl;
-								}
-							}
-						}
-					} else {
-						printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
-						cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): N/A (no maxima)" << endl; //cout << "Commonmode (Q" << mi << ", S" << mj << "): N/A (no maxima)" << endl;
-					}
-					
-					free(peakfinderHist);
-					free(peakfinderHistX);
-					
-				} else {
-					cerr << "ERROR in cmModuleSubtract: Input parameters are out of range." << endl;
-					cout << "\tpeakfinderStart: " << peakfinderStart << endl;
-					cout << "\tpeakfinderStop: " << peakfinderStop << endl;
-					cout << "\tpeakfinderDelta: " << peakfinderDelta << endl;
-				}				
-			} else if (global->cmModule == 2) {
-			// OLD COMMON-MODE ALGORITHM BASED ON MEDIAN
-				// Find median value
-				counter = 0;
-				for(long i=0; i<nhist; i++){
-					//counter += histogram[i];
-					counter += histograms[i+mj*nhist+mi*8*nhist];
-					if(counter > (global->cmFloor*ROWS*COLS)) { //if(counter > (global->cmFloor*2*ROWS*COLS)) {
-						median = i-noffset;
-						
-						if (global->cmSaveHistograms) {
-							if (histograms[mj*nhist+mi*8*nhist] == 0) histograms[mj*nhist+mi*8*nhist] = i;
-							else {
-								cout << "1st element of histogram non-zero! Save median to 11th element." << endl;
-								if (histograms[10+mj*nhist+mi*8*nhist] == 0) histograms[10+mj*nhist+mi*8*nhist] = i;
-								else {
-									cout << "11th element of histogram non-zero! Save median to 101st element." << endl;
-									if (histograms[100+mj*nhist+mi*8*nhist] == 0) histograms[100+mj*nhist+mi*8*nhist] = i;
-									else cout << "101st element of histogram non-zero! Aborting save of median..." << endl;
-								}							
-							}
-						}
-						
-						break;
-					}
-					
+	tCommonModeScratch *scratch = getCommonModeScratch(peakfinderStart, peakfinderStop);
+	uint16_t	*peakfinderHist = scratch->hist;
+	memset(peakfinderHist, 0, nPeakfinder*sizeof(uint16_t));
+	
+	// Histogram pixels within the peak finder window, count the ones that fall outside
+	long		underflow = 0;
+	long		overflow = 0;
+	for(long j=0; j<COLS; j++){
+		e = (j + mj*COLS) * (8*ROWS) + mi*ROWS;
+		for(long i=0; i<ROWS; i++){
+			int value = int(round(data[e+i]));
+			if (value < peakfinderStart)
+				underflow++;
+			else if (value > peakfinderStop)
+				overflow++;
+			else
+				peakfinderHist[value-peakfinderStart]++;
+			if (histogram && value+cmHistOffset >= 0 && value+cmHistOffset < cmHistLength)
+				histogram[value+cmHistOffset]++;
+		}
+	}
+	DEBUGL2_ONLY printf("r%04u:%i Commonmode (Q%li, S%li): %li pixels below cmStart, %li pixels above cmStop\n", (int)threadInfo->runNumber, (int)threadInfo->threadNum, mi/2, mi%2+2*mj, underflow, overflow);
+	
+	PeakDetect peakfinder(scratch->histX, peakfinderHist, nPeakfinder);
+	peakfinder.findAll(peakfinderDelta);
+	
+	Point *min, *max;
+	if (peakfinder.maxima->size() > 0) {
+		for (int k=0; k<peakfinder.maxima->size(); k++) {
+			min = peakfinder.minima->get(k);
+			max = peakfinder.maxima->get(k);
+			DEBUGL2_ONLY cout << "max->getX()-min->getX() = " << max->getX()-min->getX() << ", max->getY()-peakfinderHist[max->getX()-peakfinderStart-1] = " << max->getY()-peakfinderHist[max->getX()-peakfinderStart-1] << ", max->getY()-peakfinderHist[max->getX()-peakfinderStart+1] = " << max->getY()-peakfinderHist[max->getX()-peakfinderStart+1] << endl;
+			if (max->getX()-min->getX() > 4) {
+				int commonmode = max->getX();
+				for (long j=0; j<COLS; j++) {
+					e = (j + mj*COLS) * (8*ROWS) + mi*ROWS;
+					for (long i=0; i<ROWS; i++)
+						data[e+i] -= commonmode;
 				}
-				
-				
-				// Ignore common mode for ASICs without wires (only Feb run)
-				if ((mi == 1 && mj == 6) || (mi == 2 && mj == 5) || (mi == 3 && mj == 5) || (mi == 4 && mj == 5) || (mi == 4 && mj == 6)) {
-					median = 0;
+				DEBUGL1_ONLY printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
+				DEBUGL1_ONLY cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): " << commonmode << endl;
+				break;
+			} else if (k == peakfinder.maxima->size()-1) {
+				// Feb data (ASICs missing)
+				if ((mi != 0 || mj != 5) && (mi != 1 || mj != 5) && (mi != 5 || mj != 3) && (mi != 6 || mj != 4) && (mi != 7 || mj != 4) && (mi != 6 || mj != 6) && (mi != 7 || mj != 6)) {
+					printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
+					cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): N/A" << endl;
 				}
-				
-				// Subtract median value
-				for(long i=0; i<ROWS; i++){ //for(long i=0; i<2*ROWS; i++){
-					for(long j=0; j<COLS; j++){
-						e = (j + mj*COLS) * (8*ROWS);
-						e += i + mi*ROWS; //e += i + mi*2*ROWS;
-						threadInfo->corrected_data[e] -= median;
-					}
-				}
-			} else {
-				cerr << "WARNING in cmModuleSubtract: No such common-mode algorithm exists, common-mode correction disabled." << endl;
 			}
 		}
+	} else {
+		printf("r%04u:%i ", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
+		cout << "Commonmode (Q" << mi/2 << ", S" << mi%2+2*mj << "): N/A (no maxima)" << endl;
+	}
+}
+
+
+/*
+ *	Common mode of one ASIC from the cmFloor-weighted median (algorithm 2)
+ */
+static void cmModuleMedian(tThreadInfo *threadInfo, cGlobal *global, long mi, long mj, uint16_t *histogram){
+	
+	long		e;
+	long		n = 0;
+	long		median = 0;
+	float		*data = threadInfo->corrected_data;
+	float		*values = getCommonModeScratch(global->cmStart, global->cmStop)->values;
+	
+	for(long j=0; j<COLS; j++){
+		e = (j + mj*COLS) * (8*ROWS) + mi*ROWS;
+		for(long i=0; i<ROWS; i++)
+			values[n++] = data[e+i];
+	}
+	
+	// Full histogram only when it is saved for inspection
+	if (histogram) {
+		for(long i=0; i<n; i++) {
+			int value = int(round(values[i]));
+			if (value+cmHistOffset >= 0 && value+cmHistOffset < cmHistLength)
+				histogram[value+cmHistOffset]++;
+		}
+	}
+	
+	if (cmQuantile(values, n, global->cmFloor*ROWS*COLS, &median) && histogram)
+		cmMarkHistogram(histogram, median+cmHistOffset);
+	
+	// Ignore common mode for ASICs without wires (only Feb run)
+	if ((mi == 1 && mj == 6) || (mi == 2 && mj == 5) || (mi == 3 && mj == 5) || (mi == 4 && mj == 5) || (mi == 4 && mj == 6)) {
+		median = 0;
+	}
+	
+	// Subtract median value
+	for(long j=0; j<COLS; j++){
+		e = (j + mj*COLS) * (8*ROWS) + mi*ROWS;
+		for(long i=0; i<ROWS; i++)
+			data[e+i] -= median;
+	}
+}
+
+
+/*
+ *	Subtract common mode on each 2x1 module
+ *	The 64 ASICs are independent and are spread over cmThreads cores when OpenMP is available
+ */
+void cmModuleSubtract(tThreadInfo *threadInfo, cGlobal *global){
+
+	DEBUGL2_ONLY printf("cmModuleSubtract\n");
+	
+	char		filename[1024];
+	
+	if (global->cmModule == 1) {
+		if (!(global->cmStart < global->cmStop && cmHistOffset+global->cmStart >= 0 && cmHistOffset+global->cmStop < cmHistLength && global->cmDelta > 0)) { // sanity check
+			cerr << "ERROR in cmModuleSubtract: Input parameters are out of range." << endl;
+			cout << "\tpeakfinderStart: " << global->cmStart << endl;
+			cout << "\tpeakfinderStop: " << global->cmStop << endl;
+			cout << "\tpeakfinderDelta: " << global->cmDelta << endl;
+			return;
+		}
+	} else if (global->cmModule != 2) {
+		cerr << "WARNING in cmModuleSubtract: No such common-mode algorithm exists, common-mode correction disabled." << endl;
+		return;
+	}
+	
+	// Full histograms, one row per ASIC sorted by quad
+	uint16_t	*histograms = NULL;
+	if (global->cmSaveHistograms)
+		histograms = (uint16_t*) calloc(64*cmHistLength, sizeof(uint16_t));
+	
+	// Loop over each ASIC (8x8 array)
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(global->cmThreads) if(global->cmThreads > 1) schedule(dynamic)
+#endif
+	for(long asic=0; asic<64; asic++){
+		long mi = asic/8;
+		long mj = asic%8;
+		uint16_t *histogram = histograms ? histograms+asic*cmHistLength : NULL;
+		
+		if (global->cmModule == 1)
+			cmModulePeak(threadInfo, global, mi, mj, histogram);
+		else
+			cmModuleMedian(threadInfo, global, mi, mj, histogram);
 	}
 	
-	//free(histogram);
 	if (global->cmSaveHistograms) {
 		sprintf(filename,"%s-hist.h5",threadInfo->eventname);
-		//writeSimpleHDF5(filename, histograms, (int)nhist, 8, 4, H5T_STD_U16LE);
-		// save as 2D array with each ASIC sorted by quad
-		writeSimpleHDF5(filename, histograms, (int)nhist, 64, H5T_STD_U16LE); //writeSimpleHDF5(filename, histograms, (int)nhist, 32, H5T_STD_U16LE);
+		writeSimpleHDF5(filename, histograms, (int)cmHistLength, 64, H5T_STD_U16LE);
+		free(histograms);
 	}
-	free(histograms);
 }
 
+
 /*
  *	Subtract common mode on each module
- *	This is done in a very slow way now - speed up later once we know it works!
+ *	Each ASIC is cut into cmSubModule x cmSubModule regions, each with its own cmFloor-weighted median
  */
 void cmSubModuleSubtract(tThreadInfo *threadInfo, cGlobal *global){
 	
 	// ROWS = 194;
 	// COLS = 185;
 	
-	long		e;
-	long		ii,jj;
-	long		counter;
-//	uint16_t	value;
-	uint16_t	median;
-	
-	// Create histogram array
-	int			nhist = 131071;
-	uint16_t	*histogram;
-	histogram = (uint16_t*) calloc(nhist, sizeof(uint16_t));
-	
 	// Subunits
 	long		nn = global->cmSubModule;		// Multiple of 2 please!
 	if (nn == 1 || nn % 2) {
 		cout << "subtractCMSubModule must be a multiple of 2, aborting common-mode correction." << endl;
 		return;
 	}
+	float		threshold = global->cmFloor*ROWS*COLS/(nn*nn);
+	float		*data = threadInfo->corrected_data;
 	
 	// Loop over whole modules (8x8 array)
-	for(long mi=0; mi<8; mi++){
-		for(long mj=0; mj<8; mj++){
-			
-			
-			// Loop over sub-modules
-			for(long smi=0; smi<ROWS; smi+=ROWS/nn){
-				for(long smj=0; smj<COLS; smj+=COLS/nn){
-				
-					// Zero histogram
-					memset(histogram, 0, nhist*sizeof(uint16_t));
+#ifdef _OPENMP
+	#pragma omp parallel for num_threads(global->cmThreads) if(global->cmThreads > 1) schedule(dynamic)
+#endif
+	for(long asic=0; asic<64; asic++){
+		long mi = asic/8;
+		long mj = asic%8;
+		long e, n;
+		long median = 0;
+		float *values = getCommonModeScratch(global->cmStart, global->cmStop)->values;
+		
+		// Loop over sub-modules
+		for(long smi=0; smi<ROWS; smi+=ROWS/nn){
+			for(long smj=0; smj<COLS; smj+=COLS/nn){
 				
+				// Gather pixels within this subregion
+				n = 0;
+				for(long j=0; j<COLS/nn && (j+smj)<COLS; j++){
+					e = (smj + j + mj*COLS)*8*ROWS + smi + mi*ROWS;
+					for(long i=0; i<ROWS/nn && (i+smi)<ROWS; i++)
+						values[n++] = data[e+i];
+				}
 				
-					// Loop over pixels within this subregion
-					for(long i=0; i<ROWS/nn && (i+smi)<ROWS; i++){
-						for(long j=0; j<COLS/nn && (j+smj)<COLS; j++){
-							jj = smj + j + mj*COLS;
-							ii = smi + i + mi*ROWS;
-							e = ii + jj*8*ROWS;
-							histogram[int(round(threadInfo->corrected_data[e]))+65535] += 1;
-						}
-					}
-					
-					// Find median value
-					counter = 0;
-					for(long i=0; i<nhist; i++){
-						counter += histogram[i];
-						if(counter > (global->cmFloor*ROWS*COLS/(nn*nn))) {
-							median = i-65535;
-							break;
-						}
-					}
+				// Regions at the edge of the ASIC that are too small keep the median of the previous region
+				cmQuantile(values, n, threshold, &median);
 				
-					// Subtract median value
-					for(long i=0; i<ROWS/nn && (i+smi)<ROWS; i++){
-						for(long j=0; j<COLS/nn && (j+smj)<COLS; j++){
-							jj = smj + j + mj*COLS;
-							ii = smi + i + mi*ROWS;
-							e = ii + jj*8*ROWS;
-							threadInfo->corrected_data[e] -= median;
-						}
-					}
+				// Subtract median value
+				for(long j=0; j<COLS/nn && (j+smj)<COLS; j++){
+					e = (smj + j + mj*COLS)*8*ROWS + smi + mi*ROWS;
+					for(long i=0; i<ROWS/nn && (i+smi)<ROWS; i++)
+						data[e+i] -= median;
 				}
 			}
 		}
 	}
-	free(histogram);
 }
-
-
@@ -29,157 +29,156 @@ using std::endl;
 using std::string;
 
 #include <cmath>
+#include <string.h>
 
 #include "correlation.h"
+#include "hdf5writer.h"
 
 
 #ifdef CORRELATION_ENABLED
 	#include "arrayclasses.h"
 	#include "arraydataIO.h"
 
-	//----------------------------------------------------------correlate
-	// apply angular cross correlation
+	//----------------------------------------------------------writeTiff
+	// write nRows x nCols values to a scaled tiff image
 	//-------------------------------------------------------------------
-	void correlate(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+	static void writeTiff(string filename, const double *data, int nRows, int nCols) {
 		
-		DEBUGL1_ONLY cout << "CORRELATING... in thread #" << threadInfo->threadNum << "." << endl;
-
-		//prepare some things for output
 		arraydataIO *io = new arraydataIO;
-		std::ostringstream osst;
-		osst << threadInfo->eventname;
-		string eventname_str = osst.str();
+		array2D<double> *image = new array2D<double>(nRows, nCols);
+		for (int i=0; i < nRows; i++) {
+			for (int j=0; j < nCols; j++) {
+				image->set(i, j, data[i*nCols + j]);
+			}
+		}
+		io->writeToTiff( filename, image, 1 );			// 0: unscaled, 1: scaled
+		delete image;
+		delete io;
+	}
+
+
+	//----------------------------------------------------------saveShot
+	// write the correlation of one shot, if hits are saved to disk
+	//-------------------------------------------------------------------
+	static void saveShot(cGlobal *global, tXCCAWork *work, double *correlation, char *eventname, cHit *hit) {
 		
-		//create cross correlator object that takes care of the computations
-		//the arguments that are passed to the constructor determine 2D/3D calculations with/without mask
-		CrossCorrelator *cc = NULL;
-		if (global->autoCorrelateOnly) {
-			if (global->correlationQScale == 1) {
-				cc = new CrossCorrelator( //auto-correlation 2D case, no mask, r pixel map [pixels]
-										 threadInfo->corrected_data, global->pix_x, global->pix_y, RAW_DATA_LENGTH, 
-										 global->correlationNumPhi, global->correlationNumQ );
-				
-			} else {
-				cc = new CrossCorrelator( //auto-correlation 2D case, no mask, q pixel map [Å-1]
-										 threadInfo->corrected_data, threadInfo->pix_qx, threadInfo->pix_qy, RAW_DATA_LENGTH, 
-										 global->correlationNumPhi, global->correlationNumQ );
+		string eventname_str = eventname;
+		
+		// check if hits should be saved to disk
+		if (global->hdf5dump || global->generateDarkcal
+							 || (hit->standard && global->hitfinder.savehits) 
+							 || (hit->water && global->waterfinder.savehits) 
+							 || (hit->ice && global->icefinder.savehits) 
+							 || (!hit->background && global->backgroundfinder.savehits) ) {
+			//HDF5 output
+			if (global->correlationOutput % 2){
+				if (global->autoCorrelateOnly){
+					writeSimpleHDF5( (eventname_str+"-xaca.h5").c_str(), correlation, global->correlationNumDelta, global->correlationNumQ, H5T_NATIVE_DOUBLE );
+				}else{
+					writeSimpleHDF5( (eventname_str+"-xcca.h5").c_str(), correlation, global->correlationNumDelta, global->correlationNumQ, global->correlationNumQ, H5T_NATIVE_DOUBLE );
+				}
 			}
-		} else {
-			if (global->correlationQScale == 1) {
-				cc = new CrossCorrelator( //full cross-correlation 3D case, no mask, r pixel map [pixels]
-										 threadInfo->corrected_data, global->pix_x, global->pix_y, RAW_DATA_LENGTH, 
-										 global->correlationNumQ, global->correlationNumQ, global->correlationNumPhi );	
-			} else {
-				cc = new CrossCorrelator( //full cross-correlation 3D case, no mask, q pixel map [Å-1]
-										 threadInfo->corrected_data, threadInfo->pix_qx, threadInfo->pix_qy, RAW_DATA_LENGTH, 
-										 global->correlationNumQ, global->correlationNumQ, global->correlationNumPhi );	
+			//bin output
+			if (global->correlationOutput % 4 > 1){
+				//writeSAXS(global, work, eventname);			// writes SAXS to binary
+				writeXCCA(global, work, correlation, eventname); 			// writes XCCA+SAXS to binary
+			}
+			//TIFF image output
+			if (global->correlationOutput > 3){
+				writeTiff( eventname_str+"-polar.tif", work->polar, global->correlationNumQ, global->correlationNumPhi );
+				if (global->autoCorrelateOnly){
+					writeTiff( eventname_str+"-xaca.tif", correlation, global->correlationNumQ, global->correlationNumDelta );
+				}else{
+					cerr << "WARNING in correlate: no tiff output for 3D cross-correlation case implemented, yet!" << endl;
+					//one possibility would be to write a stack of tiffs, one for each of the outer q values
+				}
 			}
 		}
+	}
+
+
+	//----------------------------------------------------------flushBatch
+	// autocorrelate the frames waiting in a batch, write them out and add them to the sums
+	// (caller holds batch->mutex)
+	//-------------------------------------------------------------------
+	static void flushBatch(cGlobal *global, tXCCABatch *batch) {
 		
-		//set bad pixel mask, if necessary
-		if (global->useBadPixelMask){
-			cc->setMask( global->badpixelmask, RAW_DATA_LENGTH );
+		xccaCorrelateBatch(global, batch);
+		for (int f=0; f < batch->count; f++) {
+			saveShot(global, batch->frames[f], batch->correlation[f], batch->eventname[f], &batch->hit[f]);
+			if (global->sumCorrelation)
+				addToCorrelationSums(global, batch->workerNum, &batch->hit[f], batch->correlation[f]);
 		}
+		batch->count = 0;
+	}
+
+
+	//----------------------------------------------------------flushCorrelationBatches
+	// correlate the frames still waiting in the batches of all workers
+	// (before the correlation sums are merged, i.e. in saveRunningSums and endjob)
+	//-------------------------------------------------------------------
+	void flushCorrelationBatches(cGlobal *global) {
 		
-		//normalize by variance, if necessary
-		if (global->correlationNormalization == 2){
-			cc->setVarianceEnable(true);
+		if (global->workerData == NULL)
+			return;
+		
+		for (long n=0; n < global->nThreads; n++) {
+			tXCCAWork *work = global->workerData[n].xcca;
+			if (work == NULL || work->batch == NULL)
+				continue;
+			pthread_mutex_lock(&work->batch->mutex);
+			flushBatch(global, work->batch);
+			pthread_mutex_unlock(&work->batch->mutex);
 		}
+	}
+
+
+	//----------------------------------------------------------correlate
+	// apply angular cross correlation
+	// the result goes into threadInfo->correlation, ring averages etc. stay in the workspace of this worker
+	// with correlationBatch, the frame waits in the batch of this worker and is written out and summed from there
+	//-------------------------------------------------------------------
+	void correlate(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+		
+		DEBUGL1_ONLY cout << "CORRELATING... in thread #" << threadInfo->threadNum << "." << endl;
+
+		tXCCAWork *work = getXCCAWork(threadInfo, global);
 		
-		//turn on debug level inside the CrossCorrelator, if needed
-		DEBUGL1_ONLY cc->setDebug(1); 
-		DEBUGL2_ONLY cc->setDebug(2);
+		// polar bins of this frame, from the polar map shared by all workers (see xcca.h)
+		xccaPolar(threadInfo, global, work);
 		
 		//--------------------------------------------------------------------------------------------alg1
 		if (global->useCorrelation == 1) {							
 			DEBUGL1_ONLY cout << "XCCA regular (algorithm 1)" << endl;
+			xccaCorrelateDirect(global, work, threadInfo->correlation);
 			
-			cc->calculatePolarCoordinates(global->correlationStartQ, global->correlationStopQ);
-			cc->calculateXCCA();
+		//--------------------------------------------------------------------------------------------alg2, batched
+		} else if (global->useCorrelation == 2 && work->batch) {
+			DEBUGL1_ONLY cout << "XCCA fast (algorithm 2), batch of " << work->batch->size << " frames" << endl;
+			
+			pthread_mutex_lock(&work->batch->mutex);
+			if (xccaQueue(global, work, threadInfo->eventname, hit))
+				flushBatch(global, work->batch);
+			pthread_mutex_unlock(&work->batch->mutex);
+			threadInfo->correlated = 0;		//summed by flushBatch, nothing to add in worker.cpp: addToCorrelation
+			return;
 			
 		//--------------------------------------------------------------------------------------------alg2
 		} else if (global->useCorrelation == 2) {					
 			DEBUGL1_ONLY cout << "XCCA fast (algorithm 2)" << endl;
-			cc->setLookupTable( global->correlationLUT, global->correlationLUTdim1, global->correlationLUTdim2 );
-			cc->calculatePolarCoordinates_FAST(global->correlationStartQ, global->correlationStopQ);
-			
-			// need to protect the FFTW at the core with a mutex, not thread-safe!!
-			pthread_mutex_lock(&global->correlationFFT_mutex);
-			cc->calculateXCCA_FAST();
-			pthread_mutex_unlock(&global->correlationFFT_mutex);
 			
-			io->writeToTiff( eventname_str+"-polar.tif", cc->polar(), 1 );		// 0: unscaled, 1: scaled
+			// FFT buffers of this worker, FFT plans shared by all workers
+			xccaCorrelate(global, work, threadInfo->correlation);
 
 		} else {
 			cerr << "ERROR in correlate: correlation algorithm " << global->useCorrelation << " not known." << endl;
+			return;
 		}
-		
-		
-		//--------------------------------------------------------------------------------------------save to sum
-		//add to threadInfo->correlation
-		//pthread_mutex_lock(&global->correlation_mutex);
-		if (global->useCorrelation && global->sumCorrelation) {
-			
-			if (threadInfo->correlation) {
-				free(threadInfo->correlation);
-			}
-			threadInfo->correlation = (double*) calloc(global->correlation_nn, sizeof(double));
-			
-			if (global->autoCorrelateOnly) {
-				// autocorrelation only (q1=q2)
-				for (int i=0; i < cc->nQ(); i++) {
-					for (int k=0; k < cc->nLag(); k++) {
-						threadInfo->correlation[i*cc->nLag() + k] = cc->autoCorr()->get(i,k);
-					}
-				}				
-			} else {
-				// cross-correlation
-				for (int i=0; i < cc->nQ(); i++) {
-					for (int j=0; j < cc->nQ(); j++) {
-						for (int k=0; k < cc->nLag(); k++) {
-							threadInfo->correlation[i*cc->nQ()*cc->nLag() + j*cc->nLag() + k] = cc->crossCorr()->get(i,j,k);
-						}
-					}
-				}
-			}
-			
-		}
+		threadInfo->correlated = 1;
 		
 		
 		//--------------------------------------------------------------------------------------------output for this shot
-		// check if hits should be saved to disk
-		if (global->useCorrelation && (global->hdf5dump || global->generateDarkcal
-														|| (hit->standard && global->hitfinder.savehits) 
-														|| (hit->water && global->waterfinder.savehits) 
-														|| (hit->ice && global->icefinder.savehits) 
-														|| (!hit->background && global->backgroundfinder.savehits) )) {
-			//HDF5 output
-			if (global->correlationOutput % 2){
-				if (global->autoCorrelateOnly){
-					io->writeToHDF5( osst.str()+"-xaca.h5", cc->autoCorr(), 0 );				// 0: supposed to be double, but it seems to currently save in float (32-bit) precision
-				}else{
-					cerr << "WARNING in correlate: no HDF5 output for 3D cross-correlation case implemented, yet!" << endl;
-				}
-			}
-			//bin output
-			if (global->correlationOutput % 4 > 1){
-				//writeSAXS(threadInfo, global, cc, threadInfo->eventname);			// writes SAXS to binary
-				writeXCCA(threadInfo, global, cc, threadInfo->eventname); 			// writes XCCA+SAXS to binary
-			}
-			//TIFF image output
-			if (global->correlationOutput > 3){
-				if (global->autoCorrelateOnly){
-					io->writeToTiff( eventname_str+"-xaca.tif", cc->autoCorr(), 1 );			// 0: unscaled, 1: scaled
-				}else{
-					cerr << "WARNING in correlate: no tiff output for 3D cross-correlation case implemented, yet!" << endl;
-					//one possibility would be to write a stack of tiffs, one for each of the outer q values
-				}
-			}
-		}
-		//pthread_mutex_unlock(&global->correlation_mutex);
-		
-		delete io;
-		delete cc;
+		saveShot(global, work, threadInfo->correlation, threadInfo->eventname, hit);
 	}
 
 
@@ -189,36 +188,28 @@ using std::string;
 	//----------------------------------------------------------------------------writeSAXS
 	// write SAXS intensity to binary
 	//-------------------------------------------------------------------------------------
-	void writeSAXS(tThreadInfo *info, cGlobal *global, CrossCorrelator *cc, char *eventname) {	
+	void writeSAXS(cGlobal *global, tXCCAWork *work, char *eventname) {	
 		
 		DEBUGL1_ONLY cout << "writing SAXS to file..." << std::flush;
 		FILE *filePointerWrite;
 		char outfile[1024];
-		double nQD = (double) cc->nQ(); // save everything as doubles
-		double *buffer;
-		buffer = (double*) calloc(cc->nQ(), sizeof(double));
+		const int nQ = global->correlationNumQ;
+		double nQD = (double) nQ; // save everything as doubles
 		
 		sprintf(outfile,"%s-saxs.bin",eventname);
-		DEBUGL1_ONLY printf("r%04u:%i (%2.1f Hz): Writing data to: %s\n", (int)global->runNumber, (int)info->threadNum, global->datarate, outfile);
+		DEBUGL1_ONLY printf("r%04u (%2.1f Hz): Writing data to: %s\n", (int)global->runNumber, global->datarate, outfile);
 		
 		filePointerWrite = fopen(outfile,"w+");
 
 		// angular averages
-		for (int i=0; i<cc->nQ(); i++) {
-			buffer[i] = cc->iAvg()->get(i);
-		}
 		fwrite(&nQD,sizeof(double),1,filePointerWrite); // saving dimensions of array before the actual data
-		fwrite(&buffer[0],sizeof(double),cc->nQ(),filePointerWrite);
+		fwrite(&work->iAvg[0],sizeof(double),nQ,filePointerWrite);
 		
 		// q binning
-		for (int i=0; i<cc->nQ(); i++) {
-			buffer[i] = cc->qAvg()->get(i);
-		}
 		fwrite(&nQD,sizeof(double),1,filePointerWrite);
-		fwrite(&buffer[0],sizeof(double),cc->nQ(),filePointerWrite);
+		fwrite(&work->qAvg[0],sizeof(double),nQ,filePointerWrite);
 		
 		fclose(filePointerWrite);
-		free(buffer);
 		
 		DEBUGL1_ONLY cout << "writeSAXS done" << endl;
 	}
@@ -228,89 +219,54 @@ using std::string;
 	//----------------------------------------------------------------------------writeXCCA
 	// write cross-correlation to binary
 	//-------------------------------------------------------------------------------------
-	void writeXCCA(tThreadInfo *info, cGlobal *global, CrossCorrelator *cc, char *eventname) {
+	void writeXCCA(cGlobal *global, tXCCAWork *work, double *correlation, char *eventname) {
 		
 		FILE *filePointerWrite;
 		char outfile[1024];
 		
-		double nQD = (double) cc->nQ(); // save everything as doubles
-		double nLagD = (double) cc->nLag();
-		double nPhiD = (double) cc->nPhi();
-		
-		const int nQ = cc->nQ();
-		const int nPhi = cc->nPhi();
-		const int nLag = cc->nLag();
+		const int nQ = global->correlationNumQ;
+		const int nPhi = global->correlationNumPhi;
+		const int nLag = global->correlationNumDelta;
 		
-		double *buffer;
-		buffer = (double*) calloc(nQ*nQ*nLag, sizeof(double));
+		double nQD = (double) nQ; // save everything as doubles
+		double nLagD = (double) nLag;
+		double nPhiD = (double) nPhi;
 		
 		if (global->autoCorrelateOnly){
 			sprintf(outfile,"%s-xaca.bin",eventname);
 		} else {
 			sprintf(outfile,"%s-xcca.bin",eventname);
 		}
-		DEBUGL1_ONLY printf("r%04u:%i (%2.1f Hz): Writing data to: %s\n", (int)global->runNumber, (int)info->threadNum, global->datarate, outfile);
+		DEBUGL1_ONLY printf("r%04u (%2.1f Hz): Writing data to: %s\n", (int)global->runNumber, global->datarate, outfile);
 		
 		filePointerWrite = fopen(outfile,"w+");
 		
 		// angular averages
-		for (int i=0; i<nQ; i++) {
-			buffer[i] = cc->iAvg()->get(i);
-		}
 		fwrite(&nQD,sizeof(double),1,filePointerWrite); // saving dimensions of array before the actual data
-		fwrite(&buffer[0],sizeof(double),nQ,filePointerWrite);
+		fwrite(&work->iAvg[0],sizeof(double),nQ,filePointerWrite);
 		
 		// q binning
-		for (int i=0; i<nQ; i++) {
-			buffer[i] = cc->qAvg()->get(i);
-		}
 		fwrite(&nQD,sizeof(double),1,filePointerWrite);
-		fwrite(&buffer[0],sizeof(double),nQ,filePointerWrite);
+		fwrite(&work->qAvg[0],sizeof(double),nQ,filePointerWrite);
 		
 		// angle binning
-		for (int i=0; i<nPhi; i++) {
-			buffer[i] = cc->phiAvg()->get(i);
-		}
 		fwrite(&nPhiD,sizeof(double),1,filePointerWrite);
-		fwrite(&buffer[0],sizeof(double),nPhi,filePointerWrite);
+		fwrite(&work->phiAvg[0],sizeof(double),nPhi,filePointerWrite);
 		
 		// cross-correlation
-		if (global->useCorrelation) {
-			if (global->autoCorrelateOnly) {
-				// autocorrelation only (q1=q2)
-				if (!global->sumCorrelation) {
-					for (int i=0; i < nQ; i++) {
-						for (int k=0; k < nLag; k++) {
-							buffer[i*nLag + k] = cc->autoCorr()->get(i,k);
-						}
-					}
-				}
-				fwrite(&nQD,sizeof(double),1,filePointerWrite);
-				fwrite(&nLagD,sizeof(double),1,filePointerWrite);
-				
-			} else {
-				// full version
-				if (!global->sumCorrelation) {
-					for (int i=0; i < nQ; i++) {
-						for (int j=0; j < nQ; j++) {
-							for (int k=0; k < nLag; k++) {
-								buffer[i*nQ*nLag + j*nLag + k] = cc->crossCorr()->get(i,j,k);
-							}
-						}
-					}
-				}
-				fwrite(&nQD,sizeof(double),1,filePointerWrite);
-				fwrite(&nQD,sizeof(double),1,filePointerWrite);
-				fwrite(&nLagD,sizeof(double),1,filePointerWrite);
-				
-			}
-			if (global->sumCorrelation)
-				fwrite(&info->correlation[0],sizeof(double),global->correlation_nn,filePointerWrite);
-			else fwrite(&buffer[0],sizeof(double),global->correlation_nn,filePointerWrite); 
+		if (global->autoCorrelateOnly) {
+			// autocorrelation only (q1=q2)
+			fwrite(&nQD,sizeof(double),1,filePointerWrite);
+			fwrite(&nLagD,sizeof(double),1,filePointerWrite);
+		} else {
+			// full version
+			fwrite(&nQD,sizeof(double),1,filePointerWrite);
+			fwrite(&nQD,sizeof(double),1,filePointerWrite);
+			fwrite(&nLagD,sizeof(double),1,filePointerWrite);
 		}
+		fwrite(&correlation[0],sizeof(double),global->correlation_nn,filePointerWrite);
 		
 		fclose(filePointerWrite);
-		free(buffer);
 	}
 
 #else
@@ -321,9 +277,12 @@ using std::string;
 		cerr << " =================================================================================================== " << endl;	
 	}
 
-	void correlate(tThreadInfo *threadInfo, cGlobal *global) {
+	void correlate(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
 		print_warning();
-		threadInfo->correlation = NULL;		//set to NULL to be safe, this is called from worker.cpp: addToCorrelation
+		threadInfo->correlated = 0;		//nothing to add in worker.cpp: addToCorrelation
+	}
+
+	void flushCorrelationBatches(cGlobal *global) {
 	}
 #endif
 
@@ -34,21 +34,26 @@
 //     crosscorrelator.cpp,h
 //     fouriertransformer.cpp,h
 //  
+//  The correlation itself is now done in xcca.cpp (with fftw), giraffe is only used
+//  for the tiff output (arraydataIO)
+//  
 //  If the preprocessor flag CORRELATION_ENABLED is not set, cheetah does not need 
 //  the giraffe library (or the supporting libraries for fftw and tiff) 
 //  but, in turn, it cannot perform correlation calculations, either
 //
 #ifdef CORRELATION_ENABLED
 
-	#include "crosscorrelator.h"
+	#include "xcca.h"
 	
 	void correlate(tThreadInfo *info, cGlobal *global, cHit *hit);
-	void writeSAXS(tThreadInfo *info, cGlobal *global, CrossCorrelator *cc, char *eventname);
-	void writeXCCA(tThreadInfo *info, cGlobal *global, CrossCorrelator *cc, char *eventname);
+	void flushCorrelationBatches(cGlobal *global);
+	void writeSAXS(cGlobal *global, tXCCAWork *work, char *eventname);
+	void writeXCCA(cGlobal *global, tXCCAWork *work, double *correlation, char *eventname);
 
 	#else //no correlation functionality --> define a dummy version of correlate that does nothing
 
-	void correlate(tThreadInfo *info, cGlobal *global);
+	void correlate(tThreadInfo *info, cGlobal *global, cHit *hit);
+	void flushCorrelationBatches(cGlobal *global);
 
 	#endif
 #endif
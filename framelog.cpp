@@ -0,0 +1,353 @@
+/*
+ *  framelog.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "framelog.h"
+#include "hdf5writer.h"
+
+
+/*
+ *	Frame log
+ *	Workers put one record per frame into a ring of frameLogWindow slots, a single logger thread
+ *	takes them out in threadNum order and writes them in large batches. Every frame handed to the
+ *	workers gets a threadNum and passes through logFrame(), so the sequence has no gaps.
+ *	The records are handed over without a lock, log->mutex is only taken to sleep on or signal
+ *	the condition variables: the logger thread sleeps until the next record in order comes in,
+ *	a worker only sleeps if the frame frameLogWindow places ahead of it has not been taken out yet.
+ */
+
+
+/*
+ *	Append formatted text to one of the log buffers
+ */
+static void appendText(tFrameLogText *text, const char *format, ...) {
+
+	va_list	args;
+	int		n;
+
+	while(1) {
+		va_start(args, format);
+		n = vsnprintf(text->data + text->size, text->capacity - text->size, format, args);
+		va_end(args);
+		if (n >= 0 && text->size + n < text->capacity)
+			break;
+		text->capacity = 2*text->capacity + n;
+		text->data = (char*) realloc(text->data, text->capacity);
+	}
+	text->size += n;
+}
+
+
+/*
+ *	Format one record, same lines as the frame file and hit lists always had
+ */
+static void addRecord(tFrameLog *log, cGlobal *global, const tFrameRecord *record) {
+
+	// Frame file lists the peaks in the order standard, ice, water, background, list
+	static const int	order[NHITFINDERS] = {0, 2, 1, 3, 4};
+	cHitfinder	*finders[NHITFINDERS] = {&global->hitfinder, &global->waterfinder, &global->icefinder, &global->backgroundfinder, &global->listfinder};
+
+	if (global->frameLogFormat == FRAMELOG_HDF5) {
+		log->rows[log->nRows++] = *record;
+	}
+	else {
+		appendText(&log->frames, "%i, %i, %s, %f", (int) record->threadNum, record->seconds, record->eventName, record->intensityAvg);
+		for(int k=0; k<NHITFINDERS; k++)
+			if (finders[order[k]]->use)
+				appendText(&log->frames, ", %i", record->nPeaks[order[k]]);
+		appendText(&log->frames, "\n");
+	}
+
+	for(int f=0; f<4; f++)
+		if (finders[f]->use && record->hit[f])
+			appendText(&log->hits[f], "r%04u/%s, %f, %i\n", (unsigned) record->runNumber, record->eventName, record->intensityAvg, record->nPeaks[f]);
+
+	// The listfinder writes every frame to the standard hit list
+	if (global->listfinder.use)
+		appendText(&log->hits[0], "r%04u/%s, %f, %i\n", (unsigned) record->runNumber, record->eventName, record->intensityAvg, record->nPeaks[4]);
+}
+
+
+/*
+ *	Write out everything collected so far
+ */
+static void writeFrameLog(tFrameLog *log, cGlobal *global) {
+
+	FILE	*files[4] = {global->hitfinder.cleanedfp, global->waterfinder.cleanedfp, global->icefinder.cleanedfp, global->backgroundfinder.cleanedfp};
+
+	pthread_mutex_lock(&global->framefp_mutex);
+
+	if (log->frames.size && global->framefp)
+		fwrite(log->frames.data, 1, log->frames.size, global->framefp);
+	log->frames.size = 0;
+	for(int f=0; f<4; f++) {
+		if (log->hits[f].size && files[f])
+			fwrite(log->hits[f].data, 1, log->hits[f].size, files[f]);
+		log->hits[f].size = 0;
+	}
+
+	if (log->nRows) {
+		lockHDF5();
+		if (strcmp(log->filename, global->framefile)) {
+			if (log->file >= 0) {
+				H5Dclose(log->table);
+				H5Fclose(log->file);
+			}
+			strcpy(log->filename, global->framefile);
+			log->table = createFrameTable(log->filename, &log->file);
+			log->nTableRows = 0;
+		}
+		else if (log->file < 0) {
+			// Closed by flushHDF5, carry on after the rows already in the file
+			log->table = openFrameTable(log->filename, &log->file);
+		}
+		if (log->table >= 0 && appendFrameTable(log->table, log->nTableRows, log->nRows, log->rows) == 0)
+			log->nTableRows += log->nRows;
+		else
+			printf("Error writing %li rows to frame log %s\n", log->nRows, log->filename);
+		unlockHDF5();
+		log->nRows = 0;
+	}
+
+	pthread_mutex_unlock(&global->framefp_mutex);
+}
+
+
+/*
+ *	Wake up the workers waiting for a slot, after slots have been taken out of the ring
+ */
+static void freeSlots(tFrameLog *log) {
+
+	pthread_mutex_lock(&log->mutex);
+	pthread_cond_broadcast(&log->slotFree);
+	pthread_mutex_unlock(&log->mutex);
+}
+
+
+/*
+ *	Logger thread: take records out of the ring in order, write them out in batches
+ */
+static void *frameLogThread(void *threadarg) {
+
+	cGlobal			*global = (cGlobal*) threadarg;
+	tFrameLog		*log = global->frameLog;
+	tFrameLogSlot	*slot;
+
+	while(1) {
+
+		// Sleep until the next record in order, a flush or the shutdown comes in
+		pthread_mutex_lock(&log->mutex);
+		while(log->slots[log->next % log->window].threadNum != log->next && !log->flush && !log->shutdown)
+			pthread_cond_wait(&log->recordReady, &log->mutex);
+		int		flush = log->flush;
+		int		shutdown = log->shutdown;
+		log->flush = 0;
+		pthread_mutex_unlock(&log->mutex);
+
+		long	n = 0;
+		while((slot = &log->slots[log->next % log->window])->threadNum == log->next) {
+			__sync_synchronize();
+			if (slot->logged)
+				addRecord(log, global, &slot->record);
+			__sync_synchronize();
+			slot->turn = log->next + log->window;
+			log->next++;
+			n++;
+
+			if (log->frames.size >= FRAMELOG_BATCH || log->nRows == FRAMELOG_ROWS) {
+				freeSlots(log);
+				writeFrameLog(log, global);
+			}
+		}
+		if (n)
+			freeSlots(log);
+
+		if (flush)
+			writeFrameLog(log, global);
+
+		if (n == 0 && shutdown)
+			break;
+	}
+
+	writeFrameLog(log, global);
+	pthread_exit(NULL);
+}
+
+
+/*
+ *	Set up the ring and start the logger thread (in beginjob, after allocateFrameBuffers, before the first frame)
+ */
+void startFrameLog(cGlobal *global) {
+
+	tFrameLog	*log = (tFrameLog*) calloc(1, sizeof(tFrameLog));
+
+	// At least one slot per frame buffer, a worker then only waits on the log for frames already in flight
+	if (global->frameLogWindow < global->nFrameBuffers) {
+		printf("frameLogWindow = %li is less than the %li frame buffers, set to %li\n", global->frameLogWindow, global->nFrameBuffers, global->nFrameBuffers);
+		global->frameLogWindow = global->nFrameBuffers;
+	}
+
+	log->window = global->frameLogWindow;
+	log->slots = (tFrameLogSlot*) calloc(log->window, sizeof(tFrameLogSlot));
+	log->next = global->threadCounter + 1;
+	for(long t=log->next; t<log->next+log->window; t++)
+		log->slots[t % log->window].turn = t;
+	log->frames.capacity = FRAMELOG_BATCH + 4096;
+	log->frames.data = (char*) malloc(log->frames.capacity);
+	for(int f=0; f<4; f++) {
+		log->hits[f].capacity = 4096;
+		log->hits[f].data = (char*) malloc(log->hits[f].capacity);
+	}
+	log->rows = (tFrameRecord*) malloc(FRAMELOG_ROWS*sizeof(tFrameRecord));
+	log->file = -1;
+	log->table = -1;
+	pthread_mutex_init(&log->mutex, NULL);
+	pthread_cond_init(&log->recordReady, NULL);
+	pthread_cond_init(&log->slotFree, NULL);
+	global->frameLog = log;
+
+	if (pthread_create(&log->thread, NULL, frameLogThread, (void *)global)) {
+		printf("Error: could not create frame log thread\n");
+		exit(1);
+	}
+}
+
+
+/*
+ *	Hand the record of this frame to the logger thread, called by the worker for every frame
+ */
+void logFrame(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+
+	tFrameLog		*log = global->frameLog;
+	tFrameLogSlot	*slot = &log->slots[threadInfo->threadNum % log->window];
+
+	if (slot->turn != threadInfo->threadNum) {
+		pthread_mutex_lock(&log->mutex);
+		while(slot->turn != threadInfo->threadNum)
+			pthread_cond_wait(&log->slotFree, &log->mutex);
+		pthread_mutex_unlock(&log->mutex);
+	}
+	__sync_synchronize();
+
+	tFrameRecord	*record = &slot->record;
+	record->threadNum = threadInfo->threadNum;
+	record->runNumber = threadInfo->runNumber;
+	record->seconds = threadInfo->seconds;
+	record->nanoSeconds = threadInfo->nanoSeconds;
+	record->fiducial = threadInfo->fiducial;
+	record->intensityAvg = threadInfo->intensityAvg;
+	record->hit[0] = hit->standard;
+	record->hit[1] = hit->water;
+	record->hit[2] = hit->ice;
+	record->hit[3] = hit->background;
+	record->hit[4] = hit->list;
+	record->nPeaks[0] = hit->standardPeaks;
+	record->nPeaks[1] = hit->waterPeaks;
+	record->nPeaks[2] = hit->icePeaks;
+	record->nPeaks[3] = hit->backgroundPeaks;
+	record->nPeaks[4] = hit->listPeaks;
+	strncpy(record->eventName, threadInfo->eventname, sizeof(record->eventName)-1);
+	record->eventName[sizeof(record->eventName)-1] = 0;
+
+	// Frames used to build up the initial background and hot pixel mask are not logged
+	slot->logged = (threadInfo->threadNum >= global->startFrames);
+
+	__sync_synchronize();
+	slot->threadNum = threadInfo->threadNum;
+
+	pthread_mutex_lock(&log->mutex);
+	pthread_cond_signal(&log->recordReady);
+	pthread_mutex_unlock(&log->mutex);
+}
+
+
+/*
+ *	Ask the logger thread to write out what it has collected (when the log file is updated)
+ */
+void flushFrameLog(cGlobal *global) {
+
+	tFrameLog	*log = global->frameLog;
+
+	if (log == NULL)
+		return;
+
+	pthread_mutex_lock(&log->mutex);
+	log->flush = 1;
+	pthread_cond_signal(&log->recordReady);
+	pthread_mutex_unlock(&log->mutex);
+}
+
+
+/*
+ *	Close the HDF5 frame table so that H5close() can be called, the next write reopens it
+ *	Call with the HDF5 lock held (see flushHDF5)
+ */
+void closeFrameTable(cGlobal *global) {
+
+	tFrameLog	*log = global->frameLog;
+
+	if (log == NULL || log->file < 0)
+		return;
+
+	if (log->table >= 0)
+		H5Dclose(log->table);
+	H5Fclose(log->file);
+	log->table = -1;
+	log->file = -1;
+}
+
+
+/*
+ *	Write out the remaining records and stop the logger thread (after stopWorkerThreads())
+ */
+void stopFrameLog(cGlobal *global) {
+
+	tFrameLog	*log = global->frameLog;
+
+	if (log == NULL)
+		return;
+
+	pthread_mutex_lock(&log->mutex);
+	log->shutdown = 1;
+	pthread_cond_signal(&log->recordReady);
+	pthread_mutex_unlock(&log->mutex);
+	pthread_join(log->thread, NULL);
+	pthread_mutex_destroy(&log->mutex);
+	pthread_cond_destroy(&log->recordReady);
+	pthread_cond_destroy(&log->slotFree);
+
+	lockHDF5();
+	if (log->nTableRows)
+		printf("Frame log: %li frames in %s\n", log->nTableRows, log->filename);
+	closeFrameTable(global);
+	unlockHDF5();
+
+	free(log->slots);
+	free(log->frames.data);
+	for(int f=0; f<4; f++)
+		free(log->hits[f].data);
+	free(log->rows);
+	free(log);
+	global->frameLog = NULL;
+}
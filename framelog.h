@@ -0,0 +1,111 @@
+/*
+ *  framelog.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _framelog_h
+#define _framelog_h
+
+#include <stdint.h>
+#include <pthread.h>
+#include <hdf5.h>
+
+#include "setup.h"
+#include "worker.h"
+
+// Output formats of the frame log (frameLogFormat)
+#define FRAMELOG_TEXT		0		// r0123-frames.txt, one comma separated line per frame
+#define FRAMELOG_HDF5		1		// r0123-frames.h5, table of tFrameRecord
+
+// Bytes of text (or number of records) collected before they are written out
+#define FRAMELOG_BATCH		1048576
+#define FRAMELOG_ROWS		4096
+
+/*
+ *	Everything logged about one frame, hitfinder results in the order of cHitfinder
+ *	(standard, water, ice, background, list)
+ */
+typedef struct {
+	int64_t		threadNum;
+	int32_t		runNumber;
+	int32_t		seconds;
+	int32_t		nanoSeconds;
+	uint32_t	fiducial;
+	double		intensityAvg;
+	int32_t		hit[NHITFINDERS];
+	int32_t		nPeaks[NHITFINDERS];
+	char		eventName[64];
+} tFrameRecord;
+
+/*
+ *	Slot of the ring that the workers hand records over in
+ *	Frame threadNum goes into slot threadNum % frameLogWindow once the record
+ *	threadNum - frameLogWindow has been taken out by the logger thread
+ */
+typedef struct {
+	volatile long	turn;				// threadNum of the frame that may fill the slot next
+	volatile long	threadNum;			// threadNum of the record in the slot, once it is complete
+	int				logged;				// 0 for frames that are not written out (initial frames)
+	tFrameRecord	record;
+} tFrameLogSlot;
+
+/*
+ *	Text collected for one of the log files
+ */
+typedef struct {
+	char		*data;
+	long		size;
+	long		capacity;
+} tFrameLogText;
+
+typedef struct sFrameLog {
+
+	tFrameLogSlot	*slots;
+	long			window;
+	long			next;				// threadNum of the next record to be written
+	volatile int	shutdown;
+	volatile int	flush;				// write out what has been collected so far
+	pthread_t		thread;
+
+	// Waking up: the logger thread when a record, flush or shutdown comes in, workers when slots are taken out
+	pthread_mutex_t	mutex;
+	pthread_cond_t	recordReady;
+	pthread_cond_t	slotFree;
+
+	// Frame file (FRAMELOG_TEXT) and hit lists of the standard, water, ice and background finders
+	tFrameLogText	frames;
+	tFrameLogText	hits[4];
+
+	// FRAMELOG_HDF5: records not yet appended to /frames
+	tFrameRecord	*rows;
+	long			nRows;
+	hid_t			file;				// -1 while the file is closed (see closeFrameTable)
+	hid_t			table;
+	long			nTableRows;
+	char			filename[1024];		// file the table is in, a new one is started with each run
+
+} tFrameLog;
+
+
+/*
+ *	Function prototypes
+ */
+void startFrameLog(cGlobal*);
+void logFrame(tThreadInfo*, cGlobal*, cHit*);
+void flushFrameLog(cGlobal*);
+void closeFrameTable(cGlobal*);
+void stopFrameLog(cGlobal*);
+
+#endif
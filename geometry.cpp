@@ -0,0 +1,221 @@
+/*
+ *  geometry.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <cmath>
+
+#include "setup.h"
+#include "worker.h"
+#include "geometry.h"
+#include "snapshot.h"
+
+
+/*
+ *	Set up the (empty) geometry cache, it is filled by the first frame that needs it
+ */
+void initGeometryCache(cGlobal *global) {
+	initSnapshot(&global->geometrySnapshot, calloc(1, sizeof(tGeometryCache)), calloc(1, sizeof(tGeometryCache)));
+	global->geometryVersion = 0;
+}
+
+void freeGeometryCache(cGlobal *global) {
+	for(int n=0; n<2; n++) {
+		tGeometryCache *cache = (tGeometryCache*) global->geometrySnapshot.buffer[n];
+		free(cache->theta);
+		free(cache->correction);
+	}
+	freeSnapshot(&global->geometrySnapshot);
+}
+
+
+/*
+ *	Solid angle (in srad) of pixel i from the two plane triangles that form the pixel
+ */
+static double pixelSolidAngle(cGlobal *global, long i, double detectorZ) {
+	
+	// allocate local arrays
+	double corner_coordinates[4][3]; // array of vector coordinates of pixel corners, first index starts from upper left corner and goes around clock-wise, second index determines X=0/Y=1/Z=2 coordinate
+	double corner_distances[4]; // array of distances of pixel corners, index starts from upper left corner and goes around clock-wise
+	double determinant;
+	double denominator;
+	double solid_angle[2]; // array of solid angles of the two plane triangles that form the pixel
+	
+	// upper left corner
+	corner_coordinates[0][0] = global->pix_x[i]*global->pixelSize + global->pixelSize/2;
+	corner_coordinates[0][1] = global->pix_y[i]*global->pixelSize + global->pixelSize/2;
+	// upper right corner
+	corner_coordinates[1][0] = global->pix_x[i]*global->pixelSize - global->pixelSize/2;
+	corner_coordinates[1][1] = global->pix_y[i]*global->pixelSize + global->pixelSize/2;
+	// lower right corner
+	corner_coordinates[2][0] = global->pix_x[i]*global->pixelSize - global->pixelSize/2;
+	corner_coordinates[2][1] = global->pix_y[i]*global->pixelSize - global->pixelSize/2;
+	// lower left corner
+	corner_coordinates[3][0] = global->pix_x[i]*global->pixelSize + global->pixelSize/2;
+	corner_coordinates[3][1] = global->pix_y[i]*global->pixelSize - global->pixelSize/2;
+	// assign Z coordinate as detector distance and calculate length of the vectors to the pixel coordinates
+	for (int j = 0; j < 4; j++) {
+		corner_coordinates[j][2] = detectorZ/1000;
+		corner_distances[j] = sqrt(corner_coordinates[j][0]*corner_coordinates[j][0] + corner_coordinates[j][1]*corner_coordinates[j][1] + corner_coordinates[j][2]*corner_coordinates[j][2]);
+	}
+	
+	// first triangle made up of upper left, upper right, and lower right corner
+	// nominator in expression for solid angle of a plane triangle - magnitude of triple product of first 3 corners
+	determinant = fabs( corner_coordinates[0][0]*(corner_coordinates[1][1]*corner_coordinates[2][2] - corner_coordinates[1][2]*corner_coordinates[2][1])
+					   - corner_coordinates[0][1]*(corner_coordinates[1][0]*corner_coordinates[2][2] - corner_coordinates[1][2]*corner_coordinates[2][0])
+					   + corner_coordinates[0][2]*(corner_coordinates[1][0]*corner_coordinates[2][1] - corner_coordinates[1][1]*corner_coordinates[2][0]) );
+	denominator = corner_distances[0]*corner_distances[1]*corner_distances[2] + corner_distances[2]*(corner_coordinates[0][0]*corner_coordinates[1][0] + corner_coordinates[0][1]*corner_coordinates[1][1] + corner_coordinates[0][2]*corner_coordinates[1][2])
+	+ corner_distances[1]*(corner_coordinates[0][0]*corner_coordinates[2][0] + corner_coordinates[0][1]*corner_coordinates[2][1] + corner_coordinates[0][2]*corner_coordinates[2][2])
+	+ corner_distances[0]*(corner_coordinates[1][0]*corner_coordinates[2][0] + corner_coordinates[1][1]*corner_coordinates[2][1] + corner_coordinates[1][2]*corner_coordinates[2][2]);
+	solid_angle[0] = atan2(determinant, denominator);
+	if (solid_angle[0] < 0)
+		solid_angle[0] += M_PI; // If det > 0 and denom < 0 arctan2 returns < 0, so add PI
+	
+	// second triangle made up of lower right, lower left, and upper left corner
+	// nominator in expression for solid angle of a plane triangle - magnitude of triple product of last 3 corners
+	determinant = fabs( corner_coordinates[0][0]*(corner_coordinates[3][1]*corner_coordinates[2][2] - corner_coordinates[3][2]*corner_coordinates[2][1])
+					   - corner_coordinates[0][1]*(corner_coordinates[3][0]*corner_coordinates[2][2] - corner_coordinates[3][2]*corner_coordinates[2][0])
+					   + corner_coordinates[0][2]*(corner_coordinates[3][0]*corner_coordinates[2][1] - corner_coordinates[3][1]*corner_coordinates[2][0]) );
+	denominator = corner_distances[2]*corner_distances[3]*corner_distances[0] + corner_distances[2]*(corner_coordinates[0][0]*corner_coordinates[3][0] + corner_coordinates[0][1]*corner_coordinates[3][1] + corner_coordinates[0][2]*corner_coordinates[3][2])
+	+ corner_distances[3]*(corner_coordinates[0][0]*corner_coordinates[2][0] + corner_coordinates[0][1]*corner_coordinates[2][1] + corner_coordinates[0][2]*corner_coordinates[2][2])
+	+ corner_distances[0]*(corner_coordinates[3][0]*corner_coordinates[2][0] + corner_coordinates[3][1]*corner_coordinates[2][1] + corner_coordinates[3][2]*corner_coordinates[2][2]);
+	solid_angle[1] = atan2(determinant, denominator);
+	if (solid_angle[1] < 0)
+		solid_angle[1] += M_PI; // If det > 0 and denom < 0 arctan2 returns < 0, so add PI
+	
+	return 2*(solid_angle[0] + solid_angle[1]);
+}
+
+
+/*
+ *	Fill a geometry cache for the given detector position
+ *	The polarization correction is from Hura et al JCP 2000, the solid angle correction only 
+ *	keeps the theta/phi dependent part (the constant term is saved as threadInfo->solidAngle)
+ */
+static void buildGeometryCache(tGeometryCache *cache, cGlobal *global, double detectorZ, float pixelCenterX, float pixelCenterY) {
+	
+	int		useCorrection = (global->usePolarizationCorrection || global->useSolidAngleCorrection);
+	double	solidAngle = global->pixelSize*global->pixelSize/(detectorZ/1000*detectorZ/1000);
+	double	theta, divisor;
+	
+	if (cache->theta == NULL)
+		cache->theta = (double*) calloc(global->pix_nn, sizeof(double));
+	if (useCorrection && cache->correction == NULL)
+		cache->correction = (double*) calloc(global->pix_nn, sizeof(double));
+	
+	// pixel maps may be updated by the main thread (updatePixelArrays)
+	pthread_mutex_lock(&global->pixelcenter_mutex);
+	for (long i = 0; i < global->pix_nn; i++) {
+		theta = atan(global->pixelSize*global->pix_r[i]*1000/detectorZ);
+		cache->theta[i] = theta;
+		
+		if (!useCorrection)
+			continue;
+		
+		divisor = 1;
+		if (global->usePolarizationCorrection) {
+			divisor *= global->horizontalPolarization*(1 - sin(global->phi[i])*sin(global->phi[i])*sin(theta)*sin(theta)) + (1 - global->horizontalPolarization)*(1 - cos(global->phi[i])*cos(global->phi[i])*sin(theta)*sin(theta));
+		}
+		if (global->useSolidAngleCorrection == 2) {
+			// Azimuthally symmetrical correction
+			divisor *= cos(theta)*cos(theta)*cos(theta);
+		} else if (global->useSolidAngleCorrection) {
+			// Rigorous correction from solid angle of a plane triangle
+			divisor *= pixelSolidAngle(global, i, detectorZ)/solidAngle;
+		}
+		cache->correction[i] = 1/divisor;
+	}
+	cache->geometryVersion = global->geometryVersion;
+	pthread_mutex_unlock(&global->pixelcenter_mutex);
+	
+	cache->detectorZ = detectorZ;
+	cache->pixelCenterX = pixelCenterX;
+	cache->pixelCenterY = pixelCenterY;
+	cache->valid = 1;
+}
+
+
+/*
+ *	Is the cache valid for this frame? 
+ *	Detector positions within geometryTolerance (mm) of the cached one are considered equal
+ */
+static int geometryMatches(const tGeometryCache *cache, tThreadInfo *threadInfo, cGlobal *global) {
+	
+	if (!cache->valid || cache->geometryVersion != global->geometryVersion)
+		return 0;
+	if (cache->pixelCenterX != threadInfo->pixelCenterX || cache->pixelCenterY != threadInfo->pixelCenterY)
+		return 0;
+	if (threadInfo->detectorPosition != threadInfo->detectorPosition)
+		return (cache->detectorZ != cache->detectorZ);	// NaN
+	return fabs(cache->detectorZ - threadInfo->detectorPosition) <= global->geometryTolerance;
+}
+
+
+/*
+ *	Get theta and the polarization/solid angle correction for this frame (threadInfo->geometry)
+ *	The cache is rebuilt by the first thread that finds it out of date, the others keep using 
+ *	their version until they are done with their frame. Released with unpinGeometry().
+ */
+void pinGeometry(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	const tGeometryCache	*cache;
+	
+	if (threadInfo->geometry)
+		return;
+	
+	cache = (const tGeometryCache*) pinSnapshot(&global->geometrySnapshot, &threadInfo->geometryPinned);
+	if (!geometryMatches(cache, threadInfo, global)) {
+		unpinSnapshot(&global->geometrySnapshot, threadInfo->geometryPinned);
+		
+		// Only one thread rebuilds at a time; it must not hold a pinned version while waiting for readers
+		pthread_mutex_lock(&global->geometry_mutex);
+		cache = (const tGeometryCache*) pinSnapshot(&global->geometrySnapshot, &threadInfo->geometryPinned);
+		if (!geometryMatches(cache, threadInfo, global)) {
+			unpinSnapshot(&global->geometrySnapshot, threadInfo->geometryPinned);
+			DEBUGL1_ONLY printf("r%04u:%i Updating geometry cache for detector position %g mm\n", (int)threadInfo->runNumber, (int)threadInfo->threadNum, threadInfo->detectorPosition);
+			tGeometryCache *update = (tGeometryCache*) beginSnapshotUpdate(&global->geometrySnapshot);
+			buildGeometryCache(update, global, threadInfo->detectorPosition, threadInfo->pixelCenterX, threadInfo->pixelCenterY);
+			publishSnapshot(&global->geometrySnapshot);
+			cache = (const tGeometryCache*) pinSnapshot(&global->geometrySnapshot, &threadInfo->geometryPinned);
+		}
+		pthread_mutex_unlock(&global->geometry_mutex);
+	}
+	threadInfo->geometry = cache;
+}
+
+void unpinGeometry(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	if (threadInfo->geometry == NULL)
+		return;
+	unpinSnapshot(&global->geometrySnapshot, threadInfo->geometryPinned);
+	threadInfo->geometry = NULL;
+}
+
+
+/*
+ *	Apply polarization and solid angle correction: one multiplication per pixel
+ */
+void applyGeometryCorrection(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	const double	*correction = threadInfo->geometry->correction;
+	float			*data = threadInfo->corrected_data;
+	
+	for (long i = 0; i < global->pix_nn; i++) {
+		data[i] *= correction[i];
+	}
+}
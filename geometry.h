@@ -0,0 +1,48 @@
+/*
+ *  geometry.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef _geometry_h
+#define _geometry_h
+
+#include "setup.h"
+#include "worker.h"
+
+/*
+ *	Per-pixel quantities that only depend on the detector geometry and position
+ *	Shared by all worker threads through global->geometrySnapshot and rebuilt when the detector moves
+ */
+typedef struct sGeometryCache {
+	int			valid;
+	double		detectorZ;			// detector position (mm) the cache was built for
+	float		pixelCenterX;
+	float		pixelCenterY;
+	long		geometryVersion;	// value of global->geometryVersion the cache was built for
+	double		*theta;				// scattering angle of each pixel
+	double		*correction;		// combined 1/(polarization*solid angle) factor of each pixel, NULL if neither correction is used
+} tGeometryCache;
+
+
+/*
+ *	Function prototypes
+ */
+void initGeometryCache(cGlobal*);
+void freeGeometryCache(cGlobal*);
+void pinGeometry(tThreadInfo*, cGlobal*);
+void unpinGeometry(tThreadInfo*, cGlobal*);
+void applyGeometryCorrection(tThreadInfo*, cGlobal*);
+
+#endif
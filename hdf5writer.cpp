@@ -0,0 +1,678 @@
+/*
+ *  hdf5writer.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <hdf5.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "hdf5writer.h"
+
+
+/*
+ *	The HDF5 library is not built thread-safe, so every call into it goes through this lock
+ *	(the writer thread, and the powder/log output of the main thread)
+ */
+static pthread_mutex_t hdf5_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void lockHDF5(void) {
+	pthread_mutex_lock(&hdf5_mutex);
+}
+
+void unlockHDF5(void) {
+	pthread_mutex_unlock(&hdf5_mutex);
+}
+
+
+/*
+ *	Per-event values written to /LCLS, same names as in the single event files
+ */
+#define COLUMN_INT32	0
+#define COLUMN_DOUBLE	1
+
+typedef struct {
+	const char	*name;
+	int			type;
+	size_t		offset;		// position in tThreadInfo
+} tHDF5Column;
+
+static const tHDF5Column hdf5Columns[HDF5_NCOLUMNS] = {
+	{ "machineTime",			COLUMN_INT32,	offsetof(tThreadInfo, seconds) },
+	{ "fiducial",				COLUMN_INT32,	offsetof(tThreadInfo, fiducial) },
+	{ "ebeamCharge",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamCharge) },
+	{ "ebeamL3Energy",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamL3Energy) },
+	{ "ebeamPkCurrBC2",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamPkCurrBC2) },
+	{ "ebeamLTUPosX",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamLTUPosX) },
+	{ "ebeamLTUPosY",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamLTUPosY) },
+	{ "ebeamLTUAngX",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamLTUAngX) },
+	{ "ebeamLTUAngY",			COLUMN_DOUBLE,	offsetof(tThreadInfo, fEbeamLTUAngY) },
+	{ "phaseCavityTime1",		COLUMN_DOUBLE,	offsetof(tThreadInfo, phaseCavityTime1) },
+	{ "phaseCavityTime2",		COLUMN_DOUBLE,	offsetof(tThreadInfo, phaseCavityTime2) },
+	{ "phaseCavityCharge1",		COLUMN_DOUBLE,	offsetof(tThreadInfo, phaseCavityCharge1) },
+	{ "phaseCavityCharge2",		COLUMN_DOUBLE,	offsetof(tThreadInfo, phaseCavityCharge2) },
+	{ "photon_energy_eV",		COLUMN_DOUBLE,	offsetof(tThreadInfo, photonEnergyeV) },
+	{ "photon_wavelength_A",	COLUMN_DOUBLE,	offsetof(tThreadInfo, wavelengthA) },
+	{ "f_11_ENRC",				COLUMN_DOUBLE,	offsetof(tThreadInfo, gmd11) },
+	{ "f_12_ENRC",				COLUMN_DOUBLE,	offsetof(tThreadInfo, gmd12) },
+	{ "f_21_ENRC",				COLUMN_DOUBLE,	offsetof(tThreadInfo, gmd21) },
+	{ "f_22_ENRC",				COLUMN_DOUBLE,	offsetof(tThreadInfo, gmd22) },
+	{ "detectorPosition",		COLUMN_DOUBLE,	offsetof(tThreadInfo, detectorPosition) },
+	{ "attenuation",			COLUMN_DOUBLE,	offsetof(tThreadInfo, attenuation) },
+	{ "solidAngle",				COLUMN_DOUBLE,	offsetof(tThreadInfo, solidAngle) },
+	{ "intensityAvg",			COLUMN_DOUBLE,	offsetof(tThreadInfo, intensityAvg) }
+};
+
+static size_t columnSize(int type) {
+	return (type == COLUMN_DOUBLE) ? sizeof(double) : sizeof(int32_t);
+}
+
+static hid_t columnType(int type) {
+	return (type == COLUMN_DOUBLE) ? H5T_NATIVE_DOUBLE : H5T_NATIVE_INT32;
+}
+
+
+/*
+ *	Dataset creation properties for images: chunk shape and filters from the ini file
+ *	dims are the dimensions of one image (rank 2) or of one event slice (rank 3, dims[0] = 1)
+ *	Returns H5P_DEFAULT (contiguous, as before) if neither chunking nor filters are requested
+ */
+hid_t imageCreatePlist(cGlobal *global, int rank, const hsize_t *dims) {
+
+	hsize_t	chunk[3];
+	hid_t	plist;
+
+	if (rank == 2 && global->hdf5ChunkRows == 0 && global->hdf5Compression == 0 && !global->hdf5Shuffle)
+		return H5P_DEFAULT;
+
+	for(int d=0; d<rank; d++)
+		chunk[d] = dims[d];
+	if (rank == 3)
+		chunk[0] = global->hdf5ChunkEvents;
+	if (global->hdf5ChunkRows > 0 && (hsize_t) global->hdf5ChunkRows < chunk[rank-2])
+		chunk[rank-2] = global->hdf5ChunkRows;
+
+	plist = H5Pcreate(H5P_DATASET_CREATE);
+	H5Pset_chunk(plist, rank, chunk);
+	if (global->hdf5Shuffle)
+		H5Pset_shuffle(plist);
+	if (global->hdf5Compression > 0)
+		H5Pset_deflate(plist, global->hdf5Compression);
+	return plist;
+}
+
+
+/*
+ *	Convert an image to int16 for writing
+ *	Optionally zeroes everything with |value| below hdf5Threshold and rounds to multiples of hdf5Quantize ADU,
+ *	which is lossy but makes the near-zero background of most hits compress very well
+ */
+void convertImage(const float *data, int16_t *buffer, long n, cGlobal *global) {
+
+	float	threshold = global->hdf5Threshold;
+	float	step = global->hdf5Quantize;
+
+	if (threshold <= 0 && step <= 1) {
+		for(long i=0; i<n; i++)
+			buffer[i] = (int16_t) data[i];
+		return;
+	}
+
+	for(long i=0; i<n; i++) {
+		float	x = data[i];
+		if (fabsf(x) < threshold)
+			x = 0;
+		else if (step > 1)
+			x = step*rintf(x/step);
+		buffer[i] = (int16_t) x;
+	}
+}
+
+
+/*
+ *	Keep track of how much image data went to disk and how long it took (called with the HDF5 lock held)
+ */
+void addHDF5Statistics(cGlobal *global, double imageBytes, double storedBytes, double seconds) {
+	global->hdf5EventsWritten++;
+	global->hdf5ImageBytes += imageBytes;
+	global->hdf5StoredBytes += storedBytes;
+	global->hdf5WriteTime += seconds;
+}
+
+void printHDF5Statistics(cGlobal *global) {
+
+	if (global->hdf5EventsWritten == 0)
+		return;
+	printf("HDF5 output: %li events, %.1f MB of images stored in %.1f MB (%.2fx smaller), %.1f MB/s\n",
+		   global->hdf5EventsWritten, global->hdf5ImageBytes/1048576., global->hdf5StoredBytes/1048576.,
+		   global->hdf5StoredBytes > 0 ? global->hdf5ImageBytes/global->hdf5StoredBytes : 0,
+		   global->hdf5WriteTime > 0 ? global->hdf5ImageBytes/1048576./global->hdf5WriteTime : 0);
+}
+
+double hdf5Clock(void) {
+	struct timeval	t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec + 1e-6*t.tv_usec;
+}
+
+
+/*
+ *	Create an empty dataset that grows along its first dimension
+ *	dims is the shape of one row, a chunk holds one row unless plist says otherwise
+ */
+static hid_t createExtendibleDataset(hid_t loc, const char *name, hid_t type, int rank, const hsize_t *dims, hid_t plist) {
+
+	hsize_t	size[3], max_size[3];
+	hid_t	dataspace_id, dapl, dataset_id;
+	int		ownPlist = 0;
+
+	for(int d=0; d<rank; d++) {
+		size[d] = dims[d];
+		max_size[d] = dims[d];
+	}
+	size[0] = 0;
+	max_size[0] = H5S_UNLIMITED;
+
+	if (plist == H5P_DEFAULT) {
+		plist = H5Pcreate(H5P_DATASET_CREATE);
+		H5Pset_chunk(plist, rank, dims);
+		ownPlist = 1;
+	}
+
+	// Chunks spanning several events are filled one event at a time; make sure a whole row 
+	// of chunks fits in the chunk cache so that they are only compressed once
+	hsize_t	chunk[3];
+	size_t	chunkBytes = H5Tget_size(type);
+	H5Pget_chunk(plist, rank, chunk);
+	for(int d=1; d<rank; d++)
+		chunkBytes *= dims[d];
+	chunkBytes *= chunk[0];
+	dapl = H5Pcreate(H5P_DATASET_ACCESS);
+	if (chunkBytes > 1048576)
+		H5Pset_chunk_cache(dapl, 12421, chunkBytes + 1048576, 1);
+
+	dataspace_id = H5Screate_simple(rank, size, max_size);
+	dataset_id = H5Dcreate(loc, name, type, dataspace_id, H5P_DEFAULT, plist, dapl);
+	H5Pclose(dapl);
+	if (ownPlist)
+		H5Pclose(plist);
+	H5Sclose(dataspace_id);
+
+	return dataset_id;
+}
+
+
+/*
+ *	Write nRows rows (of shape chunk[1..rank-1]) at row offset, growing the dataset as needed
+ */
+static int appendRows(hid_t dataset_id, hid_t memtype, int rank, const hsize_t *chunk, hsize_t offset, hsize_t nRows, const void *buffer) {
+
+	hsize_t	size[3], start[3], count[3];
+	hid_t	filespace, memspace;
+	herr_t	hdf_error;
+
+	for(int d=0; d<rank; d++) {
+		size[d] = chunk[d];
+		start[d] = 0;
+		count[d] = chunk[d];
+	}
+	size[0] = offset + nRows;
+	start[0] = offset;
+	count[0] = nRows;
+
+	if (H5Dset_extent(dataset_id, size) < 0)
+		return -1;
+	filespace = H5Dget_space(dataset_id);
+	H5Sselect_hyperslab(filespace, H5S_SELECT_SET, start, NULL, count, NULL);
+	memspace = H5Screate_simple(rank, count, NULL);
+	hdf_error = H5Dwrite(dataset_id, memtype, memspace, filespace, H5P_DEFAULT, buffer);
+	H5Sclose(memspace);
+	H5Sclose(filespace);
+
+	return (hdf_error < 0) ? -1 : 0;
+}
+
+
+/*
+ *	Append the buffered event data to the 1D datasets
+ */
+static void flushColumns(tHDF5RunFile *run) {
+
+	hsize_t	chunk[1] = {HDF5_COLUMN_BLOCK};
+	hid_t	stringtype;
+
+	if (run->nBuffered == 0)
+		return;
+
+	for(int c=0; c<HDF5_NCOLUMNS; c++)
+		appendRows(run->columns[c], columnType(hdf5Columns[c].type), 1, chunk, run->nColumnRows, run->nBuffered, run->columnBuffer[c]);
+
+	stringtype = H5Tcopy(H5T_C_S1);
+	H5Tset_size(stringtype, H5T_VARIABLE);
+	appendRows(run->eventName, stringtype, 1, chunk, run->nColumnRows, run->nBuffered, run->eventNameBuffer);
+	appendRows(run->eventTimeString, stringtype, 1, chunk, run->nColumnRows, run->nBuffered, run->eventTimeBuffer);
+	H5Tclose(stringtype);
+
+	for(long i=0; i<run->nBuffered; i++) {
+		free(run->eventNameBuffer[i]);
+		free(run->eventTimeBuffer[i]);
+	}
+	run->nColumnRows += run->nBuffered;
+	run->nBuffered = 0;
+}
+
+
+/*
+ *	Compound types for the peak lists (tPeak and tPeakPixel)
+ */
+static hid_t peakType(void) {
+	hid_t	type = H5Tcreate(H5T_COMPOUND, sizeof(tPeak));
+	H5Tinsert(type, "event", HOFFSET(tPeak, event), H5T_NATIVE_INT32);
+	H5Tinsert(type, "nPixels", HOFFSET(tPeak, nPixels), H5T_NATIVE_INT32);
+	H5Tinsert(type, "firstPixel", HOFFSET(tPeak, firstPixel), H5T_NATIVE_INT64);
+	H5Tinsert(type, "fs", HOFFSET(tPeak, fs), H5T_NATIVE_FLOAT);
+	H5Tinsert(type, "ss", HOFFSET(tPeak, ss), H5T_NATIVE_FLOAT);
+	H5Tinsert(type, "total", HOFFSET(tPeak, total), H5T_NATIVE_FLOAT);
+	return type;
+}
+
+static hid_t peakPixelType(void) {
+	hid_t	type = H5Tcreate(H5T_COMPOUND, sizeof(tPeakPixel));
+	H5Tinsert(type, "event", HOFFSET(tPeakPixel, event), H5T_NATIVE_INT32);
+	H5Tinsert(type, "peak", HOFFSET(tPeakPixel, peak), H5T_NATIVE_INT32);
+	H5Tinsert(type, "fs", HOFFSET(tPeakPixel, fs), H5T_NATIVE_INT16);
+	H5Tinsert(type, "ss", HOFFSET(tPeakPixel, ss), H5T_NATIVE_INT16);
+	H5Tinsert(type, "value", HOFFSET(tPeakPixel, value), H5T_NATIVE_FLOAT);
+	return type;
+}
+
+
+// Frame log records (tFrameRecord)
+static hid_t frameRecordType(void) {
+	hsize_t	dims[1] = {NHITFINDERS};
+	hid_t	array = H5Tarray_create(H5T_NATIVE_INT32, 1, dims);
+	hid_t	name = H5Tcopy(H5T_C_S1);
+	H5Tset_size(name, sizeof(((tFrameRecord*) 0)->eventName));
+	hid_t	type = H5Tcreate(H5T_COMPOUND, sizeof(tFrameRecord));
+	H5Tinsert(type, "threadNum", HOFFSET(tFrameRecord, threadNum), H5T_NATIVE_INT64);
+	H5Tinsert(type, "runNumber", HOFFSET(tFrameRecord, runNumber), H5T_NATIVE_INT32);
+	H5Tinsert(type, "seconds", HOFFSET(tFrameRecord, seconds), H5T_NATIVE_INT32);
+	H5Tinsert(type, "nanoSeconds", HOFFSET(tFrameRecord, nanoSeconds), H5T_NATIVE_INT32);
+	H5Tinsert(type, "fiducial", HOFFSET(tFrameRecord, fiducial), H5T_NATIVE_UINT32);
+	H5Tinsert(type, "intensityAvg", HOFFSET(tFrameRecord, intensityAvg), H5T_NATIVE_DOUBLE);
+	H5Tinsert(type, "hit", HOFFSET(tFrameRecord, hit), array);
+	H5Tinsert(type, "nPeaks", HOFFSET(tFrameRecord, nPeaks), array);
+	H5Tinsert(type, "eventName", HOFFSET(tFrameRecord, eventName), name);
+	H5Tclose(array);
+	H5Tclose(name);
+	return type;
+}
+
+
+/*
+ *	Extendible table for the peak lists, compressed like the images
+ */
+static hid_t createPeakTable(hid_t loc, const char *name, hid_t type, hsize_t chunk, cGlobal *global) {
+
+	hid_t	plist, dataset_id;
+	hsize_t	dims[1] = {chunk};
+
+	plist = H5Pcreate(H5P_DATASET_CREATE);
+	H5Pset_chunk(plist, 1, dims);
+	if (global->hdf5Shuffle)
+		H5Pset_shuffle(plist);
+	if (global->hdf5Compression > 0)
+		H5Pset_deflate(plist, global->hdf5Compression);
+	dataset_id = createExtendibleDataset(loc, name, type, 1, dims, plist);
+	H5Pclose(plist);
+	return dataset_id;
+}
+
+
+/*
+ *	Bytes the images and peak lists take on disk
+ */
+static double storedSize(tHDF5RunFile *run) {
+
+	double	size = 0;
+
+	if (run->data >= 0)
+		size += H5Dget_storage_size(run->data);
+	if (run->rawdata >= 0)
+		size += H5Dget_storage_size(run->rawdata);
+	if (run->peaks >= 0)
+		size += H5Dget_storage_size(run->peaks);
+	if (run->peakPixels >= 0)
+		size += H5Dget_storage_size(run->peakPixels);
+	return size;
+}
+
+
+/*
+ *	Close the current run file (if any), writing out the buffered event data first
+ */
+static void closeRunFile(tHDF5RunFile *run, cGlobal *global) {
+
+	if (run->file < 0)
+		return;
+
+	flushColumns(run);
+
+	// Count the image chunks that were still sitting in the chunk cache
+	double	storedBytes;
+	H5Fflush(run->file, H5F_SCOPE_LOCAL);
+	storedBytes = storedSize(run);
+	global->hdf5StoredBytes += storedBytes - run->nBytes;
+	run->nBytes = storedBytes;
+
+	for(int c=0; c<HDF5_NCOLUMNS; c++)
+		H5Dclose(run->columns[c]);
+	H5Dclose(run->eventName);
+	H5Dclose(run->eventTimeString);
+	if (run->peaks >= 0)
+		H5Dclose(run->peaks);
+	if (run->peakPixels >= 0)
+		H5Dclose(run->peakPixels);
+	if (run->rawdata >= 0)
+		H5Dclose(run->rawdata);
+	if (run->data >= 0)
+		H5Dclose(run->data);
+	H5Fclose(run->file);
+	run->file = -1;
+}
+
+
+/*
+ *	Start the next run file
+ */
+static int openRunFile(tHDF5RunFile *run, cGlobal *global, unsigned runNumber) {
+
+	char	filename[1024];
+	hid_t	gid, stringtype, plist, type;
+	int		saveImages = (global->savePeaks != 2);
+	hsize_t	imagedims[3] = {1, (hsize_t) global->image_nx, (hsize_t) global->image_nx};
+	hsize_t	rawdims[3] = {1, 8*COLS, 8*ROWS};
+	hsize_t	columnchunk[1] = {HDF5_COLUMN_BLOCK};
+
+	if (runNumber != run->runNumber)
+		run->fileIndex = 0;
+	else
+		run->fileIndex++;
+	run->runNumber = runNumber;
+
+	sprintf(filename, "r%04u-hits-%03i.h5", runNumber, run->fileIndex);
+	printf("r%04u: Appending hits to %s\n", runNumber, filename);
+
+	run->file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if (run->file < 0) {
+		ERROR("Couldn't create file: %s\n", filename);
+		return -1;
+	}
+	run->nBytes = 0;
+
+	run->data = -1;
+	run->rawdata = -1;
+	if (saveImages) {
+		gid = H5Gcreate(run->file, "data", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		plist = imageCreatePlist(global, 3, imagedims);
+		run->data = createExtendibleDataset(gid, "data", H5T_STD_I16LE, 3, imagedims, plist);
+		H5Pclose(plist);
+		if (global->saveRaw) {
+			plist = imageCreatePlist(global, 3, rawdims);
+			run->rawdata = createExtendibleDataset(gid, "rawdata", H5T_STD_I16LE, 3, rawdims, plist);
+			H5Pclose(plist);
+		}
+		H5Gclose(gid);
+	}
+
+	run->peaks = -1;
+	run->peakPixels = -1;
+	if (global->savePeaks) {
+		gid = H5Gcreate(run->file, "peaks", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		type = peakType();
+		run->peaks = createPeakTable(gid, "peaks", type, 1024, global);
+		H5Tclose(type);
+		type = peakPixelType();
+		run->peakPixels = createPeakTable(gid, "pixels", type, 16384, global);
+		H5Tclose(type);
+		H5Gclose(gid);
+	}
+
+	gid = H5Gcreate(run->file, "LCLS", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	for(int c=0; c<HDF5_NCOLUMNS; c++)
+		run->columns[c] = createExtendibleDataset(gid, hdf5Columns[c].name, columnType(hdf5Columns[c].type), 1, columnchunk, H5P_DEFAULT);
+	stringtype = H5Tcopy(H5T_C_S1);
+	H5Tset_size(stringtype, H5T_VARIABLE);
+	run->eventName = createExtendibleDataset(gid, "eventName", stringtype, 1, columnchunk, H5P_DEFAULT);
+	run->eventTimeString = createExtendibleDataset(gid, "eventTimeString", stringtype, 1, columnchunk, H5P_DEFAULT);
+	H5Tclose(stringtype);
+	H5Lcreate_soft("/LCLS/eventTimeString", run->file, "/LCLS/eventTime", H5P_DEFAULT, H5P_DEFAULT);
+	H5Gclose(gid);
+
+	if ((saveImages && (run->data < 0 || (global->saveRaw && run->rawdata < 0)))
+		|| (global->savePeaks && (run->peaks < 0 || run->peakPixels < 0))) {
+		ERROR("Couldn't create datasets in %s\n", filename);
+		closeRunFile(run, global);
+		return -1;
+	}
+
+	run->image_nx = global->image_nx;
+	run->nEvents = 0;
+	run->nColumnRows = 0;
+	run->nBuffered = 0;
+	run->nPeakRows = 0;
+	run->nPixelRows = 0;
+	return 0;
+}
+
+
+/*
+ *	Append one event to the run file (hdf5Aggregate or savePeaks)
+ *	A new file is started for every run, when the image size changes, and once the current file
+ *	holds hdf5MaxEvents events or hdf5MaxSize MB of image data
+ */
+void appendHDF5(tThreadInfo *info, cGlobal *global, char *eventname) {
+
+	tHDF5RunFile	*run;
+	hsize_t			imagechunk[3] = {1, (hsize_t) global->image_nx, (hsize_t) global->image_nx};
+	hsize_t			rawchunk[3] = {1, 8*COLS, 8*ROWS};
+	hsize_t			tablerow[1] = {1};
+	char			timestr[64];
+	time_t			eventTime = info->seconds;
+	int				fail = 0;
+	double			imageBytes = 0, storedBytes;
+	double			tstart = hdf5Clock();
+	int				saveImages = (global->savePeaks != 2);
+	hid_t			type;
+
+	// Convert outside the lock
+	int16_t *buffer1 = NULL;
+	if (saveImages) {
+		buffer1 = (int16_t*) calloc(global->image_nn, sizeof(int16_t));
+		convertImage(info->image, buffer1, global->image_nn, global);
+	}
+	int16_t *buffer2 = NULL;
+	if (saveImages && global->saveRaw) {
+		buffer2 = (int16_t*) calloc(RAW_DATA_LENGTH, sizeof(int16_t));
+		convertImage(info->corrected_data, buffer2, RAW_DATA_LENGTH, global);
+	}
+	ctime_r(&eventTime, timestr);
+
+	lockHDF5();
+
+	if (global->hdf5RunFile == NULL) {
+		global->hdf5RunFile = (tHDF5RunFile*) calloc(1, sizeof(tHDF5RunFile));
+		global->hdf5RunFile->file = -1;
+		global->hdf5RunFile->runNumber = info->runNumber;
+		global->hdf5RunFile->fileIndex = -1;
+	}
+	run = global->hdf5RunFile;
+
+	// Time for a new file?
+	if (run->file >= 0 && (run->runNumber != info->runNumber
+						   || run->image_nx != global->image_nx
+						   || (global->hdf5MaxEvents > 0 && run->nEvents >= global->hdf5MaxEvents)
+						   || (global->hdf5MaxSize > 0 && run->nBytes >= global->hdf5MaxSize*1048576.))) {
+		closeRunFile(run, global);
+	}
+	if (run->file < 0)
+		fail = openRunFile(run, global, info->runNumber);
+
+	if (!fail) {
+		DEBUGL1_ONLY printf("r%04u:%i (%2.1f Hz): Appending %s as event %li\n", (int)info->runNumber, (int)info->threadNum, global->datarate, eventname, run->nEvents);
+
+		if (saveImages) {
+			fail = appendRows(run->data, H5T_NATIVE_INT16, 3, imagechunk, run->nEvents, 1, buffer1);
+			imageBytes += global->image_nn*sizeof(int16_t);
+		}
+		if (!fail && saveImages && global->saveRaw) {
+			fail = appendRows(run->rawdata, H5T_NATIVE_INT16, 3, rawchunk, run->nEvents, 1, buffer2);
+			imageBytes += RAW_DATA_LENGTH*sizeof(int16_t);
+		}
+		
+		// Peak lists refer to this event and to the rows already in the file
+		if (!fail && global->savePeaks) {
+			int64_t	firstPixel = run->nPixelRows;
+			for(long p=0; p<info->nPeakList; p++) {
+				info->peakList[p].event = (int) run->nEvents;
+				info->peakList[p].firstPixel = firstPixel;
+				firstPixel += info->peakList[p].nPixels;
+			}
+			for(long p=0; p<info->nPeakPixels; p++)
+				info->peakPixels[p].event = (int) run->nEvents;
+			
+			type = peakType();
+			if (info->nPeakList > 0)
+				fail = appendRows(run->peaks, type, 1, tablerow, run->nPeakRows, info->nPeakList, info->peakList);
+			H5Tclose(type);
+			type = peakPixelType();
+			if (!fail && info->nPeakPixels > 0)
+				fail = appendRows(run->peakPixels, type, 1, tablerow, run->nPixelRows, info->nPeakPixels, info->peakPixels);
+			H5Tclose(type);
+			if (!fail) {
+				run->nPeakRows += info->nPeakList;
+				run->nPixelRows += info->nPeakPixels;
+			}
+			imageBytes += info->nPeakList*sizeof(tPeak) + info->nPeakPixels*sizeof(tPeakPixel);
+		}
+		if (fail)
+			ERROR("%i: Couldn't append %s to run file\n", (int)info->threadNum, eventname);
+
+		// hdf5MaxSize refers to what is actually on disk, i.e. after compression
+		// (chunks still in the chunk cache are not counted until they are flushed)
+		storedBytes = storedSize(run);
+		addHDF5Statistics(global, imageBytes, storedBytes - run->nBytes, hdf5Clock() - tstart);
+		run->nBytes = storedBytes;
+	}
+
+	if (!fail) {
+		// Event data is buffered and written in blocks
+		for(int c=0; c<HDF5_NCOLUMNS; c++) {
+			size_t	n = columnSize(hdf5Columns[c].type);
+			if (run->columnBuffer[c] == NULL)
+				run->columnBuffer[c] = (char*) calloc(HDF5_COLUMN_BLOCK, n);
+			memcpy(run->columnBuffer[c] + run->nBuffered*n, (char*) info + hdf5Columns[c].offset, n);
+		}
+		run->eventNameBuffer[run->nBuffered] = strdup(eventname);
+		run->eventTimeBuffer[run->nBuffered] = strdup(timestr);
+		run->nBuffered++;
+		run->nEvents++;
+		if (run->nBuffered == HDF5_COLUMN_BLOCK)
+			flushColumns(run);
+	}
+
+	unlockHDF5();
+
+	free(buffer1);
+	free(buffer2);
+}
+
+
+/*
+ *	Close the run file so that it can be read while cheetah keeps running
+ *	The next hit starts a new file (of the same run)
+ */
+void closeHDF5RunFile(cGlobal *global) {
+
+	lockHDF5();
+	if (global->hdf5RunFile) {
+		closeRunFile(global->hdf5RunFile, global);
+		for(int c=0; c<HDF5_NCOLUMNS; c++) {
+			free(global->hdf5RunFile->columnBuffer[c]);
+			global->hdf5RunFile->columnBuffer[c] = NULL;
+		}
+	}
+	unlockHDF5();
+}
+
+
+/*
+ *	Table of frame records (frame log with frameLogFormat=1), /frames in a file of its own
+ *	Call with the HDF5 lock held
+ */
+hid_t createFrameTable(const char *filename, hid_t *file) {
+
+	hid_t	type, dataset_id;
+	hsize_t	dims[1] = {FRAMELOG_ROWS};
+
+	*file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+	if (*file < 0) {
+		printf("Could not create frame log %s\n", filename);
+		return -1;
+	}
+
+	type = frameRecordType();
+	dataset_id = createExtendibleDataset(*file, "frames", type, 1, dims, H5P_DEFAULT);
+	H5Tclose(type);
+	return dataset_id;
+}
+
+/*
+ *	Reopen the table of a frame log closed by closeFrameTable(), keeping the rows already written
+ *	Call with the HDF5 lock held
+ */
+hid_t openFrameTable(const char *filename, hid_t *file) {
+
+	hid_t	dataset_id;
+
+	*file = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
+	if (*file < 0) {
+		printf("Could not reopen frame log %s\n", filename);
+		return -1;
+	}
+
+	dataset_id = H5Dopen(*file, "frames", H5P_DEFAULT);
+	if (dataset_id < 0)
+		printf("Could not find /frames in frame log %s\n", filename);
+	return dataset_id;
+}
+
+int appendFrameTable(hid_t table, long offset, long nRows, const tFrameRecord *rows) {
+
+	hsize_t	chunk[1] = {FRAMELOG_ROWS};
+	hid_t	type = frameRecordType();
+	int		fail = appendRows(table, type, 1, chunk, offset, nRows, rows);
+	H5Tclose(type);
+	return fail;
+}
@@ -0,0 +1,84 @@
+/*
+ *  hdf5writer.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _hdf5writer_h
+#define _hdf5writer_h
+
+#include <stdint.h>
+#include <hdf5.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "framelog.h"
+
+// Number of per-event values buffered in memory before they are appended to the file
+#define HDF5_COLUMN_BLOCK	256
+
+// Per-event values stored as 1D columns in /LCLS (see hdf5Columns in hdf5writer.cpp)
+#define HDF5_NCOLUMNS		23
+
+/*
+ *	Run file that hits are appended to when hdf5Aggregate is set (r0123-hits-000.h5, r0123-hits-001.h5, ...)
+ *	Images go into extendible 3D datasets, one slice per event, event data into 1D columns
+ *	With savePeaks the peak lists go into two tables in /peaks, the event column refers to the rows in /LCLS
+ */
+typedef struct sHDF5RunFile {
+
+	hid_t		file;
+	hid_t		data;						// /data/data, assembled images
+	hid_t		rawdata;					// /data/rawdata, raw images (saveRaw only)
+	hid_t		columns[HDF5_NCOLUMNS];		// /LCLS/...
+	hid_t		eventName;					// /LCLS/eventName
+	hid_t		eventTimeString;			// /LCLS/eventTimeString
+	hid_t		peaks;						// /peaks/peaks, peak list of all events (savePeaks only)
+	hid_t		peakPixels;					// /peaks/pixels, their pixels and the sparse pixels
+
+	unsigned	runNumber;
+	int			fileIndex;					// rolls over when hdf5MaxEvents or hdf5MaxSize are reached
+	long		image_nx;					// image size the file was created for
+	long		nEvents;					// events in the file
+	double		nBytes;						// image (and peak list) bytes written to the file
+	long		nPeakRows;					// rows in /peaks/peaks
+	long		nPixelRows;					// rows in /peaks/pixels
+
+	// Event data not yet appended to the file
+	long		nColumnRows;				// rows already in the 1D datasets
+	long		nBuffered;
+	char		*columnBuffer[HDF5_NCOLUMNS];
+	char		*eventNameBuffer[HDF5_COLUMN_BLOCK];
+	char		*eventTimeBuffer[HDF5_COLUMN_BLOCK];
+
+} tHDF5RunFile;
+
+
+/*
+ *	Function prototypes
+ */
+void lockHDF5(void);
+void unlockHDF5(void);
+void appendHDF5(tThreadInfo*, cGlobal*, char*);
+void closeHDF5RunFile(cGlobal*);
+hid_t imageCreatePlist(cGlobal*, int, const hsize_t*);
+void convertImage(const float*, int16_t*, long, cGlobal*);
+void addHDF5Statistics(cGlobal*, double, double, double);
+void printHDF5Statistics(cGlobal*);
+double hdf5Clock(void);
+hid_t createFrameTable(const char*, hid_t*);
+hid_t openFrameTable(const char*, hid_t*);
+int appendFrameTable(hid_t, long, long, const tFrameRecord*);
+
+#endif
@@ -0,0 +1,153 @@
+/*
+ *  hdf5writer_bench.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Standalone benchmark of the saved image filters (make hdf5writer_bench)
+ *	Appends the same synthetic hits with appendHDF5() for a range of hdf5Compression, hdf5Shuffle,
+ *	hdf5Threshold and hdf5Quantize settings and reports the bytes stored and the write throughput
+ *
+ *	Usage: hdf5writer_bench [nHits] [-r]	(-r also saves the raw data, as saveRaw=1)
+ *	The r%04u-hits-000.h5 files are written to the current directory and removed again
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "hdf5writer.h"
+
+#define IMAGE_NX	1760		// assembled CSPAD image
+#define NFRAMES		8			// distinct synthetic hits, cycled through
+
+typedef struct {
+	int		compression;
+	int		shuffle;
+	float	threshold;
+	float	quantize;
+} tFilterSetting;
+
+static const tFilterSetting settings[] = {
+	{0, 0, 0, 0},
+	{1, 0, 0, 0},
+	{1, 1, 0, 0},
+	{4, 1, 0, 0},
+	{6, 1, 0, 0},
+	{9, 1, 0, 0},
+	{1, 1, 10, 0},
+	{1, 1, 0, 4},
+	{1, 1, 10, 4},
+	{4, 1, 10, 4},
+};
+
+
+/*
+ *	Noise of a few ADU around 0, a diffuse ring and a few hundred Bragg peaks, like a dark-subtracted hit
+ */
+static float noise(void) {
+	return (rand()%1000 + rand()%1000 + rand()%1000 - 1500)/100.f;
+}
+
+static void makeHit(float *data, long nx, long ny) {
+
+	for(long j=0; j<ny; j++) {
+		for(long i=0; i<nx; i++) {
+			double	r = sqrt((i-nx/2.)*(i-nx/2.) + (j-ny/2.)*(j-ny/2.));
+			data[i + j*nx] = noise() + 40*exp(-(r-0.3*nx)*(r-0.3*nx)/(2*30.*30.));
+		}
+	}
+	for(int p=0; p<300; p++) {
+		long	x = 2 + rand()%(nx-4);
+		long	y = 2 + rand()%(ny-4);
+		float	height = 100 + rand()%3000;
+		for(int dy=-2; dy<=2; dy++)
+			for(int dx=-2; dx<=2; dx++)
+				data[x+dx + (y+dy)*nx] += height*exp(-(dx*dx+dy*dy)/1.5);
+	}
+}
+
+
+int main(int argc, char **argv) {
+
+	cGlobal		*global = new cGlobal();
+	long		nHits = 20;
+	int			nSettings = sizeof(settings)/sizeof(settings[0]);
+
+	for(int a=1; a<argc; a++) {
+		if (!strcmp(argv[a], "-r"))
+			global->saveRaw = 1;
+		else
+			nHits = atol(argv[a]);
+	}
+
+	global->image_nx = IMAGE_NX;
+	global->image_nn = (long) IMAGE_NX*IMAGE_NX;
+	global->hdf5ChunkEvents = 1;
+
+	tThreadInfo	*threadInfo = (tThreadInfo*) calloc(1, sizeof(tThreadInfo));
+	float		*images[NFRAMES];
+	float		*raw[NFRAMES];
+	srand(13);
+	for(int f=0; f<NFRAMES; f++) {
+		images[f] = (float*) malloc(global->image_nn*sizeof(float));
+		makeHit(images[f], IMAGE_NX, IMAGE_NX);
+		raw[f] = (float*) malloc(RAW_DATA_LENGTH*sizeof(float));
+		makeHit(raw[f], 8*ROWS, 8*COLS);
+	}
+
+	printf("%li hits of %ix%i pixels%s\n", nHits, IMAGE_NX, IMAGE_NX, global->saveRaw ? " plus raw data" : "");
+	printf("deflate shuffle threshold quantize    image MB   stored MB   ratio      MB/s\n");
+
+	for(int s=0; s<nSettings; s++) {
+		global->hdf5Compression = settings[s].compression;
+		global->hdf5Shuffle = settings[s].shuffle;
+		global->hdf5Threshold = settings[s].threshold;
+		global->hdf5Quantize = settings[s].quantize;
+		global->hdf5EventsWritten = 0;
+		global->hdf5ImageBytes = 0;
+		global->hdf5StoredBytes = 0;
+		global->hdf5WriteTime = 0;
+
+		// A run of its own for each setting, timed including the chunks flushed when the file is closed
+		double	tstart = hdf5Clock();
+		for(long n=0; n<nHits; n++) {
+			char	eventname[64];
+			threadInfo->image = images[n % NFRAMES];
+			threadInfo->corrected_data = raw[n % NFRAMES];
+			threadInfo->runNumber = s+1;
+			threadInfo->threadNum = n;
+			sprintf(eventname, "LCLS_bench_%li", n);
+			appendHDF5(threadInfo, global, eventname);
+		}
+		closeHDF5RunFile(global);
+		double	seconds = hdf5Clock() - tstart;
+
+		printf("%7i %7i %9.0f %8.0f %11.1f %11.1f %7.2f %9.1f\n", settings[s].compression, settings[s].shuffle,
+			   settings[s].threshold, settings[s].quantize, global->hdf5ImageBytes/1048576., global->hdf5StoredBytes/1048576.,
+			   global->hdf5StoredBytes > 0 ? global->hdf5ImageBytes/global->hdf5StoredBytes : 0,
+			   global->hdf5ImageBytes/1048576./seconds);
+
+		char	filename[1024];
+		sprintf(filename, "r%04u-hits-%03i.h5", (unsigned) s+1, 0);
+		unlink(filename);
+	}
+
+	return 0;
+}
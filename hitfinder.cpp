@@ -24,40 +24,519 @@
 #include <stdlib.h>
 
 #include "hitfinder.h"
+#include "threadpool.h"
+#include "calibration.h"
 
 
 /*
- *	A basic hitfinder
+ *	Pixels above threshold are kept as bitmaps of the raw frame, one bit per pixel:
+ *	each row of pix_nx pixels takes bitmapWords(pix_nx) 64 bit words, unused bits at the end are 0
  */
-int hitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf) {
+static inline long bitmapWords(long nx) {
+	return (nx + 63) / 64;
+}
 
-	long	nat;
-    long    lastnat;
-	long	counter;
-	int		hit=0;
-	long	ii;
-//    long    jj;
-    long    nn;
+static inline int testBit(const uint64_t *row, long i) {
+	return (int) ((row[i >> 6] >> (i & 63)) & 1);
+}
 
-	nat = 0;
-	counter = 0;
+static inline void setBit(uint64_t *row, long i) {
+	row[i >> 6] |= (uint64_t) 1 << (i & 63);
+}
+
+// Word w of a row, keeping only the bits of pixels x0 <= i < x1
+static inline uint64_t spanBits(const uint64_t *row, long w, long x0, long x1) {
+	uint64_t	bits = row[w];
+	if (x0 > (w << 6))
+		bits &= ~(uint64_t) 0 << (x0 - (w << 6));
+	if (x1 < (w << 6) + 64)
+		bits &= ~(~(uint64_t) 0 << (x1 - (w << 6)));
+	return bits;
+}
+
+// Loop over the pixels i (relative to x0) of a row with bits set between x0 and x1, in increasing order
+#define FOR_EACH_BIT(row, x0, x1, i) \
+	for(long _w = (x0) >> 6; _w <= ((x1)-1) >> 6; _w++) \
+		for(uint64_t _bits = spanBits(row, _w, x0, x1); _bits && ((i = (_w << 6) + __builtin_ctzll(_bits) - (x0)), 1); _bits &= _bits - 1)
+
+// Number of bits set in i-1, i, i+1
+static inline int countBits3(const uint64_t *row, long i) {
+	long		s = i - 1;
+	long		b = s & 63;
+	uint64_t	x = row[s >> 6] >> b;
+	if (b > 61)
+		x |= row[(s >> 6) + 1] << (64 - b);
+	return __builtin_popcountll(x & 7);
+}
+
+// Clear i-1, i, i+1
+static inline void clearBits3(uint64_t *row, long i) {
+	long		s = i - 1;
+	long		b = s & 63;
+	row[s >> 6] &= ~((uint64_t) 7 << b);
+	if (b > 61)
+		row[(s >> 6) + 1] &= ~((uint64_t) 7 >> (64 - b));
+}
+
+// Set i-1, i, i+1
+static inline void setBits3(uint64_t *row, long i) {
+	long		s = i - 1;
+	long		b = s & 63;
+	row[s >> 6] |= (uint64_t) 7 << b;
+	if (b > 61)
+		row[(s >> 6) + 1] |= (uint64_t) 7 >> (64 - b);
+}
+
+
+/*
+ *	Threshold kernels: set the bits of one row of pixels with data*mask > adc (data > adc without a mask)
+ *	The mask is multiplied in float like the old masked copy of the frame, so the bits are exactly the pixels
+ *	the old code compared above threshold
+ */
+typedef void (*tThresholdKernel)(const float*, const int16_t*, float, uint64_t*, long);
+
+template <int MASK>
+static inline void thresholdRange(const float *data, const int16_t *mask, float adc, uint64_t *row, long start, long end) {
+	for(long i=start; i<end; i++) {
+		float x = data[i];
+		if (MASK)
+			x *= mask[i];
+		if (x > adc)
+			setBit(row, i);
+	}
+}
+
+template <int MASK>
+static void thresholdScalar(const float *data, const int16_t *mask, float adc, uint64_t *row, long nx) {
+	thresholdRange<MASK>(data, mask, adc, row, 0, nx);
+}
+
+
+#ifdef SIMD_HAVE_SSE2
+template <int MASK>
+static void thresholdSSE2(const float *data, const int16_t *mask, float adc, uint64_t *row, long nx) {
+
+	const __m128 a = _mm_set1_ps(adc);
+	long i = 0;
+
+	for(; i+64<=nx; i+=64) {
+		uint64_t	bits = 0;
+		for(long k=0; k<64; k+=4) {
+			__m128 x = _mm_loadu_ps(data+i+k);
+			if (MASK) {
+				__m128i m = _mm_loadl_epi64((const __m128i*) (mask+i+k));
+				m = _mm_srai_epi32(_mm_unpacklo_epi16(m, m), 16);
+				x = _mm_mul_ps(x, _mm_cvtepi32_ps(m));
+			}
+			bits |= (uint64_t) _mm_movemask_ps(_mm_cmpgt_ps(x, a)) << k;
+		}
+		row[i >> 6] = bits;
+	}
+	thresholdRange<MASK>(data, mask, adc, row, i, nx);
+}
+#endif
+
+
+#ifdef SIMD_HAVE_AVX2
+template <int MASK>
+__attribute__((target("avx2")))
+static void thresholdAVX2(const float *data, const int16_t *mask, float adc, uint64_t *row, long nx) {
+
+	const __m256 a = _mm256_set1_ps(adc);
+	long i = 0;
+
+	for(; i+64<=nx; i+=64) {
+		uint64_t	bits = 0;
+		for(long k=0; k<64; k+=8) {
+			__m256 x = _mm256_loadu_ps(data+i+k);
+			if (MASK) {
+				__m128i m = _mm_loadu_si128((const __m128i*) (mask+i+k));
+				x = _mm256_mul_ps(x, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(m)));
+			}
+			bits |= (uint64_t) _mm256_movemask_ps(_mm256_cmp_ps(x, a, _CMP_GT_OQ)) << k;
+		}
+		row[i >> 6] = bits;
+	}
+	thresholdRange<MASK>(data, mask, adc, row, i, nx);
+}
+#endif
+
+
+static tThresholdKernel thresholdKernel(cGlobal *global, int useMask) {
+
+	tThresholdKernel	kernel = useMask ? thresholdScalar<1> : thresholdScalar<0>;
+#ifdef SIMD_HAVE_SSE2
+	if (global->simdLevel == SIMD_SSE2)
+		kernel = useMask ? thresholdSSE2<1> : thresholdSSE2<0>;
+#endif
+#ifdef SIMD_HAVE_AVX2
+	if (global->simdLevel == SIMD_AVX2)
+		kernel = useMask ? thresholdAVX2<1> : thresholdAVX2<0>;
+#endif
+	return kernel;
+}
+
+
+/*
+ *	Bitmap of the pixels above hitfinderADC (within the peak mask if used), returns the number of bits set
+ */
+static long thresholdBitmap(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf, uint64_t *bitmap) {
+
+	tThresholdKernel	kernel = thresholdKernel(global, hitf->UsePeakmask);
+	long	nx = global->pix_nx;
+	long	words = bitmapWords(nx);
+	long	count = 0;
+	
+	memset(bitmap, 0, global->pix_ny*words*sizeof(uint64_t));
+	for(long j=0; j<global->pix_ny; j++) {
+		uint64_t	*row = bitmap + j*words;
+		kernel(threadInfo->corrected_data + j*nx, hitf->UsePeakmask ? hitf->peakmask + j*nx : NULL, (float) hitf->ADC, row, nx);
+		for(long w=0; w<words; w++)
+			count += __builtin_popcountll(row[w]);
+	}
+	return count;
+}
+
+
+/*
+ *	Unmasked bitmaps for several thresholds in one sweep over the frame 
+ *	(each row of data is thresholded against all of them while it is in cache)
+ */
+static void thresholdBitmaps(tThreadInfo *threadInfo, cGlobal *global, const int *adc, int nadc, uint64_t **bitmaps, long *counts) {
+
+	tThresholdKernel	kernel = thresholdKernel(global, 0);
+	long	nx = global->pix_nx;
+	long	words = bitmapWords(nx);
+	
+	for(int k=0; k<nadc; k++) {
+		memset(bitmaps[k], 0, global->pix_ny*words*sizeof(uint64_t));
+		counts[k] = 0;
+	}
+	for(long j=0; j<global->pix_ny; j++) {
+		const float	*data = threadInfo->corrected_data + j*nx;
+		for(int k=0; k<nadc; k++) {
+			uint64_t	*row = bitmaps[k] + j*words;
+			kernel(data, NULL, (float) adc[k], row, nx);
+			for(long w=0; w<words; w++)
+				counts[k] += __builtin_popcountll(row[w]);
+		}
+	}
+}
+
+
+/*
+ *	Algorithm 2: count 3x3 clusters of pixels above threshold
+ *	Scans the frame like the original pixel loop: wherever the 3x3 neighbourhood of a pixel above threshold
+ *	holds at least hitfinderCluster pixels above threshold, count a cluster and remove the neighbourhood.
+ *	Only pixels above threshold are visited (all interior pixels for hitfinderCluster <= 0, which the old
+ *	code counted regardless of the data). The old code removed pixels by setting them to 0, which 
+ *	still counts as above a negative threshold.
+ */
+static long countClusters(cGlobal *global, cHitfinder *hitf, uint64_t *bitmap) {
+
+	long	nx = global->pix_nx;
+	long	words = bitmapWords(nx);
+	long	nat = 0;
+	int		nn;
+
+	for(long j=1; j<global->pix_ny-1; j++) {
+		uint64_t	*up = bitmap + (j-1)*words;
+		uint64_t	*row = bitmap + j*words;
+		uint64_t	*down = bitmap + (j+1)*words;
+		long		i = 1;
+		
+		while(i < nx-1) {
+			// Next pixel above threshold (the row changes as clusters are removed)
+			if(hitf->Cluster > 0) {
+				uint64_t	x = row[i >> 6] >> (i & 63);
+				if(x == 0) {
+					i = (i | 63) + 1;
+					continue;
+				}
+				i += __builtin_ctzll(x);
+				if(i >= nx-1)
+					break;
+			}
+			
+			nn = 0;
+			if(testBit(row, i))
+				nn = countBits3(up, i) + countBits3(row, i) + countBits3(down, i);
+			if(nn >= hitf->Cluster) {
+				nat++;
+				if(hitf->ADC >= 0) {
+					clearBits3(up, i);
+					clearBits3(row, i);
+					clearBits3(down, i);
+				}
+				else {
+					setBits3(up, i);
+					setBits3(row, i);
+					setBits3(down, i);
+				}
+			}
+			i++;
+		}
+	}
+	return nat;
+}
+
+
+/*
+ *	Grow the peak lists of a frame as needed, they are kept with the frame buffer
+ */
+static void addPeakPixel(tThreadInfo *threadInfo, int peak, long fs, long ss, float value) {
+
+	if (threadInfo->nPeakPixels == threadInfo->peakPixelsSize) {
+		threadInfo->peakPixelsSize = (threadInfo->peakPixelsSize == 0) ? 4096 : 2*threadInfo->peakPixelsSize;
+		threadInfo->peakPixels = (tPeakPixel*) realloc(threadInfo->peakPixels, threadInfo->peakPixelsSize*sizeof(tPeakPixel));
+	}
+	tPeakPixel	*pixel = &threadInfo->peakPixels[threadInfo->nPeakPixels++];
+	pixel->event = 0;
+	pixel->peak = peak;
+	pixel->fs = (int16_t) fs;
+	pixel->ss = (int16_t) ss;
+	pixel->value = value;
+}
+
+
+/*
+ *	Grow the peak list of a frame by one peak
+ */
+static tPeak *addPeak(tThreadInfo *threadInfo) {
+
+	if (threadInfo->nPeakList == threadInfo->peakListSize) {
+		threadInfo->peakListSize = (threadInfo->peakListSize == 0) ? 256 : 2*threadInfo->peakListSize;
+		threadInfo->peakList = (tPeak*) realloc(threadInfo->peakList, threadInfo->peakListSize*sizeof(tPeak));
+	}
+	return &threadInfo->peakList[threadInfo->nPeakList++];
+}
+
+
+/*
+ *	Union-find on the provisional peak labels of one ASIC
+ */
+static int findLabel(int *parent, int l) {
+	while(parent[l] != l) {
+		parent[l] = parent[parent[l]];
+		l = parent[l];
+	}
+	return l;
+}
+
+static int mergeLabels(int *parent, int a, int b) {
+	a = findLabel(parent, a);
+	b = findLabel(parent, b);
+	if(a < b) {
+		parent[b] = a;
+		return a;
+	}
+	parent[a] = b;
+	return b;
+}
+
+
+/*
+ *	Count the peaks of one ASIC (module mi, mj of the 8x8 array of ROWS x COLS ASICs) for algorithm 3
+ *
+ *	Peaks are the 8-connected groups of pixels above hitfinderADC within the ASIC, found with a 
+ *	two-scan labelling: the first scan gives each pixel a provisional label and merges the labels 
+ *	of touching pixels, the second resolves them and measures each peak.
+ *	This counts exactly what the original flood fill counted:
+ *	- only peaks with at least one pixel off the ASIC border are found (the flood fill only started 
+ *	  from those), numbered in the order the first of these pixels is met
+ *	- the pixel count compared with MinPixCount/MaxPixCount includes the first pixel of the peak 
+ *	  twice unless the peak is a single pixel (the flood fill found it again from its neighbours)
+ *	With recordPeaks, accepted peaks are added to the peak list and their pixels marked in peakBitmap
+ */
+static long countASICPeaks(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf, const uint64_t *bitmap, uint64_t *peakBitmap, long mi, long mj, int recordPeaks) {
+
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	if (workerData->peakLabel == NULL) {
+		workerData->peakLabel = (int*) calloc(ROWS*COLS, sizeof(int));
+		workerData->peakParent = (int*) calloc(ROWS*COLS+1, sizeof(int));
+		workerData->peakSize = (int*) calloc(ROWS*COLS+1, sizeof(int));
+		workerData->peakNumber = (int*) calloc(ROWS*COLS+1, sizeof(int));
+		workerData->peakOrder = (int*) calloc(ROWS*COLS+1, sizeof(int));
+	}
+	int		*label = workerData->peakLabel;
+	int		*parent = workerData->peakParent;
+	int		*size = workerData->peakSize;
+	int		*number = workerData->peakNumber;
+	int		*order = workerData->peakOrder;
+	
+	long	pix_nx = global->pix_nx;
+	long	words = bitmapWords(pix_nx);
+	long	origin = mj*COLS*pix_nx + mi*ROWS;
+	long	x0 = mi*ROWS;
+	long	x1 = x0 + ROWS;
+	int		nlabels = 0;
+	long	nseeded = 0;
+	long	counter = 0;
+	long	idx, e, i;
+	int		l, n;
+
+	
+	/*
+	 *	First scan: provisional labels, merging with the labelled neighbours already visited
+	 *	(all scans only visit the pixels above threshold)
+	 */
+	for(long j=0; j<COLS; j++) {
+		const uint64_t	*row = bitmap + (j+mj*COLS)*words;
+		memset(label + j*ROWS, 0, ROWS*sizeof(int));
+		FOR_EACH_BIT(row, x0, x1, i) {
+			idx = i + j*ROWS;
+			l = 0;
+			if(i > 0 && (n = label[idx-1]))
+				l = n;
+			if(j > 0) {
+				if(i > 0 && (n = label[idx-ROWS-1]))
+					l = l ? mergeLabels(parent, l, n) : n;
+				if((n = label[idx-ROWS]))
+					l = l ? mergeLabels(parent, l, n) : n;
+				if(i < ROWS-1 && (n = label[idx-ROWS+1]))
+					l = l ? mergeLabels(parent, l, n) : n;
+			}
+			if(l == 0) {
+				l = ++nlabels;
+				parent[l] = l;
+			}
+			label[idx] = l;
+		}
+	}
+	if(nlabels == 0)
+		return 0;
 
+	
 	/*
-	 *	Use a data buffer so we can zero out pixels already counted
+	 *	Second scan: resolve labels, measure the peaks and note the order in which they are seeded
+	 *	(number[] is -1 until the first pixel off the border is met, then -2, or the index in the peak list once recorded)
 	 */
-	float *temp = (float*) calloc(global->pix_nn, sizeof(float));
-	memcpy(temp, threadInfo->corrected_data, global->pix_nn*sizeof(float));
+	for(l=1; l<=nlabels; l++) {
+		size[l] = 0;
+		number[l] = -1;
+	}
+	for(long j=0; j<COLS; j++) {
+		const uint64_t	*row = bitmap + (j+mj*COLS)*words;
+		FOR_EACH_BIT(row, x0, x1, i) {
+			idx = i + j*ROWS;
+			l = findLabel(parent, label[idx]);
+			label[idx] = l;
+			size[l]++;
+			if(number[l] == -1 && i > 0 && i < ROWS-1 && j > 0 && j < COLS-1) {
+				number[l] = -2;
+				order[nseeded++] = l;
+			}
+		}
+	}
+
 	
+	/*
+	 *	Peak or junk?
+	 */
+	long	npixels = 0;
+	for(long k=0; k<nseeded; k++) {
+		l = order[k];
+		long nat = size[l] + (size[l] > 1 ? 1 : 0);
+		if(nat>=hitf->MinPixCount && nat<=hitf->MaxPixCount) {
+			counter++;
+			if(recordPeaks) {
+				tPeak	*peak = addPeak(threadInfo);
+				number[l] = (int) (peak - threadInfo->peakList);
+				peak->event = 0;
+				peak->nPixels = size[l];
+				peak->firstPixel = threadInfo->nPeakPixels + npixels;		// index in the frame for now
+				npixels += size[l];
+				size[l] = 0;				// pixels recorded so far
+			}
+		}
+	}
+	if(npixels == 0)
+		return counter;
+
 	
 	/*
-	 *	Apply peak search mask 
-	 *	(multiply data by 0 to ignore regions)
+	 *	Record the pixels of the accepted peaks, grouped by peak
 	 */
-	if(hitf->UsePeakmask) {
-		for(long i=0;i<global->pix_nn;i++){
-			temp[i] *= hitf->peakmask[i]; 
+	if (threadInfo->nPeakPixels + npixels > threadInfo->peakPixelsSize) {
+		while (threadInfo->nPeakPixels + npixels > threadInfo->peakPixelsSize)
+			threadInfo->peakPixelsSize = (threadInfo->peakPixelsSize == 0) ? 4096 : 2*threadInfo->peakPixelsSize;
+		threadInfo->peakPixels = (tPeakPixel*) realloc(threadInfo->peakPixels, threadInfo->peakPixelsSize*sizeof(tPeakPixel));
+	}
+	for(long j=0; j<COLS; j++) {
+		const uint64_t	*row = bitmap + (j+mj*COLS)*words;
+		FOR_EACH_BIT(row, x0, x1, i) {
+			idx = i + j*ROWS;
+			l = label[idx];
+			if(number[l] < 0)
+				continue;
+			tPeakPixel	*pixel = &threadInfo->peakPixels[threadInfo->peakList[number[l]].firstPixel + size[l]++];
+			e = origin + i + j*pix_nx;
+			pixel->event = 0;
+			pixel->peak = number[l];
+			pixel->fs = (int16_t) (i + mi*ROWS);
+			pixel->ss = (int16_t) (j + mj*COLS);
+			pixel->value = threadInfo->corrected_data[e];
+			setBit(peakBitmap + (j+mj*COLS)*words, i+mi*ROWS);
 		}
 	}
+	threadInfo->nPeakPixels += npixels;
+
+	// Total intensity and intensity weighted centroid
+	for(long p=threadInfo->nPeakList-counter; p<threadInfo->nPeakList; p++) {
+		tPeak	*peak = &threadInfo->peakList[p];
+		double	sum = 0, sumfs = 0, sumss = 0;
+		for(long q=peak->firstPixel; q<peak->firstPixel+peak->nPixels; q++) {
+			tPeakPixel	*pixel = &threadInfo->peakPixels[q];
+			sum += pixel->value;
+			sumfs += pixel->value*pixel->fs;
+			sumss += pixel->value*pixel->ss;
+		}
+		tPeakPixel	*first = &threadInfo->peakPixels[peak->firstPixel];
+		peak->total = (float) sum;
+		peak->fs = (float) (sum > 0 ? sumfs/sum : first->fs);
+		peak->ss = (float) (sum > 0 ? sumss/sum : first->ss);
+	}
+	
+	return counter;
+}
+
+
+/*
+ *	Bitmaps used by the hitfinders of a worker
+ */
+static tWorkerData *hitfinderData(tThreadInfo *threadInfo, cGlobal *global) {
+
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	if (workerData->hitBitmap == NULL) {
+		long	bitmapSize = global->pix_ny*bitmapWords(global->pix_nx);
+		workerData->hitBitmap = (uint64_t*) calloc(bitmapSize, sizeof(uint64_t));
+		workerData->peakBitmap = (uint64_t*) calloc(bitmapSize, sizeof(uint64_t));
+		for(int k=0; k<NHITFINDERS; k++)
+			workerData->adcBitmap[k] = (uint64_t*) calloc(bitmapSize, sizeof(uint64_t));
+	}
+	return workerData;
+}
+
+
+/*
+ *	Run the hitfinder algorithm on the bitmap of pixels above threshold (nat of them)
+ *	Algorithm 2 removes the pixels it has counted from the bitmap
+ */
+static int evaluateHitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf, uint64_t *bitmap, long nat) {
+
+	long	counter;
+	int		hit=0;
+
+	counter = 0;
+	
+	// Keep the peaks of the standard hitfinder for the output (savePeaks)
+	int recordPeaks = (global->savePeaks && hitf == &global->hitfinder);
+	uint64_t	*peakBitmap = global->workerData[threadInfo->workerNum].peakBitmap;
+	if(recordPeaks) {
+		threadInfo->nPeakList = 0;
+		threadInfo->nPeakPixels = 0;
+		memset(peakBitmap, 0, global->pix_ny*bitmapWords(global->pix_nx)*sizeof(uint64_t));
+	}
 	
 	
 	/*
@@ -66,11 +545,6 @@ int hitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf) {
 	switch(hitf->Algorithm) {
 		
 		case 1 :	// Simply count the number of pixels above ADC threshold (very basic)
-			for(long i=0;i<global->pix_nn;i++){
-				if(temp[i] > hitf->ADC){
-					nat++;
-				}
-			}
 			threadInfo->nPeaks = (int)nat;
 			if(nat >= hitf->NAT)
 				hit = 1;
@@ -78,35 +552,7 @@ int hitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf) {
 
 	
 		case 2 :	//	Count clusters of pixels above threshold
-			for(long j=1; j<8*COLS-1; j++){
-				for(long i=1; i<8*ROWS-1; i++) {
-					nn = 0;
-					ii = i+(8*ROWS)*j;
-					if(temp[i+(8*ROWS)*j] > hitf->ADC) {
-						nn += 1;
-						if(temp[i+1+(8*ROWS)*j] > hitf->ADC) nn++;
-						if(temp[i-1+(8*ROWS)*j] > hitf->ADC) nn++;
-						if(temp[i+(8*ROWS)*(j+1)] > hitf->ADC) nn++;
-						if(temp[i+1+(8*ROWS)*(j+1)] > hitf->ADC) nn++;
-						if(temp[i-1+(8*ROWS)*(j+1)] > hitf->ADC) nn++;
-						if(temp[i+(8*ROWS)*(j-1)] > hitf->ADC) nn++;
-						if(temp[i+1+(8*ROWS)*(j-1)] > hitf->ADC) nn++;
-						if(temp[i-1+(8*ROWS)*(j-1)] > hitf->ADC) nn++;
-					}
-					if(nn >= hitf->Cluster) {
-						nat++;
-						temp[i+(8*ROWS)*j] = 0;
-						temp[i+1+(8*ROWS)*j] = 0;
-						temp[i-1+(8*ROWS)*j] = 0;
-						temp[i+(8*ROWS)*(j+1)] = 0;
-						temp[i+1+(8*ROWS)*(j+1)] = 0;
-						temp[i-1+(8*ROWS)*(j+1)] = 0;
-						temp[i+(8*ROWS)*(j-1)] = 0;
-						temp[i+1+(8*ROWS)*(j-1)] = 0;
-						temp[i-1+(8*ROWS)*(j-1)] = 0;
-					}
-				}
-			}
+			nat = countClusters(global, hitf, bitmap);
 			threadInfo->nPeaks = (int)nat;
 			if(nat >= hitf->MinPixCount)
 				hit = 1;
@@ -117,92 +563,233 @@ int hitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf) {
 	
 		case 3 : 	// Real peak counter
 		default:
-			int search_x[] = {-1,0,1,-1,1,-1,0,1};
-			int search_y[] = {-1,-1,-1,0,0,1,1,1};
-			int	search_n = 8;
-			long e;
-			long *inx = (long *) calloc(global->pix_nn, sizeof(long));
-			long *iny = (long *) calloc(global->pix_nn, sizeof(long));
 			// Loop over modules (8x8 array)
 			for(long mj=0; mj<8; mj++){
 				for(long mi=0; mi<8; mi++){
-					
-					// Loop over pixels within a module
-					for(long j=1; j<COLS-1; j++){
-						for(long i=1; i<ROWS-1; i++){
-
-							e = (j+mj*COLS)*global->pix_nx;
-							e += i+mi*ROWS;
-
-							//if(e >= global->pix_nn)
-							//	printf("Array bounds error: e=%i\n");
-							
-							if(temp[e] > hitf->ADC){
-								// This might be the start of a peak - start searching
-								inx[0] = i;
-								iny[0] = j;
-								nat = 1;
-								
-								// Keep looping until the pixel count within this peak does not change (!)
-								do {
-									lastnat = nat;
-									// Loop through points known to be within this peak
-									for(long p=0; p<nat; p++){
-										// Loop through search pattern
-										for(long k=0; k<search_n; k++){
-											// Array bounds check
-											if((inx[p]+search_x[k]) < 0)
-												continue;
-											if((inx[p]+search_x[k]) >= ROWS)
-												continue;
-											if((iny[p]+search_y[k]) < 0)
-												continue;
-											if((iny[p]+search_y[k]) >= COLS)
-												continue;
-											
-											// Neighbour point 
-											e = (iny[p]+search_y[k]+mj*COLS)*global->pix_nx;
-											e += inx[p]+search_x[k]+mi*ROWS;
-											
-											//if(e < 0 || e >= global->pix_nn){
-											//	printf("Array bounds error: e=%i\n",e);
-											//	continue;
-											//}
-											
-											// Above threshold?
-											if(temp[e] > hitf->ADC){
-												//if(nat < 0 || nat >= global->pix_nn) {
-												//	printf("Array bounds error: nat=%i\n",nat);
-												//	break
-												//}
-												temp[e] = 0;
-												inx[nat] = inx[p]+search_x[k];
-												iny[nat] = iny[p]+search_y[k];
-												nat++; 
-											}
-										}
-									}
-								} while(lastnat != nat);
-								
-								// Peak or junk?
-								if(nat>=hitf->MinPixCount && nat<=hitf->MaxPixCount) {
-									counter ++;
-								}
-							}
-						}
-					}
+					counter += countASICPeaks(threadInfo, global, hitf, bitmap, peakBitmap, mi, mj, recordPeaks);
 				}
 			}	
 			// Hit?
 			threadInfo->nPeaks = (int)counter;
 			if(counter >= hitf->Npeaks && counter <= hitf->NpeaksMax)
 				hit = 1;
-			
-			free(inx);
-			free(iny);
 			break;
 	}
 	
-	free(temp);
+	
+	/*
+	 *	Sparse encoding of the bright pixels outside the recorded peaks
+	 */
+	if(recordPeaks && global->sparseADC > 0) {
+		long	words = bitmapWords(global->pix_nx);
+		for(long j=0; j<global->pix_ny; j++) {
+			const float		*data = threadInfo->corrected_data + j*global->pix_nx;
+			const uint64_t	*peakRow = peakBitmap + j*words;
+			for(long i=0; i<global->pix_nx; i++) {
+				if(data[i] > global->sparseADC && !testBit(peakRow, i))
+					addPeakPixel(threadInfo, -1, i, j, data[i]);
+			}
+		}
+	}
+	
 	return(hit);
 }
+
+
+/*
+ *	A basic hitfinder
+ */
+int hitfinder(tThreadInfo *threadInfo, cGlobal *global, cHitfinder *hitf) {
+
+	tWorkerData	*workerData = hitfinderData(threadInfo, global);
+	long		nat = thresholdBitmap(threadInfo, global, hitf, workerData->hitBitmap);
+	return evaluateHitfinder(threadInfo, global, hitf, workerData->hitBitmap, nat);
+}
+
+
+/*
+ *	Run all enabled hitfinders on a frame (standard, water, ice, background and list)
+ *
+ *	The frame is thresholded once for each distinct hitfinderADC, in a single sweep, and the 
+ *	hitfinders share these bitmaps. Peak masks are ANDed in as bitmaps (see prepareHitfinders), 
+ *	only peak masks with values other than 0 and 1 need a separate pass over the frame.
+ *	Results are the same as calling hitfinder() for each of them in turn.
+ */
+void hitfinders(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+
+	cHitfinder	*finders[NHITFINDERS] = {&global->hitfinder, &global->waterfinder, &global->icefinder, &global->backgroundfinder, &global->listfinder};
+	int			*result[NHITFINDERS] = {&hit->standard, &hit->water, &hit->ice, &hit->background, &hit->list};
+	int			*peaks[NHITFINDERS] = {&hit->standardPeaks, &hit->waterPeaks, &hit->icePeaks, &hit->backgroundPeaks, &hit->listPeaks};
+	int			adc[NHITFINDERS];
+	int			shared[NHITFINDERS];
+	long		counts[NHITFINDERS];
+	int			nadc = 0;
+	
+	hit->standard = 0;
+	hit->water = 0;
+	hit->ice = 0;
+	hit->background = 1;
+	hit->list = 0;
+	
+	// Finders that are not in use report no peaks (frame log and statistics list all of them)
+	for(int f=0; f<NHITFINDERS; f++)
+		*peaks[f] = 0;
+	
+	
+	/*
+	 *	Distinct thresholds of the hitfinders that can share bitmaps
+	 */
+	for(int f=0; f<NHITFINDERS; f++) {
+		shared[f] = -1;
+		if(!finders[f]->use || (finders[f]->UsePeakmask && finders[f]->peakmaskBits == NULL))
+			continue;
+		for(int k=0; k<nadc; k++)
+			if(adc[k] == finders[f]->ADC)
+				shared[f] = k;
+		if(shared[f] < 0) {
+			adc[nadc] = finders[f]->ADC;
+			shared[f] = nadc++;
+		}
+	}
+	
+	tWorkerData	*workerData = hitfinderData(threadInfo, global);
+	if(nadc > 0)
+		thresholdBitmaps(threadInfo, global, adc, nadc, workerData->adcBitmap, counts);
+	
+	
+	/*
+	 *	Evaluate the hitfinders in the usual order
+	 */
+	long	bitmapSize = global->pix_ny*bitmapWords(global->pix_nx);
+	for(int f=0; f<NHITFINDERS; f++) {
+		cHitfinder	*hitf = finders[f];
+		uint64_t	*bitmap = workerData->hitBitmap;
+		long		nat;
+		
+		if(!hitf->use)
+			continue;
+		
+		if(shared[f] < 0)
+			nat = thresholdBitmap(threadInfo, global, hitf, bitmap);
+		else if(hitf->UsePeakmask) {
+			const uint64_t	*all = workerData->adcBitmap[shared[f]];
+			nat = 0;
+			for(long w=0; w<bitmapSize; w++) {
+				bitmap[w] = all[w] & hitf->peakmaskBits[w];
+				nat += __builtin_popcountll(bitmap[w]);
+			}
+		}
+		else {
+			// Algorithm 2 modifies its bitmap, the others can use the shared one directly
+			nat = counts[shared[f]];
+			if(hitf->Algorithm == 2)
+				memcpy(bitmap, workerData->adcBitmap[shared[f]], bitmapSize*sizeof(uint64_t));
+			else
+				bitmap = workerData->adcBitmap[shared[f]];
+		}
+		
+		*result[f] = evaluateHitfinder(threadInfo, global, hitf, bitmap, nat);
+		*peaks[f] = threadInfo->nPeaks;
+	}
+}
+
+
+/*
+ *	Peak masks as bitmaps, so that hitfinders can share the thresholded frame
+ *	This is exact when the mask only holds 0 and 1 and hitfinderADC >= 0 
+ *	(masked pixels were multiplied by 0 and never exceeded the threshold), otherwise 
+ *	the hitfinder keeps thresholding the masked frame itself
+ */
+void prepareHitfinders(cGlobal *global) {
+
+	cHitfinder	*finders[NHITFINDERS] = {&global->hitfinder, &global->waterfinder, &global->icefinder, &global->backgroundfinder, &global->listfinder};
+	long		words = bitmapWords(global->pix_nx);
+	
+	for(int f=0; f<NHITFINDERS; f++) {
+		cHitfinder	*hitf = finders[f];
+		hitf->peakmaskBits = NULL;
+		if(!hitf->use || !hitf->UsePeakmask || hitf->peakmask == NULL || hitf->ADC < 0)
+			continue;
+		
+		int	binary = 1;
+		for(long i=0; i<global->pix_nn && binary; i++)
+			if(hitf->peakmask[i] != 0 && hitf->peakmask[i] != 1)
+				binary = 0;
+		if(!binary) {
+			printf("Peak search mask %s is not just 0 and 1, this hitfinder thresholds the frame separately\n", hitf->peaksearchFile);
+			continue;
+		}
+		
+		hitf->peakmaskBits = (uint64_t*) calloc(global->pix_ny*words, sizeof(uint64_t));
+		for(long j=0; j<global->pix_ny; j++)
+			for(long i=0; i<global->pix_nx; i++)
+				if(hitf->peakmask[i + j*global->pix_nx])
+					setBit(hitf->peakmaskBits + j*words, i);
+	}
+}
+
+
+
+/*
+ *	Pixels looked at by the pre-screen: every prescreenStride-th pixel along both axes of the raw frame
+ *	that lies within the peak mask of one of the hitfinders in use (or anywhere, if one of them 
+ *	searches the whole detector) and is not marked bad. Their thresholds include the darkcal, 
+ *	so the pre-screen can work on the uncorrected frame.
+ */
+void preparePrescreen(cGlobal *global) {
+	
+	if(!global->prescreen)
+		return;
+	
+	cHitfinder	*finders[3] = {&global->hitfinder, &global->waterfinder, &global->icefinder};
+	int			wholeDetector = 0;
+	for(int f=0; f<3; f++)
+		if(finders[f]->use && (!finders[f]->UsePeakmask || finders[f]->peakmask == NULL))
+			wholeDetector = 1;
+	
+	long	stride = global->prescreenStride;
+	long	n = 0;
+	global->prescreenPixels = (int32_t*) malloc(((global->pix_nx+stride-1)/stride)*((global->pix_ny+stride-1)/stride)*sizeof(int32_t));
+	for(long j=0; j<global->pix_ny; j+=stride) {
+		for(long i=0; i<global->pix_nx; i+=stride) {
+			long	e = i + j*global->pix_nx;
+			int		inside = wholeDetector;
+			for(int f=0; f<3 && !inside; f++)
+				inside = finders[f]->use && finders[f]->peakmask[e] != 0;
+			if(global->badpixelFactor && global->badpixelFactor[e] == 0)
+				inside = 0;
+			if(inside)
+				global->prescreenPixels[n++] = (int32_t) e;
+		}
+	}
+	
+	global->nPrescreenPixels = n;
+	global->prescreenThreshold = (float*) malloc(n*sizeof(float));
+	for(long k=0; k<n; k++) {
+		global->prescreenThreshold[k] = global->prescreenADC;
+		if(global->darkcalOffset)
+			global->prescreenThreshold[k] += global->darkcalOffset[global->prescreenPixels[k]];
+	}
+	printf("Pre-screening frames on %li pixels (1 in %li), prescreenADC=%i, prescreenNAT=%i\n", n, stride*stride, global->prescreenADC, global->prescreenNAT);
+}
+
+
+/*
+ *	Cheap test on the raw frame, before any corrections: returns 0 if fewer than prescreenNAT of the 
+ *	sampled pixels are more than prescreenADC above the darkcal, in which case the frame cannot be a hit
+ *	(as long as prescreenADC and prescreenNAT are set loosely enough, see nPrescreenMissed)
+ */
+int prescreenFrame(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	const float		*data = threadInfo->corrected_data;
+	const int32_t	*pixels = global->prescreenPixels;
+	const float		*threshold = global->prescreenThreshold;
+	long			nat = 0;
+	
+	for(long k=0; k<global->nPrescreenPixels; k++) {
+		nat += (data[pixels[k]] > threshold[k]);
+		if(nat >= global->prescreenNAT)
+			return 1;
+	}
+	return (nat >= global->prescreenNAT);
+}
@@ -28,5 +28,9 @@
  *	Function prototypes
  */
 int  hitfinder(tThreadInfo*, cGlobal*, cHitfinder*);
+void hitfinders(tThreadInfo*, cGlobal*, cHit*);
+void prepareHitfinders(cGlobal*);
+void preparePrescreen(cGlobal*);
+int  prescreenFrame(tThreadInfo*, cGlobal*);
 
 #endif
@@ -0,0 +1,197 @@
+/*
+ *  hitfinder_check.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Standalone check of hitfinder algorithm 3 (make hitfinder_check)
+ *	Compares the peak counts of hitfinder() with the flood fill it replaced, on random frames
+ *	with noise, hot pixels and peaks of all sizes, also across the ASIC borders
+ *	Exits with 1 if any frame gives a different peak count or hit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "threadpool.h"
+#include "hitfinder.h"
+
+#define NFRAMES		40
+
+
+/*
+ *	Peak counter of algorithm 3 before the union-find labelling, kept as the reference
+ *	Note the seed pixel is not cleared, so it is found again by its neighbours and multi-pixel
+ *	peaks count it twice, and peaks only start from pixels off the ASIC border
+ */
+static long referencePeakCount(const float *data, cGlobal *global, cHitfinder *hitf) {
+
+	int search_x[] = {-1,0,1,-1,1,-1,0,1};
+	int search_y[] = {-1,-1,-1,0,0,1,1,1};
+	int	search_n = 8;
+	long e;
+	long nat, lastnat;
+	long counter = 0;
+	float *temp = (float*) calloc(global->pix_nn, sizeof(float));
+	long *inx = (long *) calloc(global->pix_nn, sizeof(long));
+	long *iny = (long *) calloc(global->pix_nn, sizeof(long));
+
+	memcpy(temp, data, global->pix_nn*sizeof(float));
+	if(hitf->UsePeakmask) {
+		for(long i=0;i<global->pix_nn;i++){
+			temp[i] *= hitf->peakmask[i];
+		}
+	}
+
+	// Loop over modules (8x8 array)
+	for(long mj=0; mj<8; mj++){
+		for(long mi=0; mi<8; mi++){
+
+			// Loop over pixels within a module
+			for(long j=1; j<COLS-1; j++){
+				for(long i=1; i<ROWS-1; i++){
+
+					e = (j+mj*COLS)*global->pix_nx;
+					e += i+mi*ROWS;
+
+					if(temp[e] > hitf->ADC){
+						// This might be the start of a peak - start searching
+						inx[0] = i;
+						iny[0] = j;
+						nat = 1;
+
+						// Keep looping until the pixel count within this peak does not change (!)
+						do {
+							lastnat = nat;
+							// Loop through points known to be within this peak
+							for(long p=0; p<nat; p++){
+								// Loop through search pattern
+								for(long k=0; k<search_n; k++){
+									// Array bounds check
+									if((inx[p]+search_x[k]) < 0)
+										continue;
+									if((inx[p]+search_x[k]) >= ROWS)
+										continue;
+									if((iny[p]+search_y[k]) < 0)
+										continue;
+									if((iny[p]+search_y[k]) >= COLS)
+										continue;
+
+									// Neighbour point
+									e = (iny[p]+search_y[k]+mj*COLS)*global->pix_nx;
+									e += inx[p]+search_x[k]+mi*ROWS;
+
+									// Above threshold?
+									if(temp[e] > hitf->ADC){
+										temp[e] = 0;
+										inx[nat] = inx[p]+search_x[k];
+										iny[nat] = iny[p]+search_y[k];
+										nat++;
+									}
+								}
+							}
+						} while(lastnat != nat);
+
+						// Peak or junk?
+						if(nat>=hitf->MinPixCount && nat<=hitf->MaxPixCount)
+							counter ++;
+					}
+				}
+			}
+		}
+	}
+
+	free(temp);
+	free(inx);
+	free(iny);
+	return counter;
+}
+
+
+/*
+ *	Noise with a given fraction of hot pixels, plus square peaks of up to 9x9 pixels,
+ *	some of them placed on the edges of the ASICs
+ */
+static void makeFrame(float *data, cGlobal *global, double density, int npeaks) {
+
+	for(long i=0; i<global->pix_nn; i++)
+		data[i] = (rand()/(double)RAND_MAX < density) ? 100+rand()%500 : rand()%50;
+
+	for(int p=0; p<npeaks; p++) {
+		long	size = 1 + rand()%9;
+		long	x = rand() % global->pix_nx;
+		long	y = rand() % global->pix_ny;
+		if(p % 4 == 0)
+			x -= x % ROWS;
+		else if(p % 4 == 1)
+			y = y - y % COLS + COLS - 1;
+		for(long j=y; j<y+size && j<global->pix_ny; j++)
+			for(long i=x; i<x+size && i<global->pix_nx; i++)
+				data[i + j*global->pix_nx] = 200 + rand()%1000;
+	}
+}
+
+
+int main(int argc, char **argv) {
+
+	cGlobal		*global = new cGlobal();
+	cHitfinder	*hitf = &global->hitfinder;
+	int			bad = 0;
+
+	global->pix_nx = 8*ROWS;
+	global->pix_ny = 8*COLS;
+	global->pix_nn = global->pix_nx*global->pix_ny;
+	global->nThreads = 1;
+	global->workerData = (tWorkerData*) calloc(1, sizeof(tWorkerData));
+
+	hitf->use = 1;
+	hitf->Algorithm = 3;
+	hitf->peakmask = (int16_t*) calloc(global->pix_nn, sizeof(int16_t));
+	for(long i=0; i<global->pix_nn; i++)
+		hitf->peakmask[i] = (rand()%7 != 0);
+
+	tThreadInfo	*threadInfo = (tThreadInfo*) calloc(1, sizeof(tThreadInfo));
+	threadInfo->pGlobal = global;
+	threadInfo->corrected_data = (float*) calloc(global->pix_nn, sizeof(float));
+
+	srand(7);
+	for(int frame=0; frame<NFRAMES; frame++) {
+		makeFrame(threadInfo->corrected_data, global, 0.01 + 0.08*(frame%5), 50*(frame%3));
+		hitf->ADC = (frame % 2) ? 99 : 150;
+		hitf->MinPixCount = 1 + frame%4;
+		hitf->MaxPixCount = 3 + (frame*7)%40;
+		hitf->Npeaks = 5 + frame%100;
+		hitf->NpeaksMax = (frame % 3) ? 100000 : 500;
+		hitf->UsePeakmask = (frame % 4 == 3);
+		global->savePeaks = (frame % 2);
+
+		long	expected = referencePeakCount(threadInfo->corrected_data, global, hitf);
+		int		expectedHit = (expected >= hitf->Npeaks && expected <= hitf->NpeaksMax);
+		int		hit = hitfinder(threadInfo, global, hitf);
+
+		if(threadInfo->nPeaks != expected || hit != expectedHit || (global->savePeaks && threadInfo->nPeakList != expected)) {
+			printf("Frame %i: %i peaks (hit %i), expected %li (hit %i)\n", frame, threadInfo->nPeaks, hit, expected, expectedHit);
+			bad++;
+		}
+		else if(argc > 1 && !strcmp(argv[1], "-v"))
+			printf("Frame %i: %i peaks, hit %i\n", frame, threadInfo->nPeaks, hit);
+	}
+
+	printf("Hitfinder algorithm 3: %i of %i frames differ from the flood fill\n", bad, NFRAMES);
+	return bad ? 1 : 0;
+}
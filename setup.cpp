@@ -48,8 +48,13 @@ using std::string;
 
 #include "setup.h"
 #include "worker.h"
+#include "framelog.h"
+#include "statistics.h"
 #include "data2d.h"
 #include "attenuation.h"
+#include "calibration.h"
+#include "geometry.h"
+#include "xcca.h"
 #include "arrayclasses.h"
 #include "arraydataIO.h"
 #include "util.h"
@@ -112,6 +117,7 @@ void cGlobal::defaultConfiguration(void) {
 	cmDelta = 20;
 	cmFloor = 0.02;
 	cmSaveHistograms = 0;
+	cmThreads = 1;
 	
 	// Gain calibration correction
 	strcpy(gaincalFile, "gaincal.h5");
@@ -122,6 +128,7 @@ void cGlobal::defaultConfiguration(void) {
 	// Subtraction of running background (persistent photon background) 
 	useSubtractPersistentBackground = 0;
 	bgMemory = 50;
+	bgRecalc = 5;
 	startFrames = 0;
 	scaleBackground = 0;
 	
@@ -130,6 +137,7 @@ void cGlobal::defaultConfiguration(void) {
 	hotpixFreq = 0.9;
 	hotpixADC = 1000;
 	hotpixMemory = 50;
+	hotpixRecalc = 10;
 	
 	// Polarization correction
 	usePolarizationCorrection = 0;
@@ -137,6 +145,7 @@ void cGlobal::defaultConfiguration(void) {
 	
 	// Solid angle correction
 	useSolidAngleCorrection = 0;
+	geometryTolerance = 0.01;
 	
 	// Attenuation correction
 	useAttenuationCorrection = 0;
@@ -218,6 +227,13 @@ void cGlobal::defaultConfiguration(void) {
 	strcpy(listfinder.peaksearchFile, "listfindermask.h5");
 	strcpy(listfinderFile, "hits_sorted.txt");
 	
+	// Pre-screening
+	prescreen = 0;
+	prescreenADC = 400;
+	prescreenNAT = 10;
+	prescreenStride = 2;
+	prescreenSample = 0.01;
+	
 	// Powder pattern generation
 	powdersum = 1;
 	powderthresh = 0;
@@ -242,13 +258,27 @@ void cGlobal::defaultConfiguration(void) {
     correlationStopPhi = 360;
     correlationNumPhi = 256;
 	correlationNumDelta = 0;
-	correlationLUTdim1 = 100;
-	correlationLUTdim2 = 100;
 	correlationOutput = 1;
+	correlationBatch = 0;
 	
 	// Saving options
 	saveRaw = 0;
 	hdf5dump = 0;
+	hdf5Aggregate = 0;
+	hdf5MaxEvents = 1000;
+	hdf5MaxSize = 4096;
+	hdf5Compression = 0;
+	hdf5Shuffle = 0;
+	hdf5ChunkRows = 0;
+	hdf5ChunkEvents = 1;
+	hdf5Threshold = 0;
+	hdf5Quantize = 0;
+	savePeaks = 0;
+	sparseADC = 0;
+	hdf5EventsWritten = 0;
+	hdf5ImageBytes = 0;
+	hdf5StoredBytes = 0;
+	hdf5WriteTime = 0;
 	saveInterval = 500;
 	flushInterval = 20000;
 	
@@ -257,6 +287,10 @@ void cGlobal::defaultConfiguration(void) {
 	
 	// Default to only a few threads
 	nThreads = 8;
+	useSIMD = 1;
+	writerQueueSize = 16;
+	frameLogFormat = 0;
+	frameLogWindow = 1024;
 	
 	// Log files
 	strcpy(logfile, "log.txt");
@@ -276,7 +310,6 @@ void cGlobal::defaultConfiguration(void) {
 void cGlobal::setup() {
 		
 	//initially, set everything to NULL, allocate only those that are actually needed below
-	selfdark = NULL;
 	hotpixelmask = NULL;
 	powderRaw = NULL;
 	powderAssembled = NULL;
@@ -293,8 +326,13 @@ void cGlobal::setup() {
 	powderCorrelation = NULL;
 	iceCorrelation = NULL;
 	waterCorrelation = NULL;
-	correlationLUT = NULL;
+	xccaPlans = NULL;
 	powderVariance = NULL;
+	assemblyStart = NULL;
+	assemblySource = NULL;
+	assemblyWeight = NULL;
+	hdf5RunFile = NULL;
+	frameLog = NULL;
 	
 	
 	/*
@@ -347,11 +385,22 @@ void cGlobal::setup() {
 	/*
 	 *	Set up arrays for remembering powder data, background, etc.
 	 */	
-	if (useSubtractPersistentBackground)
-		selfdark = (float*) calloc(pix_nn, sizeof(float));
+	if (useSubtractPersistentBackground) {
+		initSnapshot(&selfdarkSnapshot, calloc(pix_nn, sizeof(float)), calloc(pix_nn, sizeof(float)));
+		if (bgRecalc < 1) {
+			cout << "Invalid option: bgRecalc = " << bgRecalc << ", set to default value (5)" << endl;
+			bgRecalc = 5;
+		}
+	}
 	
-	if (useAutoHotpixel) 
+	if (useAutoHotpixel) {
 		hotpixelmask = (float*) calloc(pix_nn, sizeof(float));
+		initSnapshot(&hotpixelSnapshot, calloc(pix_nn, sizeof(char)), calloc(pix_nn, sizeof(char)));
+		if (hotpixRecalc < 1 || hotpixRecalc > 32767) {
+			cout << "Invalid option: hotpixRecalc = " << hotpixRecalc << ", set to default value (10)" << endl;
+			hotpixRecalc = 10;
+		}
+	}
 	
 	if (powdersum) {
 		if (hitfinder.use || listfinder.use) {
@@ -404,7 +453,6 @@ void cGlobal::setup() {
 	 *	Setup global cross correlation variables
 	 */
 	if (useCorrelation) {
-		correlationLUT = new int[correlationLUTdim1*correlationLUTdim2];
 		if (!correlationNumDelta) 
 			correlationNumDelta = (int) ceil(correlationNumPhi/2.0+1);
 		if (correlationNormalization < 1 || correlationNormalization > 2) {
@@ -419,6 +467,10 @@ void cGlobal::setup() {
 			cout << "Invalid option: correlationOutput = " << correlationOutput << ", set to default value (1 = hdf5)" << endl;
 			correlationOutput = 1;
 		}
+		if (correlationBatch > 1 && (useCorrelation != 2 || !autoCorrelateOnly)) {
+			cout << "correlationBatch = " << correlationBatch << " only applies to the fast autocorrelation (useCorrelation=2, autoCorrelateOnly=1), frames are correlated one by one" << endl;
+			correlationBatch = 0;
+		}
 		if (autoCorrelateOnly) {
 			correlation_nn = correlationNumQ*correlationNumDelta;
 		} else {
@@ -426,11 +478,11 @@ void cGlobal::setup() {
 		}
 		if (sumCorrelation) {
 			if (hitfinder.use || listfinder.use) 
-				powderCorrelation = (double*) calloc(correlation_nn, sizeof(double));
+				powderCorrelation = createCorrelationSum(correlation_nn);
 			if (icefinder.use) 
-				iceCorrelation = (double*) calloc(correlation_nn, sizeof(double));
+				iceCorrelation = createCorrelationSum(correlation_nn);
 			if (waterfinder.use) 
-				waterCorrelation = (double*) calloc(correlation_nn, sizeof(double));
+				waterCorrelation = createCorrelationSum(correlation_nn);
 		}
 	}// useCorrelation end	
 	
@@ -445,6 +497,17 @@ void cGlobal::setup() {
 		useSolidAngleCorrection = 1;
 	}
 	
+	/*
+	 *	Setup cache for theta and the polarization/solid angle correction
+	 */
+	if (usePolarizationCorrection || useSolidAngleCorrection || useCorrelation) {
+		if (!(geometryTolerance >= 0)) {
+			cout << "Invalid option: geometryTolerance = " << geometryTolerance << ", set to default value (0.01)" << endl;
+			geometryTolerance = 0.01;
+		}
+		initGeometryCache(this);
+	}
+	
 	/*
 	 *	Setup quad center algorithm switch
 	 */
@@ -456,28 +519,96 @@ void cGlobal::setup() {
 		calculateCenterCorrectionQuad = 1;
 	}
 	
+	/*
+	 *	Setup common mode threads
+	 */
+	if (cmThreads < 1) {
+		cout << "Invalid option: cmThreads = " << cmThreads << ", set to default value (1)" << endl;
+		cmThreads = 1;
+	}
+#ifndef _OPENMP
+	if (cmThreads > 1) {
+		cout << "cmThreads = " << cmThreads << " requires OpenMP, common mode will use one core per frame" << endl;
+		cmThreads = 1;
+	}
+#endif
+	
 	/*
 	 *	Setup thread management
 	 */
+	if (nThreads < 1) {
+		cout << "Invalid option: nThreads = " << nThreads << ", set to default value (8)" << endl;
+		nThreads = 8;
+	}
+	if (writerQueueSize < 1) {
+		cout << "Invalid option: writerQueueSize = " << writerQueueSize << ", set to default value (16)" << endl;
+		writerQueueSize = 16;
+	}
+	if (frameLogFormat < 0 || frameLogFormat > 1) {
+		cout << "Invalid option: frameLogFormat = " << frameLogFormat << ", set to default value (0)" << endl;
+		frameLogFormat = 0;
+	}
+	if (frameLogWindow < 1) {
+		cout << "Invalid option: frameLogWindow = " << frameLogWindow << ", set to default value (1024)" << endl;
+		frameLogWindow = 1024;
+	}
+	if (hdf5Compression < 0 || hdf5Compression > 9) {
+		cout << "Invalid option: hdf5Compression = " << hdf5Compression << ", set to default value (0)" << endl;
+		hdf5Compression = 0;
+	}
+	if (hdf5Compression > 0 && !H5Zfilter_avail(H5Z_FILTER_DEFLATE)) {
+		cout << "HDF5 library has no deflate filter, saving uncompressed images" << endl;
+		hdf5Compression = 0;
+	}
+	if (hdf5ChunkRows < 0) {
+		cout << "Invalid option: hdf5ChunkRows = " << hdf5ChunkRows << ", set to default value (0)" << endl;
+		hdf5ChunkRows = 0;
+	}
+	if (hdf5ChunkEvents < 1) {
+		cout << "Invalid option: hdf5ChunkEvents = " << hdf5ChunkEvents << ", set to default value (1)" << endl;
+		hdf5ChunkEvents = 1;
+	}
+	if (savePeaks < 0 || savePeaks > 2) {
+		cout << "Invalid option: savePeaks = " << savePeaks << ", set to default value (0)" << endl;
+		savePeaks = 0;
+	}
+	if (savePeaks && !hitfinder.use)
+		cout << "savePeaks needs the standard hitfinder (hitfinder=1), no peaks will be saved" << endl;
+	else if (savePeaks && (hitfinder.Algorithm == 1 || hitfinder.Algorithm == 2))
+		cout << "savePeaks: hitfinderAlgorithm " << hitfinder.Algorithm << " does not find peaks, only sparse pixels will be saved" << endl;
 	nActiveThreads = 0;
 	threadCounter = 0;
+	
+	/*
+	 *	Choose instruction set for the per-pixel correction kernels
+	 */
+	simdLevel = SIMD_NONE;
+	if (useSIMD)
+		simdLevel = detectSIMD();
+	if (simdLevel == SIMD_AVX2)
+		printf("Using AVX2 instructions for pixel corrections\n");
+	else if (simdLevel == SIMD_SSE2)
+		printf("Using SSE2 instructions for pixel corrections\n");
+	darkcalOffset = NULL;
+	badpixelFactor = NULL;
+	
+	workerThreads = NULL;	// worker thread pool is started in beginjob() by startWorkerThreads()
+	workerData = NULL;
+	jobQueue = NULL;
 	pthread_mutex_init(&nActiveThreads_mutex, NULL);
 	pthread_mutex_init(&hotpixel_mutex, NULL);
 	pthread_mutex_init(&selfdark_mutex, NULL);
-	pthread_mutex_init(&intensities_mutex, NULL);
 	pthread_mutex_init(&powdersumraw_mutex, NULL);
 	pthread_mutex_init(&powdersumassembled_mutex, NULL);
-	pthread_mutex_init(&powdersumcorrelation_mutex, NULL);
 	pthread_mutex_init(&powdersumvariance_mutex, NULL);
 	pthread_mutex_init(&icesumraw_mutex, NULL);
 	pthread_mutex_init(&icesumassembled_mutex, NULL);
-	pthread_mutex_init(&icesumcorrelation_mutex, NULL);
 	pthread_mutex_init(&watersumraw_mutex, NULL);
 	pthread_mutex_init(&watersumassembled_mutex, NULL);
-	pthread_mutex_init(&watersumcorrelation_mutex, NULL);
 	pthread_mutex_init(&correlation_mutex, NULL);
 	pthread_mutex_init(&correlationFFT_mutex, NULL);
 	pthread_mutex_init(&pixelcenter_mutex, NULL);
+	pthread_mutex_init(&geometry_mutex, NULL);
 	pthread_mutex_init(&image_mutex, NULL);
     pthread_mutex_init(&nhits_mutex, NULL);
 	pthread_mutex_init(&framefp_mutex, NULL);
@@ -491,6 +622,9 @@ void cGlobal::setup() {
 	nice = 0;
 	nprocessedframes = 0;
 	nhits = 0;
+	nPrescreenRejected = 0;
+	nPrescreenChecked = 0;
+	nPrescreenMissed = 0;
 	lastclock = clock()-10;
 	gettimeofday(&lasttime, NULL);
 	datarate = 1;
@@ -523,6 +657,35 @@ void cGlobal::setup() {
 		readHits(listfinderFile);
 	}
 	
+	/*
+	 *	Pre-screening only makes sense if frames are selected by peaks on the detector
+	 */
+	nPrescreenPixels = 0;
+	prescreenPixels = NULL;
+	prescreenThreshold = NULL;
+	if (prescreen) {
+		if (hdf5dump || generateDarkcal) {
+			cout << "prescreen: every frame is processed with hdf5dump or generateDarkcal, pre-screening disabled" << endl;
+			prescreen = 0;
+		}
+		else if (listfinder.use || backgroundfinder.use) {
+			cout << "prescreen cannot be combined with the listfinder or backgroundfinder, pre-screening disabled" << endl;
+			prescreen = 0;
+		}
+		else if (!(hitfinder.use || icefinder.use || waterfinder.use)) {
+			cout << "prescreen needs at least one hitfinder, pre-screening disabled" << endl;
+			prescreen = 0;
+		}
+	}
+	if (prescreenStride < 1) {
+		cout << "Invalid option: prescreenStride = " << prescreenStride << ", set to default value (2)" << endl;
+		prescreenStride = 2;
+	}
+	if (prescreenSample < 0 || prescreenSample > 1) {
+		cout << "Invalid option: prescreenSample = " << prescreenSample << ", set to default value (0.01)" << endl;
+		prescreenSample = 0.01;
+	}
+	
 	/*
 	 *	Setup global polarization correction variables
 	 */
@@ -648,44 +811,33 @@ void cGlobal::setup() {
 		attenuationOffset = 0;
 	}
 	
+	/*
+	 *	Setup the store of per-event values, used for energy calibration and intensity statistics
+	 */
+	statistics = NULL;
+	if (useEnergyCalibration || useIntensityStatistics)
+		initStatistics(this);
+	
 	/*
 	 *	Setup global energy calibration variables
 	 */
-	energies = NULL;
-	wavelengths = NULL;
 	Ehist = NULL;	// Histograms are allocated in makeEnergyHistograms()
 	Lhist = NULL;	// Histograms are allocated in makeEnergyHistograms()
-	energyCapacity = 0;
-	nEnergies = 0;
 	Emin = 100000;	// Lowest photon energy
 	Emax = 0;	// Highest photon energy
 	Emean = 0;	// Mean photon energy
 	Lmin = 100000;	// Lowest wavelength
 	Lmax = 0;	// Highest wavelength
 	Lmean = 0;	// Mean wavelength
-	if (useEnergyCalibration) {
-		energyCapacity = 1000; // Starting capacity of dynamic arrays
-		energies = new double[energyCapacity]; // Dynamic array of all photon energies (eV)
-		wavelengths = new double[energyCapacity]; // Dynamic array of all wavelengths (Å)
-	}
 	
 	/*
 	 *	Setup global intensity statistics variables
 	 */
-	intensities = NULL;
-	hits = NULL;
-	nIntensities = 0;
-	intensityCapacity = 0;
 	Ihist = NULL;	// Histogram is allocated in makeIntensityHistograms()
 	IHhist = NULL;	// Histogram is allocated in makeIntensityHistograms()
 	Imin = 100000;	// Lowest avg intensity
 	Imax = -10000;	// Highest avg intensity
 	Imean = 0;	// Mean avg intensity of hits
-	if (useIntensityStatistics) {
-		intensityCapacity = 100; // Starting capacity of dynamic intensity array
-		intensities = new double[intensityCapacity]; // Dynamic array of avg intensities
-		hits = new bool[intensityCapacity];
-	}
 	
 	/*
 	 *	Setup global single-pixel statistics variables
@@ -806,6 +958,18 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 	if (!strcmp(tag, "nthreads")) {
 		nThreads = atoi(value);
 	}
+	else if (!strcmp(tag, "writerqueuesize")) {
+		writerQueueSize = atoi(value);
+	}
+	else if (!strcmp(tag, "framelogformat")) {
+		frameLogFormat = atoi(value);
+	}
+	else if (!strcmp(tag, "framelogwindow")) {
+		frameLogWindow = atol(value);
+	}
+	else if (!strcmp(tag, "usesimd")) {
+		useSIMD = atoi(value);
+	}
 	else if (!strcmp(tag, "geometry")) {
 		strcpy(geometryFile, value);
 	}
@@ -913,6 +1077,9 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "cmsubmodule")) {
 		cmSubModule = atoi(value);
 	}
+	else if (!strcmp(tag, "cmthreads")) {
+		cmThreads = atoi(value);
+	}
 	else if (!strcmp(tag, "cmsavehistograms")) {
 		cmSaveHistograms = atoi(value);
 	}
@@ -997,21 +1164,51 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
     else if (!strcmp(tag, "correlationnumdelta")) {
 		correlationNumDelta = atoi(value);
 	}
-    else if (!strcmp(tag, "correlationlutdim1")) {
-		correlationLUTdim1 = atoi(value);
-	}
-    else if (!strcmp(tag, "correlationlutdim2")) {
-		correlationLUTdim2 = atoi(value);
-	}
 	else if (!strcmp(tag, "correlationoutput")) {
 		correlationOutput = atoi(value);
 	}
+	else if (!strcmp(tag, "correlationbatch")) {
+		correlationBatch = atoi(value);
+	}
 	else if (!strcmp(tag, "saveraw")) {
 		saveRaw = atoi(value);
 	}
 	else if (!strcmp(tag, "hdf5dump")) {
 		hdf5dump = atoi(value);
 	}
+	else if (!strcmp(tag, "hdf5aggregate")) {
+		hdf5Aggregate = atoi(value);
+	}
+	else if (!strcmp(tag, "hdf5maxevents")) {
+		hdf5MaxEvents = atol(value);
+	}
+	else if (!strcmp(tag, "hdf5maxsize")) {
+		hdf5MaxSize = atol(value);
+	}
+	else if (!strcmp(tag, "hdf5compression")) {
+		hdf5Compression = atoi(value);
+	}
+	else if (!strcmp(tag, "hdf5shuffle")) {
+		hdf5Shuffle = atoi(value);
+	}
+	else if (!strcmp(tag, "hdf5chunkrows")) {
+		hdf5ChunkRows = atoi(value);
+	}
+	else if (!strcmp(tag, "hdf5chunkevents")) {
+		hdf5ChunkEvents = atoi(value);
+	}
+	else if (!strcmp(tag, "hdf5threshold")) {
+		hdf5Threshold = atof(value);
+	}
+	else if (!strcmp(tag, "hdf5quantize")) {
+		hdf5Quantize = atof(value);
+	}
+	else if (!strcmp(tag, "savepeaks")) {
+		savePeaks = atoi(value);
+	}
+	else if (!strcmp(tag, "sparseadc")) {
+		sparseADC = atof(value);
+	}
 	else if (!strcmp(tag, "saveinterval")) {
 		saveInterval = atoi(value);
 	}
@@ -1036,6 +1233,9 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "usesolidanglecorrection")) {
 		useSolidAngleCorrection = atoi(value);
 	}
+	else if (!strcmp(tag, "geometrytolerance")) {
+		geometryTolerance = atof(value);
+	}
 	else if (!strcmp(tag, "useattenuationcorrection")) {
 		useAttenuationCorrection = atoi(value);
 	}
@@ -1092,6 +1292,9 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "hotpixmemory")) {
 		hotpixMemory = atoi(value);
 	}
+	else if (!strcmp(tag, "hotpixrecalc")) {
+		hotpixRecalc = atoi(value);
+	}
 	else if (!strcmp(tag, "powderthresh")) {
 		powderthresh = atoi(value);
 	}
@@ -1128,6 +1331,9 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 	else if (!strcmp(tag, "bgmemory")) {
 		bgMemory = atof(value);
 	}
+	else if (!strcmp(tag, "bgrecalc")) {
+		bgRecalc = atoi(value);
+	}
 	else if (!strcmp(tag, "scalebackground")) {
 		scaleBackground = atoi(value);
 	}
@@ -1252,6 +1458,25 @@ void cGlobal::parseConfigTag(char *tag, char *value) {
 		backgroundfinder.savehits = atoi(value);
 	}
 	
+	/* 	
+	 *	Tags for pre-screening
+	 */
+	else if (!strcmp(tag, "prescreen")) {
+		prescreen = atoi(value);
+	}
+	else if (!strcmp(tag, "prescreenadc")) {
+		prescreenADC = atoi(value);
+	}
+	else if (!strcmp(tag, "prescreennat")) {
+		prescreenNAT = atoi(value);
+	}
+	else if (!strcmp(tag, "prescreenstride")) {
+		prescreenStride = atoi(value);
+	}
+	else if (!strcmp(tag, "prescreensample")) {
+		prescreenSample = atof(value);
+	}
+	
 	/* 	
 	 *	Tags for listfinder
 	 */
@@ -1831,42 +2056,6 @@ void cGlobal::expandAttenuationCapacity() {
 }
 
 
-/*
- *	Expand capacity of dynamic photon energy/wavelength arrays
- */
-void cGlobal::expandEnergyCapacity() {
-	energyCapacity *= 2;
-	double *oldEnergies = energies;
-	energies = new double[energyCapacity];
-	double *oldWavelengths = wavelengths;
-	wavelengths = new double[energyCapacity];
-	for (int i=0; i<nEnergies; i++) {
-		energies[i] = oldEnergies[i];
-		wavelengths[i] = oldWavelengths[i];
-	}
-	delete[] oldEnergies;
-	delete[] oldWavelengths;
-}
-
-
-/*
- *	Expand capacity of dynamic intensity/hits arrays
- */
-void cGlobal::expandIntensityCapacity() {
-	intensityCapacity *= 2;
-	double *oldIntensities = intensities;
-	intensities = new double[intensityCapacity];
-	bool *oldHits = hits;
-	hits = new bool[intensityCapacity];
-	for (int i=0; i<nIntensities; i++) {
-		intensities[i] = oldIntensities[i];
-		hits[i] = oldHits[i];
-	}
-	delete[] oldIntensities;
-	delete[] oldHits;
-}
-
-
 /*
  *	Read in list of pixels to be analyzed on a single-pixel basis
  */
@@ -1932,98 +2121,122 @@ void cGlobal::expandPixelCapacity() {
 
 
 /*
- *	Create lookup table (LUT) needed for the fast correlation algorithm
+ *	Create per-pixel tables used by applyStaticCorrections()
+ *	Must be called after readDarkcal() and readBadpixelMask()
  */
-void cGlobal::createLookupTable(){	
-	//write lookup table for fast cross-correlation
-	int lutNx = correlationLUTdim1;
-	int lutNy = correlationLUTdim2;
-	int lutSize = lutNx*lutNy;
-	cout << "Creating lookup table (LUT) of size " << lutNx << " x " << lutNy << " (" << lutSize << " entries)" << endl;
-	if (correlationLUT) {		// free memory of old LUT first, if necessary
-  		delete[] correlationLUT;
-	}
-	correlationLUT = new int[lutSize];
-	
-	//initialize to zero!
-	for (int i=0; i<lutSize; i++) {
-  		correlationLUT[i] = 0;
-	}
-	
-	//find max and min of the q-calibration arrays
-	double qx_range = fabs(pix_xmax - pix_xmin);
-    double qx_stepsize = qx_range/(double)(lutNx-1);
-	double qy_range = fabs(pix_ymax - pix_ymin);
-    double qy_stepsize = qy_range/(double)(lutNy-1);
-	cout << "\tLUT qx-values: min=" << pix_xmin << ", max=" << pix_xmax << ", range=" << qx_range << ", stepsize=" << qx_stepsize << endl;
-	cout << "\tLUT qy-values: min=" << pix_ymin << ", max=" << pix_ymax << ", range=" << qy_range << ", stepsize=" << qy_stepsize << endl;
-	
-	int lutFailCount = 0;
-	for (int i = 0; i < pix_nn; i++){           //go through the whole the q-calibration array
-												//get q-values from qx and qy arrays
-												//and determine at what index (ix, iy) to put them in the lookup table
-		const double ix = (pix_x[i]-pix_xmin) / qx_stepsize;
-		const double iy = (pix_y[i]-pix_ymin) / qy_stepsize;
-		
-		//fill table at the found coordinates with the data index
-		//overwriting whatever value it had before
-	    //(the add-one-half->floor trick is to achieve reasonable rounded integers)
-		int lutindex = (int) ( floor(ix+0.5) + lutNx*floor(iy+0.5) );
-		//int lutindex = (int) ( floor(ix) + lutNx*floor(iy) );
-
-		if (lutindex < 0 || lutindex >= lutSize) {
-			cerr << endl;
-  			cerr << "Error in cGlobal::createLookupTable! lookup table index out of bounds" << endl;
-			cerr << "\t (was trying to set correlationLUT[" << lutindex << "] = " << i << ")" << endl;
-			cerr << "\tLUT: pix_x, pix_y = (" << pix_x[i] << ", " << pix_y[i] << ") --> ix, iy = (" << ix << ", " << iy << ")" << endl;
-			lutFailCount++;
-		} else {
-			correlationLUT[lutindex] = i;
-		}
+void cGlobal::createCalibrationTables(){
+
+	// The old integer darkcal subtraction truncated the darkcal to whole ADUs
+	if (useDarkcalSubtraction) {
+		darkcalOffset = (float*) calloc(pix_nn, sizeof(float));
+		for(long i=0;i<pix_nn;i++)
+			darkcalOffset[i] = (float) ((int32_t) darkcal[i]);
+	}
+
+	if (useBadPixelMask) {
+		badpixelFactor = (float*) calloc(pix_nn, sizeof(float));
+		for(long i=0;i<pix_nn;i++)
+			badpixelFactor[i] = (float) badpixelmask[i];
+	}
+}
+
+
+/*
+ *	Compile the interpolation of raw pixels onto the assembled image grid into a sparse matrix
+ *	Each raw pixel is spread over the 4 adjacent image pixels according to its fractional position, 
+ *	image pixels with a total weight below 0.05 are left empty. The entries of each image pixel are 
+ *	in raw pixel order and divided by the total weight, so assembling a frame is a single gather.
+ */
+void cGlobal::createAssemblyMap(){
+	
+	free(assemblyStart);
+	free(assemblySource);
+	free(assemblyWeight);
+	assemblyStart = NULL;
+	assemblySource = NULL;
+	assemblyWeight = NULL;
+	
+	if (!(hdf5dump || powdersum || generateDarkcal
+		  || hitfinder.savehits
+		  || waterfinder.savehits
+		  || icefinder.savehits
+		  || backgroundfinder.savehits
+		  || listfinder.savehits))
+		return;
+	
+	double	*totalWeight = (double*) calloc(image_nn, sizeof(double));
+	long	*next = (long*) calloc(image_nn+1, sizeof(long));
+	long	image_index[4];
+	float	w[4];
+	float	x, y, fx, fy;
+	long	ix, iy;
+	int		n;
+	
+	assemblyStart = (long*) calloc(image_nn+1, sizeof(long));
+	
+	// Pass 1: total weight and number of entries of each image pixel, pass 2: fill in the entries
+	for(int pass=0; pass<2; pass++) {
+		for(long i=0; i<pix_nn; i++) {
+			// Pixel location with (0,0) at array element (0,0) in bottom left corner
+			x = pix_x[i] + image_nx/2;
+			y = pix_y[i] + image_nx/2;
 			
-		/////////////////////////////////////////////////////////////////////////////////////////
-		//ATTENTION: THIS METHOD WILL LEAD TO A LOSS OF DATA,
-		//ESPECIALLY FOR SMALL TABLE SIZES,
-		//BUT IT WILL BUY A LOT OF SPEED IN THE LOOKUP PROCESS
-		//--> this should be improved to a more precise version, 
-		//    maybe even one that allows the lookup(x,y) to interpolate
-		//    for that to work, we need to find the four closest points in the data or so
-		//    (for instance, instead of one index, the table could contain 
-		//    a vector of all applicable indices)
-		/////////////////////////////////////////////////////////////////////////////////////////
-		
-		if(debugLevel>2 && (i<=100 || pix_nn-i<=200) ){	//print the first and the last  entries to check
-			cout << "setting correlationLUT[" << lutindex << "] = " << i << "";
-			cout << "   LUT: pix_x, pix_y = (" << pix_x[i] << ", " << pix_y[i] << ") --> ix, iy = (" << ix << ", " << iy << ")" << endl;
+			// Split coordinate into integer and fractional parts
+			ix = (long) floor(x);
+			iy = (long) floor(y);
+			fx = x - ix;
+			fy = y - iy;
+			
+			// The 4 adjacent pixels that lie within the image, weighted by fractional overlap
+			n = 0;
+			if(ix>=0 && iy>=0 && ix<image_nx && iy<image_nx) {
+				image_index[n] = ix + image_nx*iy;
+				w[n++] = (1-fx)*(1-fy);
+			}
+			if((ix+1)>=0 && iy>=0 && (ix+1)<image_nx && iy<image_nx) {
+				image_index[n] = (ix+1) + image_nx*iy;
+				w[n++] = (fx)*(1-fy);
+			}
+			if(ix>=0 && (iy+1)>=0 && ix<image_nx && (iy+1)<image_nx) {
+				image_index[n] = ix + image_nx*(iy+1);
+				w[n++] = (1-fx)*(fy);
+			}
+			if((ix+1)>=0 && (iy+1)>=0 && (ix+1)<image_nx && (iy+1)<image_nx) {
+				image_index[n] = (ix+1) + image_nx*(iy+1);
+				w[n++] = (fx)*(fy);
+			}
+			
+			for(int j=0; j<n; j++) {
+				if (pass == 0) {
+					totalWeight[image_index[j]] += w[j];
+					assemblyStart[image_index[j]+1]++;
+				} else if (totalWeight[image_index[j]] >= 0.05) {
+					assemblySource[next[image_index[j]]] = (int) i;
+					assemblyWeight[next[image_index[j]]++] = (float) (w[j]/totalWeight[image_index[j]]);
+				}
+			}
 		}
-	}//for
-	//after all is done, set the zero element to zero 
-	//to make sure a failure of lookup() doesn't result in an acutal value
-	correlationLUT[0] = 0;		
-	
-	cout << "\tLUT created ";
-	cout << "(info: LUT assignment failed in " << lutFailCount << " of " << lutSize << " cases)" << endl;
-	
-	
-	//explicit output to test...
-	if (debugLevel>2) {
-		std::ostringstream osst;
-		osst << "-------------------LUT begin---------------------------------" << endl;
-			for (int j = 0; j<lutNy; j++){
-			osst << " [";
-			for (int i = 0; i<lutNx; i++) {
-				osst << " " << correlationLUT[i+lutNx*j];
+		
+		if (pass == 0) {
+			// Drop image pixels with too little weight, turn the counts into row offsets
+			for(long i=0; i<image_nn; i++) {
+				if (totalWeight[i] < 0.05)
+					assemblyStart[i+1] = 0;
+				assemblyStart[i+1] += assemblyStart[i];
+				next[i] = assemblyStart[i];
 			}
-			osst << "]" << endl;
+			assemblySource = (int*) calloc(assemblyStart[image_nn]+1, sizeof(int));
+			assemblyWeight = (float*) calloc(assemblyStart[image_nn]+1, sizeof(float));
 		}
-		osst << "------------------LUT end----------------------------------" << endl;		
-		cout << osst.str() << endl;
-	}//if	
+	}
+	
+	if (debugLevel >= 1) printf("\tAssembly map: %li entries for %li image pixels\n", assemblyStart[image_nn], image_nn);
+	
+	free(totalWeight);
+	free(next);
 }
 
 
-
-
 /*
  *	Write initial log file
  */
@@ -2053,22 +2266,29 @@ void cGlobal::writeInitialLog(void){
 	// Open a new frame file at the same time
 	pthread_mutex_lock(&framefp_mutex);
 	
-	sprintf(framefile,"r%04u-frames.txt",getRunNumber());
-	framefp = fopen (framefile,"w");
-	fprintf(framefp, "# ThreadNumber, UnixTime, EventName, Iavg");
-	if (hitfinder.use) {
-		fprintf(framefp, ", nPeaks (standard)");
-	}
-	if (icefinder.use) {
-		fprintf(framefp, ", nPeaks (ice)");
+	// (with frameLogFormat=1 the frame log thread creates an HDF5 file instead)
+	if (frameLogFormat == FRAMELOG_HDF5) {
+		sprintf(framefile,"r%04u-frames.h5",getRunNumber());
+		framefp = NULL;
 	}
-	if (waterfinder.use) {
-		fprintf(framefp, ", nPeaks (water)");
-	}
-	if (backgroundfinder.use) {
-		fprintf(framefp, ", nPeaks (background)");
+	else {
+		sprintf(framefile,"r%04u-frames.txt",getRunNumber());
+		framefp = fopen (framefile,"w");
+		fprintf(framefp, "# ThreadNumber, UnixTime, EventName, Iavg");
+		if (hitfinder.use) {
+			fprintf(framefp, ", nPeaks (standard)");
+		}
+		if (icefinder.use) {
+			fprintf(framefp, ", nPeaks (ice)");
+		}
+		if (waterfinder.use) {
+			fprintf(framefp, ", nPeaks (water)");
+		}
+		if (backgroundfinder.use) {
+			fprintf(framefp, ", nPeaks (background)");
+		}
+		fprintf(framefp, "\n");
 	}
-	fprintf(framefp, "\n");
 	
 	sprintf(cleanedfile,"r%04u-cleanedhits.txt",getRunNumber());
 	hitfinder.cleanedfp = fopen (cleanedfile,"w");
@@ -2120,13 +2340,18 @@ void cGlobal::updateLogfile(void){
 	fp = fopen (logfile,"a");
 	fprintf(fp, "nFrames: %i,  nHits: %i (%2.2f%%), wallTime: %ihr %imin %isec (%2.1f fps)\n", 
 		(int)nprocessedframes, (int)nhits, hitrate, hrs, mins, secs, fps);
+	if (prescreen)
+		fprintf(fp, "nPrescreenRejected: %i, missed %i of %i checked\n", (int)nPrescreenRejected, (int)nPrescreenMissed, (int)nPrescreenChecked);
 	fclose (fp);
 	
 	
 	// Flush frame file buffer
+	flushFrameLog(this);
 	pthread_mutex_lock(&framefp_mutex);
-	fclose(framefp);
-	framefp = fopen (framefile,"a");
+	if (framefp) {
+		fclose(framefp);
+		framefp = fopen (framefile,"a");
+	}
 	fclose(hitfinder.cleanedfp);
 	hitfinder.cleanedfp = fopen (cleanedfile,"a");
 	fclose(icefinder.cleanedfp);
@@ -2192,6 +2417,10 @@ void cGlobal::writeFinalLog(void){
 	fprintf(fp, "nFrames in ice powder pattern: %i\n",(int)nice);
 	fprintf(fp, "Number of hits: %i\n",(int)nhits);
 	fprintf(fp, "Average hit rate: %2.2f %%\n",hitrate);
+	if (prescreen) {
+		fprintf(fp, "Frames rejected by pre-screen: %i\n",(int)nPrescreenRejected);
+		fprintf(fp, "Pre-screen misses: %i of %i checked\n",(int)nPrescreenMissed,(int)nPrescreenChecked);
+	}
 	fprintf(fp, "Average data rate: %2.2f fps\n",fps);
 
 	fclose (fp);
@@ -2199,7 +2428,7 @@ void cGlobal::writeFinalLog(void){
 	
 	// Flush frame file buffer
 	pthread_mutex_lock(&framefp_mutex);
-	fclose(framefp);
+	if (framefp) fclose(framefp);
 	fclose(hitfinder.cleanedfp);
 	fclose(icefinder.cleanedfp);
 	fclose(waterfinder.cleanedfp);
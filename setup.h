@@ -22,13 +22,33 @@
 #define _setup_h
 
 #include <stdio.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <string>
 #include <vector>
 
+#include "snapshot.h"
+
+struct sThreadInfo;
+typedef struct sThreadInfo tThreadInfo;		// defined in worker.h
+struct sWorkerData;
+typedef struct sWorkerData tWorkerData;		// defined in threadpool.h
+struct sHDF5RunFile;
+typedef struct sHDF5RunFile tHDF5RunFile;	// defined in hdf5writer.h
+struct sFrameLog;
+typedef struct sFrameLog tFrameLog;			// defined in framelog.h
+struct sStatistics;
+typedef struct sStatistics tStatistics;		// defined in statistics.h
+struct sXCCAPlans;
+typedef struct sXCCAPlans tXCCAPlans;		// defined in xcca.h
+struct sXCCASum;
+typedef struct sXCCASum tXCCASum;			// defined in xcca.h
+
 /*
  *	Structure for hitfinder parameters
+ *	(cGlobal holds NHITFINDERS of them: hitfinder, waterfinder, icefinder, backgroundfinder and listfinder)
  */
+#define NHITFINDERS		5
 
 class cHitfinder {
 
@@ -46,6 +66,7 @@ public:
 	int 		savehits;		 // set if you want to save the hits
 	char		peaksearchFile[1024];			 // the name of the file containing the peak mask (Raw format)
 	int16_t		*peakmask;		//stores the peakmask from the file peakmaskFile
+	uint64_t	*peakmaskBits;	// peakmask as a bitmap, if it can be applied that way (see prepareHitfinders)
 	FILE		*cleanedfp;		// file name where the hits of this hitfinder are written.
 };
 
@@ -111,6 +132,7 @@ public:
 	int			cmStop;					// Algorithm 1: intensity (ADU) at which the peakfinding should stop in the histogram
 	float		cmDelta;				// Algorithm 1: noise threshold intensity (ADU) over which the peakfinding should consider as true peaks in the histogram
 	float		cmFloor;				// Algorithm 2: use lowest x% of values as the offset to subtract (typically lowest 2%)
+	int			cmThreads;				// Number of cores used to subtract the common mode of one frame (needs OpenMP), the ASICs are divided between them
 	int			cmSaveHistograms;		// Save intensity histograms for each 2x1 Module. Histograms are saved into separate files for each event. The median defined by cmFloor is saved in the first element unless terminal output states otherwise
 	
 	// Gain correction
@@ -123,12 +145,14 @@ public:
 	int			useSubtractPersistentBackground;  // if set a running background will be calculated and subtracted. 
 	int			scaleBackground;		  // scale the running background for each shot to account for intensity fluctuations
 	float		bgMemory;				  // number of frames to use for determining the running background
+	int			bgRecalc;				  // number of non-hits each worker thread sums before adding them to the running background
 	
 	// Kill persistently hot pixels
 	int			useAutoHotpixel;		 // determine the hot pixels on the fly
 	int			hotpixADC;			 // threshold above which to count as hot pixels
 	int			hotpixMemory;			 // number of frames to look for hot pixels in
 	float		hotpixFreq;				 // hot often a pixel needs to be above the threshold to be regarded as hot.
+	int			hotpixRecalc;			 // number of frames each worker thread counts hot pixels for before adding them to the shared hot pixel mask
 	
 	// Polarization correction
 	int			usePolarizationCorrection;	// set to nonzero to calculate and apply polarization correction to each hit (or saved event)
@@ -136,6 +160,7 @@ public:
 	
 	// Solid angle correction
 	int			useSolidAngleCorrection;	// set to nonzero to calculate and apply solid angle correction to each hit (or saved event), only the theta-dependent part of the correction is applied to the 2D scattering pattern, also controls what correction algorithm to be used: 1 = rigorous, 2 = azimuthally symmetric
+	float		geometryTolerance;			// detector positions (mm) closer than this share the same cached theta and polarization/solid angle correction
 	
 	// Attenuation correction
 	int			useAttenuationCorrection;		// Whether to correct each event's intensity with the calculated attenuation, this also toggles if the intensity should be corrected for the FEE gas detectors readouts (in mJ)
@@ -168,6 +193,16 @@ public:
 	cHitfinder	listfinder;				// instance of the hitfinder for using a list as input criteria
 	char		listfinderFile[1024];	// Name of the file containing the hit list
 	
+	// Pre-screening of the raw data (see prescreenFrame in hitfinder.cpp)
+	int			prescreen;				// set to skip corrections and hitfinding for frames that fail a cheap test on the raw data
+	int			prescreenADC;			// threshold in ADU above the darkcal, applied to the raw data
+	int			prescreenNAT;			// minimum number of sampled pixels above prescreenADC for a frame to pass
+	int			prescreenStride;		// only every prescreenStride-th pixel along both axes is sampled
+	float		prescreenSample;		// fraction of the rejected frames that is processed in full to measure the miss rate
+	long		nPrescreenPixels;
+	int32_t		*prescreenPixels;		// sampled pixels within the peak masks of the hitfinders
+	float		*prescreenThreshold;	// their threshold in raw ADU
+	
 	// Powder pattern generation
 	int			powdersum;			 // set to calculate powder pattern
 	int			powderthresh;			 // pixels with an ADC value above this threshold will be added to the powder
@@ -192,14 +227,25 @@ public:
     double 		correlationStopPhi;		// stop angle in degrees, default: 360
     int 		correlationNumPhi;		// number of angular steps, default: 256 (attention: if possible, use powers of 2, that makes FFT especially fast)
     int 		correlationNumDelta;	// number of angular lag steps, default: 0 (it then calculates suitable number from correlationNumPhi with the same step length)
-	int		 	*correlationLUT;		// lookup table (LUT) needed for the fast correlation
-	int			correlationLUTdim1;		// dim1 of LUT
-	int			correlationLUTdim2;		// dim2 of LUT
 	int			correlationOutput;		// switch between output formats: 1 = hdf5, 2 = bin, 3 = hdf5+bin, 4 = tiff, 5 = tiff+hdf5, 6 = tiff+bin, 7 = tiff+hdf5+bin
+	int			correlationBatch;		// number of frames each worker autocorrelates together in one FFT (fast autocorrelation only), 0/1 = one by one
+	tXCCAPlans	*xccaPlans;				// FFT plans of the fast correlation, made once in beginjob (see xcca.h)
+	tSnapshot	polarSnapshot;			// pixels of each (q, phi) bin of the correlation (tPolarMap), rebuilt when the geometry changes
 	
 	// Saving options
 	int			saveRaw;			 // set to save each hit in raw format, in addition to assembled format. Powders are only saved in raw if saveRaw and powdersum are enabled
 	int			hdf5dump;			 // set to write every frame to h5 format 
+	int			hdf5Aggregate;		 // set to append hits to a few files per run (r0123-hits-000.h5, ...) instead of writing one file per hit
+	long		hdf5MaxEvents;		 // start a new aggregated file after this many events (0 = no limit)
+	long		hdf5MaxSize;		 // start a new aggregated file after this many MB of image data on disk (0 = no limit)
+	int			hdf5Compression;	 // deflate level (1-9) for saved images, 0 = no compression
+	int			hdf5Shuffle;		 // set to apply the byte shuffle filter before deflate (usually compresses int16 images better)
+	int			hdf5ChunkRows;		 // rows per chunk, 0 = whole image
+	int			hdf5ChunkEvents;	 // events per chunk in the aggregated files
+	float		hdf5Threshold;		 // store pixels with |value| below this many ADU as 0, 0 = off (lossy)
+	float		hdf5Quantize;		 // round pixels to multiples of this many ADU, 0 or 1 = off (lossy)
+	int			savePeaks;			 // 1 = add peak lists of the standard hitfinder to the run files, 2 = save only peak lists, no images
+	float		sparseADC;			 // with savePeaks, also save all other pixels above this value (0 = none)
 	
 	// Verbosity
 	int			debugLevel;			 // set to 0 for regular, 1 for debug mode, and 2 for extra verbose
@@ -211,6 +257,8 @@ public:
 	char		icefile[1024];
 	char 		waterfile[1024];
 	char		backgroundfile[1024];
+	int			frameLogFormat;		 // 0 = frame file as text (r0123-frames.txt), 1 = HDF5 table (r0123-frames.h5)
+	long		frameLogWindow;		 // frames the log can be reordered over, workers wait if they get further ahead
 	
 	
 	/*
@@ -221,29 +269,62 @@ public:
 
 	// Log file pointers
 	FILE		*framefp;
+	tFrameLog	*frameLog;		// frames waiting to be written to framefp and the hit lists (see framelog.cpp)
+	tHDF5RunFile	*hdf5RunFile;	// file hits are currently appended to (hdf5Aggregate)
+	long		hdf5EventsWritten;		// HDF5 output statistics, see printHDF5Statistics
+	double		hdf5ImageBytes;			// int16 image bytes handed to HDF5
+	double		hdf5StoredBytes;		// bytes they took on disk
+	double		hdf5WriteTime;			// seconds spent converting and writing
 	//FILE		*cleanedfp;
 	
 	// Thread management
 	long			nThreads;
+	int				useSIMD;			// use SSE2/AVX2 kernels for the per-pixel corrections when the CPU supports them
+	int				simdLevel;			// instruction set actually used (SIMD_NONE, SIMD_SSE2 or SIMD_AVX2, see calibration.h)
 	long			nActiveThreads;
 	long			threadCounter;
+	pthread_t		*workerThreads;		// persistent pool of worker threads, created in beginjob()
+	tWorkerData		*workerData;		// data private to each worker thread, indexed by threadInfo->workerNum
+	long			nWorkersStarted;
+	tThreadInfo		**jobQueue;			// ring buffer of frames waiting for a free worker thread
+	long			jobQueueSize;
+	long			jobQueueHead;
+	long			jobQueueCount;
+	int				workerShutdown;		// tells the worker threads to exit once the queue is empty
+	pthread_cond_t	jobQueueNotEmpty;	// the condition variables below are all used together with nActiveThreads_mutex
+	pthread_cond_t	jobQueueNotFull;
+	pthread_cond_t	workersIdle;
+	pthread_t		writerThread;		// single thread doing all per-event output, see queueWriterJob()
+	long			writerQueueSize;	// number of frames that can wait for the writer thread before the workers block
+	tThreadInfo		**writerQueue;
+	long			writerQueueHead;
+	long			writerQueueCount;
+	int				writerBusy;
+	int				writerShutdown;
+	pthread_cond_t	writerQueueNotEmpty;	// the condition variables below are all used together with writer_mutex
+	pthread_cond_t	writerQueueNotFull;
+	pthread_cond_t	writerIdle;
+	pthread_mutex_t	writer_mutex;
+	tThreadInfo		**frameBuffers;		// preallocated per-frame buffers, recycled between the event loop and the workers
+	tThreadInfo		**freeFrameBuffers;	// stack of frame buffers that are not in use
+	long			nFrameBuffers;
+	long			nFreeFrameBuffers;
+	pthread_cond_t	frameBufferAvailable;	// used together with framebuffer_mutex
+	pthread_mutex_t	framebuffer_mutex;
 	pthread_mutex_t	nActiveThreads_mutex;		// there should be one mutex variable for each global variable which threads write to.
 	pthread_mutex_t	hotpixel_mutex;
 	pthread_mutex_t	selfdark_mutex;
-	pthread_mutex_t	intensities_mutex;
 	pthread_mutex_t	powdersumraw_mutex;
 	pthread_mutex_t	powdersumassembled_mutex;
-	pthread_mutex_t	powdersumcorrelation_mutex;
 	pthread_mutex_t	powdersumvariance_mutex;
 	pthread_mutex_t	watersumassembled_mutex;
 	pthread_mutex_t	watersumraw_mutex;
-	pthread_mutex_t	watersumcorrelation_mutex;
 	pthread_mutex_t	icesumassembled_mutex;
 	pthread_mutex_t	icesumraw_mutex;
-	pthread_mutex_t	icesumcorrelation_mutex;
 	pthread_mutex_t correlation_mutex;
 	pthread_mutex_t correlationFFT_mutex;
 	pthread_mutex_t pixelcenter_mutex;
+	pthread_mutex_t geometry_mutex;
 	pthread_mutex_t image_mutex;
     pthread_mutex_t	nhits_mutex;
 	pthread_mutex_t	framefp_mutex;
@@ -266,6 +347,9 @@ public:
 	unsigned		module_cols;
 	long			image_nx;
 	long			image_nn;
+	long			*assemblyStart;		// assembly map (CSR): image pixel i is interpolated from entries assemblyStart[i]..assemblyStart[i+1]-1
+	int				*assemblySource;	// raw pixel index of each entry
+	float			*assemblyWeight;	// interpolation weight of each entry, already divided by the total weight of the image pixel
 	float			*quad_dx;
 	float			*quad_dy;
 	
@@ -281,6 +365,11 @@ public:
 	double		*phi;
 	
 	
+	// Geometry cache (theta, polarization and solid angle correction), see geometry.cpp
+	tSnapshot	geometrySnapshot;	// cached per-pixel geometry for the current detector position (tGeometryCache)
+	long		geometryVersion;	// incremented whenever the pixel maps change, invalidates the cache
+	
+	
 	// Attenuation variables
 	unsigned		nFilters;		// Counter for Si filters in XRT
 	unsigned		nThicknesses;	// Counter for number of possible thicknesses
@@ -295,11 +384,11 @@ public:
 	int				attenuationOffset;		// Integer to compensate for the offset of nevents w.r.t. the recorded attenuations
 	
 	
+	// Per-event values (intensities, energies, ...) of all frames, indexed by threadNum
+	tStatistics		*statistics;
+	
+	
 	// Energy calibration variables
-	double			*energies;	// Dynamic array of photon energies (eV) for all events
-	double			*wavelengths;	// Dynamic array of wavelengths (Å) for all events
-	unsigned		energyCapacity;	// Starting capacity of dynamic arrays
-	unsigned		nEnergies;	// Number of energies saved in dynamic array
 	double			Emin;	// Lowest photon energy
 	double			Emax;	// Highest photon energy
 	double			Emean;	// Mean photon energy
@@ -311,10 +400,6 @@ public:
 	
 	
 	// Intensity statistics variables
-	double			*intensities;		// Dynamic array of avg intensities for all events
-	bool			*hits;		// Dynamic array of hits for all events
-	unsigned		intensityCapacity;	// Allocated size of dynamic intensity array
-	unsigned		nIntensities;		// Number of avg intensities saved in dynamic intensity array
 	unsigned		*Ihist;	// Histogram of intensities
 	unsigned		*IHhist;// Histogram of intensities of hits
 	double			Imin;	// Lowest avg intensity
@@ -338,26 +423,32 @@ public:
 	double			*powderRaw;		// stores powder pattern in raw format
 	double			*powderAssembled;	// stores the assembled powder pattern
 	double			*powderAverage;		// stores angular average of powder pattern
-	double			*powderCorrelation;	// stores correlation sum of regular hits
+	tXCCASum		*powderCorrelation;	// running mean and variance of the correlation of regular hits
 	double			*powderVariance;	// stores the variance of the powder pattern
 	double			*waterRaw;		// stores powder pattern of water hits in raw format
 	double			*waterAssembled;	// stores the assembled powder pattern of water hits
 	double			*waterAverage;		// stores angular average of powder pattern of water hits
-	double			*waterCorrelation;	// stores correlation sum of water hits
+	tXCCASum		*waterCorrelation;	// running mean and variance of the correlation of water hits
 	double			*iceRaw;		// stores powder pattern of ice hits in raw format
 	double			*iceAssembled;		// stores the assembled powder pattern of ice hits
 	double			*iceAverage;		// stores angular average of powder pattern	of ice hits
-	double			*iceCorrelation;	// stores correlation sum of ice hits
+	tXCCASum		*iceCorrelation;	// running mean and variance of the correlation of ice hits
 	int16_t			*badpixelmask;		// stores the bad pixel mask from the file badpixelmaskFile
-	float			*hotpixelmask;		// stores the hot pixel mask calculated by the auto hot pixel finder
-	float			*selfdark;		// stores the background calculated by the running (persistant) background subtraction
+	float			*hotpixelmask;		// stores the hot pixel mask calculated by the auto hot pixel finder (how often each pixel is above hotpixADC)
+	tSnapshot		hotpixelSnapshot;	// pixels currently regarded as hot (char array), read by the worker threads without locking
+	tSnapshot		selfdarkSnapshot;	// background calculated by the running (persistant) background subtraction (float array), read by the worker threads without locking
 	float			*gaincal;		// stores the gain map read from the gaincalFile
+	float			*darkcalOffset;		// darkcal truncated to whole ADUs, as subtracted by applyStaticCorrections()
+	float			*badpixelFactor;	// bad pixel mask as float multipliers for applyStaticCorrections()
 	float			avgGMD;			// what is this?
 	long			npowder;		// number of frames in the powder
 	long			nwater;		// number of frames in the water powder
 	long			nice;		// number of frames in the ice powder
 	long			nprocessedframes;	// number of frames that have been processed by the worker program
 	long			nhits;			// number of hits that have been found
+	long			nPrescreenRejected;	// frames rejected by the pre-screen
+	long			nPrescreenChecked;	// rejected frames that were processed in full anyway (prescreenSample)
+	long			nPrescreenMissed;	// checked frames that turned out to be hits
 	long			correlation_nn;	// length of global cross-correlation arrays
 	double			detectorZ;		// position (mm) of the detector along the beam direction
 	float			detposold;		// the detector position of the second last event, this makes sure the detector doesn't artificially 'jump' between events due to bug in PV readout
@@ -387,11 +478,10 @@ public:
 	void readHits(char *);
 	void readAttenuations(char *);		// read in list of attenuations
 	void expandAttenuationCapacity();
-	void expandEnergyCapacity();
-	void expandIntensityCapacity();
 	void readPixels(char *);			// read in list of pixels to be analyzed on a single-pixel basis
 	void expandPixelCapacity();
-	void createLookupTable();			// create lookup table (LUT) needed for the fast correlation algorithm	
+	void createCalibrationTables();		// per-pixel tables for applyStaticCorrections(), built after the calibration files are read
+	void createAssemblyMap();			// raw to assembled image interpolation map used by assemble2Dimage(), rebuilt whenever the pixel maps change
 
 	void writeInitialLog(void);			// functions to write the log file
 	void updateLogfile(void);			
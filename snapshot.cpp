@@ -0,0 +1,89 @@
+/*
+ *  snapshot.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdlib.h>
+#include <sched.h>
+
+#include "snapshot.h"
+
+
+/*
+ *	Set up a snapshot from two buffers of the same size, buffer0 is published first
+ *	The snapshot takes ownership of the buffers (they are released with free())
+ */
+void initSnapshot(tSnapshot *snapshot, void *buffer0, void *buffer1) {
+	snapshot->buffer[0] = buffer0;
+	snapshot->buffer[1] = buffer1;
+	snapshot->current = 0;
+	snapshot->readers[0] = 0;
+	snapshot->readers[1] = 0;
+}
+
+void freeSnapshot(tSnapshot *snapshot) {
+	free(snapshot->buffer[0]);
+	free(snapshot->buffer[1]);
+	snapshot->buffer[0] = NULL;
+	snapshot->buffer[1] = NULL;
+}
+
+
+/*
+ *	Get the current version for reading, must be followed by unpinSnapshot()
+ *	If a new version is published while we register as a reader, simply try again
+ */
+const void *pinSnapshot(tSnapshot *snapshot, int *pinned) {
+	
+	int	n;
+	
+	while(1) {
+		n = snapshot->current;
+		__sync_fetch_and_add(&snapshot->readers[n], 1);
+		if (n == snapshot->current)
+			break;
+		__sync_fetch_and_sub(&snapshot->readers[n], 1);
+	}
+	*pinned = n;
+	return snapshot->buffer[n];
+}
+
+void unpinSnapshot(tSnapshot *snapshot, int pinned) {
+	__sync_fetch_and_sub(&snapshot->readers[pinned], 1);
+}
+
+
+/*
+ *	Get the spare buffer for writing the next version
+ *	Waits for threads still reading the previous version, which takes at most one frame
+ */
+void *beginSnapshotUpdate(tSnapshot *snapshot) {
+	
+	int	spare = 1 - snapshot->current;
+	
+	while(__sync_fetch_and_add(&snapshot->readers[spare], 0) != 0)
+		sched_yield();
+	return snapshot->buffer[spare];
+}
+
+
+/*
+ *	Make the buffer returned by beginSnapshotUpdate() the current version
+ */
+void publishSnapshot(tSnapshot *snapshot) {
+	__sync_synchronize();
+	snapshot->current = 1 - snapshot->current;
+	__sync_synchronize();
+}
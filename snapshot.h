@@ -0,0 +1,54 @@
+/*
+ *  snapshot.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#ifndef _snapshot_h
+#define _snapshot_h
+
+/*
+ *	Double-buffered array shared between the worker threads.
+ *	Readers pin the current buffer and never block; a single writer at a time (serialised 
+ *	by the caller) fills the spare buffer and then publishes it with one pointer swap.
+ *	The spare buffer is only reused once the last reader of the old version has let go.
+ */
+typedef struct {
+	void			*buffer[2];
+	volatile int	current;		// index of the published buffer
+	volatile int	readers[2];		// number of threads reading each buffer
+} tSnapshot;
+
+
+/*
+ *	Running averages published as snapshots (hot pixel mask, persistent background)
+ *	Each worker collects its frames in arrays of its own. After n >= Recalc frames it folds them
+ *	into the shared average if it gets the lock at once (trylock), otherwise it carries on and
+ *	tries again with the next frame; from 2*Recalc frames on it waits for the lock.
+ *	Applying avg = ((M-1)*avg + frame)/M for each of the n frames is approximated by
+ *	avg = a^n*avg + (1-a^n)*sum/n with a = (M-1)/M, which is exact for n = 1.
+ */
+
+
+/*
+ *	Function prototypes
+ */
+void initSnapshot(tSnapshot*, void*, void*);
+void freeSnapshot(tSnapshot*);
+const void *pinSnapshot(tSnapshot*, int*);
+void unpinSnapshot(tSnapshot*, int);
+void *beginSnapshotUpdate(tSnapshot*);
+void publishSnapshot(tSnapshot*);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ *  statistics.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "setup.h"
+#include "statistics.h"
+
+
+/*
+ *	New chunk with all values unset
+ */
+static double *newChunk(void) {
+	
+	double	*chunk = (double*) malloc(STAT_NCOLUMNS*STAT_CHUNK*sizeof(double));
+	for(long i=0; i<STAT_NCOLUMNS*STAT_CHUNK; i++)
+		chunk[i] = NAN;
+	return chunk;
+}
+
+
+/*
+ *	Set up the column store (in setup), the first chunk is allocated right away
+ */
+void initStatistics(cGlobal *global) {
+	
+	global->statistics = (tStatistics*) calloc(1, sizeof(tStatistics));
+	global->statistics->chunks[0] = newChunk();
+}
+
+
+/*
+ *	Chunk c of the store, allocated if no worker has done so yet
+ */
+static double *getChunk(tStatistics *statistics, long c) {
+	
+	double	*chunk = statistics->chunks[c];
+	if (chunk == NULL) {
+		chunk = newChunk();
+		if (!__sync_bool_compare_and_swap(&statistics->chunks[c], (double*) NULL, chunk)) {
+			free(chunk);
+			chunk = statistics->chunks[c];
+		}
+	}
+	return chunk;
+}
+
+
+/*
+ *	Set one value of frame threadNum, called by the worker processing that frame
+ *	Halfway through a chunk the next one is allocated, so workers hardly ever wait for memory.
+ */
+void setStatistic(cGlobal *global, long threadNum, int column, double value) {
+	
+	long	c = threadNum / STAT_CHUNK;
+	long	i = threadNum % STAT_CHUNK;
+	
+	if (c >= STAT_MAXCHUNKS)
+		return;
+	
+	double	*chunk = getChunk(global->statistics, c);
+	chunk[column*STAT_CHUNK + i] = value;
+	
+	if (i == STAT_CHUNK/2 && c+1 < STAT_MAXCHUNKS)
+		getChunk(global->statistics, c+1);
+}
+
+
+/*
+ *	Copy the values of column for all frames that have a value in column select, in frame order
+ *	Returns the number of values, buffer may be NULL to just count them.
+ *	Only call once the frames have been processed (the workers do not synchronise with this).
+ */
+long gatherStatistic(cGlobal *global, int column, int select, double *buffer) {
+	
+	long	n = 0;
+	
+	for(long c=0; c<STAT_MAXCHUNKS; c++) {
+		const double	*chunk = global->statistics->chunks[c];
+		if (chunk == NULL)
+			continue;
+		const double	*values = chunk + column*STAT_CHUNK;
+		const double	*selected = chunk + select*STAT_CHUNK;
+		for(long i=0; i<STAT_CHUNK; i++) {
+			if (isnan(selected[i]))
+				continue;
+			if (buffer)
+				buffer[n] = values[i];
+			n++;
+		}
+	}
+	return n;
+}
+
+
+void freeStatistics(cGlobal *global) {
+	
+	if (global->statistics == NULL)
+		return;
+	for(long c=0; c<STAT_MAXCHUNKS; c++)
+		free(global->statistics->chunks[c]);
+	free(global->statistics);
+	global->statistics = NULL;
+}
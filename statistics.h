@@ -0,0 +1,60 @@
+/*
+ *  statistics.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _statistics_h
+#define _statistics_h
+
+#include "setup.h"
+
+/*
+ *	Per-event values kept for the whole job, one column each
+ */
+#define STAT_INTENSITY		0		// intensityAvg
+#define STAT_HIT			1		// 1 if the frame was a hit or saved, 0 otherwise
+#define STAT_NPEAKS			2		// nat/npeaks of the standard hitfinder
+#define STAT_NHOT			3		// number of hot pixels killed
+#define STAT_GMD			4		// (gmd21+gmd22)/2
+#define STAT_PHOTONENERGY	5		// photon energy in eV
+#define STAT_WAVELENGTH		6		// wavelength in Angstrom
+#define STAT_NCOLUMNS		7
+
+// Columns are stored in chunks of STAT_CHUNK events (up to STAT_MAXCHUNKS*STAT_CHUNK frames per job)
+#define STAT_CHUNK			16384
+#define STAT_MAXCHUNKS		16384
+
+/*
+ *	Column store indexed by threadNum
+ *	Every frame has its own row, so workers fill in their values without locking; rows and values
+ *	that were never set are NaN. The chunk directory is fixed, a missing chunk is allocated by
+ *	whichever worker needs it first.
+ */
+typedef struct sStatistics {
+
+	double * volatile	chunks[STAT_MAXCHUNKS];		// STAT_NCOLUMNS columns of STAT_CHUNK values each
+
+} tStatistics;
+
+
+/*
+ *	Function prototypes
+ */
+void initStatistics(cGlobal*);
+void setStatistic(cGlobal*, long, int, double);
+long gatherStatistic(cGlobal*, int, int, double*);
+void freeStatistics(cGlobal*);
+
+#endif
@@ -0,0 +1,420 @@
+/*
+ *  threadpool.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "threadpool.h"
+#include "xcca.h"
+
+
+/*
+ *	Create the pool of worker threads and the queue feeding them
+ *	The threads live until stopWorkerThreads() is called in endjob()
+ */
+void startWorkerThreads(cGlobal *global) {
+	
+	global->jobQueueSize = global->nThreads;
+	global->jobQueue = (tThreadInfo**) calloc(global->jobQueueSize, sizeof(tThreadInfo*));
+	global->jobQueueHead = 0;
+	global->jobQueueCount = 0;
+	global->workerShutdown = 0;
+	pthread_cond_init(&global->jobQueueNotEmpty, NULL);
+	pthread_cond_init(&global->jobQueueNotFull, NULL);
+	pthread_cond_init(&global->workersIdle, NULL);
+	
+	global->workerData = (tWorkerData*) calloc(global->nThreads, sizeof(tWorkerData));
+	for(long i=0; i<global->nThreads; i++) 
+		pthread_mutex_init(&global->workerData[i].powder_mutex, NULL);
+	global->nWorkersStarted = 0;
+	global->workerThreads = (pthread_t*) calloc(global->nThreads, sizeof(pthread_t));
+	for(long i=0; i<global->nThreads; i++) {
+		if (pthread_create(&global->workerThreads[i], NULL, workerThread, (void *)global)) {
+			printf("Error: could not create worker thread %li\n", i);
+			exit(1);
+		}
+	}
+	printf("Started %li worker threads\n", global->nThreads);
+}
+
+
+/*
+ *	Hand a frame over to the worker pool
+ *	Blocks while the queue is full, which throttles the event loop to the speed of the workers
+ */
+void queueWorkerJob(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	pthread_mutex_lock(&global->nActiveThreads_mutex);
+	while(global->jobQueueCount >= global->jobQueueSize) {
+		pthread_cond_wait(&global->jobQueueNotFull, &global->nActiveThreads_mutex);
+	}
+	threadInfo->threadNum = ++global->threadCounter;
+	global->jobQueue[(global->jobQueueHead+global->jobQueueCount) % global->jobQueueSize] = threadInfo;
+	global->jobQueueCount += 1;
+	pthread_cond_signal(&global->jobQueueNotEmpty);
+	pthread_mutex_unlock(&global->nActiveThreads_mutex);
+}
+
+
+/*
+ *	Wait until the queue is empty and all workers are idle
+ *	(needed before flushing HDF5 and at the end of the job)
+ */
+void waitForWorkerThreads(cGlobal *global) {
+	
+	pthread_mutex_lock(&global->nActiveThreads_mutex);
+	if (global->jobQueueCount > 0 || global->nActiveThreads > 0) {
+		printf("\twaiting for %i worker threads to finish\n", (int)(global->jobQueueCount + global->nActiveThreads));
+	}
+	while(global->jobQueueCount > 0 || global->nActiveThreads > 0) {
+		pthread_cond_wait(&global->workersIdle, &global->nActiveThreads_mutex);
+	}
+	pthread_mutex_unlock(&global->nActiveThreads_mutex);
+}
+
+
+/*
+ *	Drain the queue, tell all workers to exit and join them
+ */
+void stopWorkerThreads(cGlobal *global) {
+	
+	waitForWorkerThreads(global);
+	
+	pthread_mutex_lock(&global->nActiveThreads_mutex);
+	global->workerShutdown = 1;
+	pthread_cond_broadcast(&global->jobQueueNotEmpty);
+	pthread_mutex_unlock(&global->nActiveThreads_mutex);
+	
+	for(long i=0; i<global->nThreads; i++) {
+		pthread_join(global->workerThreads[i], NULL);
+	}
+	
+	free(global->workerThreads);
+	free(global->jobQueue);
+	global->workerThreads = NULL;
+	global->jobQueue = NULL;
+	pthread_cond_destroy(&global->jobQueueNotEmpty);
+	pthread_cond_destroy(&global->jobQueueNotFull);
+	pthread_cond_destroy(&global->workersIdle);
+}
+
+
+/*
+ *	Free the per-worker data (after stopWorkerThreads() and after anything left in it has been collected)
+ */
+void freeWorkerData(cGlobal *global) {
+	
+	if (global->workerData == NULL)
+		return;
+	for(long i=0; i<global->nThreads; i++) {
+		tWorkerData	*workerData = &global->workerData[i];
+		free(workerData->hotpixCount);
+		free(workerData->bgSum);
+		free(workerData->powderRaw);
+		free(workerData->powderAssembled);
+		free(workerData->powderVariance);
+		free(workerData->iceRaw);
+		free(workerData->iceAssembled);
+		free(workerData->waterRaw);
+		free(workerData->waterAssembled);
+		free(workerData->hitBitmap);
+		free(workerData->peakBitmap);
+		for(int k=0; k<NHITFINDERS; k++)
+			free(workerData->adcBitmap[k]);
+		free(workerData->peakLabel);
+		free(workerData->peakParent);
+		free(workerData->peakSize);
+		free(workerData->peakNumber);
+		free(workerData->peakOrder);
+		freeCorrelationSum(workerData->powderCorrelation);
+		freeCorrelationSum(workerData->iceCorrelation);
+		freeCorrelationSum(workerData->waterCorrelation);
+		freeXCCAWork(workerData);
+		pthread_mutex_destroy(&workerData->powder_mutex);
+	}
+	free(global->workerData);
+	global->workerData = NULL;
+}
+
+
+/*
+ *	Main loop of each worker thread: take the next frame from the queue and process it
+ */
+void *workerThread(void *threadarg) {
+	
+	cGlobal			*global;
+	tThreadInfo		*threadInfo;
+	long			workerNum;
+	
+	global = (cGlobal*) threadarg;
+	workerNum = __sync_fetch_and_add(&global->nWorkersStarted, 1);
+	
+	while(1) {
+		
+		// Wait for the next frame (or for the pool to be shut down)
+		pthread_mutex_lock(&global->nActiveThreads_mutex);
+		while(global->jobQueueCount == 0 && !global->workerShutdown) {
+			pthread_cond_wait(&global->jobQueueNotEmpty, &global->nActiveThreads_mutex);
+		}
+		if (global->jobQueueCount == 0 && global->workerShutdown) {
+			pthread_mutex_unlock(&global->nActiveThreads_mutex);
+			break;
+		}
+		threadInfo = global->jobQueue[global->jobQueueHead];
+		global->jobQueueHead = (global->jobQueueHead+1) % global->jobQueueSize;
+		global->jobQueueCount -= 1;
+		global->nActiveThreads += 1;
+		pthread_cond_signal(&global->jobQueueNotFull);
+		pthread_mutex_unlock(&global->nActiveThreads_mutex);
+		
+		// Process this frame
+		threadInfo->workerNum = workerNum;
+		worker(threadInfo);
+		
+		// Decrement thread pool counter by one
+		pthread_mutex_lock(&global->nActiveThreads_mutex);
+		global->nActiveThreads -= 1;
+		if (global->jobQueueCount == 0 && global->nActiveThreads == 0) 
+			pthread_cond_broadcast(&global->workersIdle);
+		pthread_mutex_unlock(&global->nActiveThreads_mutex);
+	}
+	
+	pthread_exit(NULL);
+}
+
+
+/*
+ *	Single thread that does the per-event output (HDF5 files, angular averages, pixel lists)
+ *	Workers hand the whole frame buffer over instead of copying the data out of it; the writer 
+ *	returns it to the pool once everything has been written, so workers never wait for the 
+ *	file system unless writerQueueSize frames are already waiting.
+ */
+static void *writerThread(void *threadarg) {
+	
+	cGlobal			*global = (cGlobal*) threadarg;
+	tThreadInfo		*threadInfo;
+	
+	while(1) {
+		
+		pthread_mutex_lock(&global->writer_mutex);
+		while(global->writerQueueCount == 0 && !global->writerShutdown) {
+			pthread_cond_wait(&global->writerQueueNotEmpty, &global->writer_mutex);
+		}
+		if (global->writerQueueCount == 0 && global->writerShutdown) {
+			pthread_mutex_unlock(&global->writer_mutex);
+			break;
+		}
+		threadInfo = global->writerQueue[global->writerQueueHead];
+		global->writerQueueHead = (global->writerQueueHead+1) % global->writerQueueSize;
+		global->writerQueueCount -= 1;
+		global->writerBusy = 1;
+		pthread_cond_signal(&global->writerQueueNotFull);
+		pthread_mutex_unlock(&global->writer_mutex);
+		
+		writeEvent(threadInfo, global);
+		releaseFrameBuffer(threadInfo, global);
+		
+		pthread_mutex_lock(&global->writer_mutex);
+		global->writerBusy = 0;
+		if (global->writerQueueCount == 0)
+			pthread_cond_broadcast(&global->writerIdle);
+		pthread_mutex_unlock(&global->writer_mutex);
+	}
+	
+	pthread_exit(NULL);
+}
+
+void startWriterThread(cGlobal *global) {
+	
+	global->writerQueue = (tThreadInfo**) calloc(global->writerQueueSize, sizeof(tThreadInfo*));
+	global->writerQueueHead = 0;
+	global->writerQueueCount = 0;
+	global->writerBusy = 0;
+	global->writerShutdown = 0;
+	pthread_mutex_init(&global->writer_mutex, NULL);
+	pthread_cond_init(&global->writerQueueNotEmpty, NULL);
+	pthread_cond_init(&global->writerQueueNotFull, NULL);
+	pthread_cond_init(&global->writerIdle, NULL);
+	
+	if (pthread_create(&global->writerThread, NULL, writerThread, (void *)global)) {
+		printf("Error: could not create writer thread\n");
+		exit(1);
+	}
+}
+
+
+/*
+ *	Pass a frame to the writer thread, which releases its frame buffer when done
+ */
+void queueWriterJob(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	pthread_mutex_lock(&global->writer_mutex);
+	while(global->writerQueueCount >= global->writerQueueSize) {
+		pthread_cond_wait(&global->writerQueueNotFull, &global->writer_mutex);
+	}
+	global->writerQueue[(global->writerQueueHead+global->writerQueueCount) % global->writerQueueSize] = threadInfo;
+	global->writerQueueCount += 1;
+	pthread_cond_signal(&global->writerQueueNotEmpty);
+	pthread_mutex_unlock(&global->writer_mutex);
+}
+
+
+/*
+ *	Wait until everything queued so far has been written (before flushing HDF5 and at the end of the job)
+ */
+void waitForWriterThread(cGlobal *global) {
+	
+	pthread_mutex_lock(&global->writer_mutex);
+	if (global->writerQueueCount > 0 || global->writerBusy) {
+		printf("\twaiting for %i frames to be written\n", (int)(global->writerQueueCount + global->writerBusy));
+	}
+	while(global->writerQueueCount > 0 || global->writerBusy) {
+		pthread_cond_wait(&global->writerIdle, &global->writer_mutex);
+	}
+	pthread_mutex_unlock(&global->writer_mutex);
+}
+
+
+/*
+ *	Write out what is left and join the writer thread (after stopWorkerThreads())
+ */
+void stopWriterThread(cGlobal *global) {
+	
+	waitForWriterThread(global);
+	
+	pthread_mutex_lock(&global->writer_mutex);
+	global->writerShutdown = 1;
+	pthread_cond_broadcast(&global->writerQueueNotEmpty);
+	pthread_mutex_unlock(&global->writer_mutex);
+	pthread_join(global->writerThread, NULL);
+	
+	free(global->writerQueue);
+	global->writerQueue = NULL;
+	pthread_cond_destroy(&global->writerQueueNotEmpty);
+	pthread_cond_destroy(&global->writerQueueNotFull);
+	pthread_cond_destroy(&global->writerIdle);
+	pthread_mutex_destroy(&global->writer_mutex);
+}
+
+
+/*
+ *	Preallocate a fixed number of frame buffers (tThreadInfo structures plus all per-frame arrays)
+ *	Buffers are handed out by getFrameBuffer() in the event loop and returned by the workers,
+ *	so no per-frame heap allocation is needed and the memory footprint is fixed at startup.
+ *	Enough buffers are allocated for all workers to be busy while the job queue and the writer queue are full.
+ */
+void allocateFrameBuffers(cGlobal *global) {
+	
+	int		needImage = (global->hdf5dump || global->powdersum
+						 || global->hitfinder.savehits
+						 || global->waterfinder.savehits
+						 || global->icefinder.savehits
+						 || global->backgroundfinder.savehits
+						 || global->listfinder.savehits);
+	
+	global->nFrameBuffers = 2*global->nThreads + global->writerQueueSize;
+	global->frameBuffers = (tThreadInfo**) calloc(global->nFrameBuffers, sizeof(tThreadInfo*));
+	global->freeFrameBuffers = (tThreadInfo**) calloc(global->nFrameBuffers, sizeof(tThreadInfo*));
+	
+	for(long n=0; n<global->nFrameBuffers; n++) {
+		tThreadInfo	*threadInfo = (tThreadInfo*) calloc(1, sizeof(tThreadInfo));
+		
+		threadInfo->pGlobal = global;
+		threadInfo->corrected_data = (float*) calloc(RAW_DATA_LENGTH, sizeof(float));
+		if (needImage) {
+			threadInfo->image = (float*) calloc(global->image_nn, sizeof(float));
+		}
+		if (global->hitAngularAvg) {
+			threadInfo->angularAvg = (double*) calloc(global->angularAvg_nn, sizeof(double));
+			threadInfo->angularAvgQ = (double*) calloc(global->angularAvg_nn, sizeof(double));
+			threadInfo->angularAvgCounter = (unsigned*) calloc(global->angularAvg_nn, sizeof(unsigned));
+		}
+		if (global->useCorrelation) {
+			threadInfo->correlation = (double*) calloc(global->correlation_nn, sizeof(double));
+		}
+		
+		global->frameBuffers[n] = threadInfo;
+		global->freeFrameBuffers[n] = threadInfo;
+	}
+	global->nFreeFrameBuffers = global->nFrameBuffers;
+	
+	pthread_mutex_init(&global->framebuffer_mutex, NULL);
+	pthread_cond_init(&global->frameBufferAvailable, NULL);
+	
+	printf("Allocated %li frame buffers\n", global->nFrameBuffers);
+}
+
+
+/*
+ *	Take a frame buffer from the pool, waiting for a worker to return one if necessary
+ */
+tThreadInfo *getFrameBuffer(cGlobal *global) {
+	
+	tThreadInfo	*threadInfo;
+	
+	pthread_mutex_lock(&global->framebuffer_mutex);
+	while(global->nFreeFrameBuffers == 0) {
+		pthread_cond_wait(&global->frameBufferAvailable, &global->framebuffer_mutex);
+	}
+	threadInfo = global->freeFrameBuffers[--global->nFreeFrameBuffers];
+	pthread_mutex_unlock(&global->framebuffer_mutex);
+	
+	return threadInfo;
+}
+
+
+/*
+ *	Return a frame buffer to the pool
+ */
+void releaseFrameBuffer(tThreadInfo *threadInfo, cGlobal *global) {
+	
+	pthread_mutex_lock(&global->framebuffer_mutex);
+	global->freeFrameBuffers[global->nFreeFrameBuffers++] = threadInfo;
+	pthread_cond_signal(&global->frameBufferAvailable);
+	pthread_mutex_unlock(&global->framebuffer_mutex);
+}
+
+
+/*
+ *	Free all frame buffers (only once the worker threads have been stopped)
+ */
+void freeFrameBuffers(cGlobal *global) {
+	
+	for(long n=0; n<global->nFrameBuffers; n++) {
+		tThreadInfo	*threadInfo = global->frameBuffers[n];
+		free(threadInfo->corrected_data);
+		free(threadInfo->image);
+		free(threadInfo->angularAvg);
+		free(threadInfo->angularAvgQ);
+		free(threadInfo->angularAvgCounter);
+		free(threadInfo->correlation);
+		free(threadInfo->peakList);
+		free(threadInfo->peakPixels);
+		free(threadInfo);
+	}
+	free(global->frameBuffers);
+	free(global->freeFrameBuffers);
+	global->frameBuffers = NULL;
+	global->freeFrameBuffers = NULL;
+	global->nFrameBuffers = 0;
+	global->nFreeFrameBuffers = 0;
+	
+	pthread_cond_destroy(&global->frameBufferAvailable);
+	pthread_mutex_destroy(&global->framebuffer_mutex);
+}
@@ -0,0 +1,96 @@
+/*
+ *  threadpool.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License 
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>. 
+ */
+ 
+#ifndef _threadpool_h
+#define _threadpool_h
+
+#include <stdint.h>
+
+#include "setup.h"
+#include "worker.h"
+
+struct sXCCAWork;
+typedef struct sXCCAWork tXCCAWork;		// defined in xcca.h
+struct sXCCASum;
+typedef struct sXCCASum tXCCASum;		// defined in xcca.h
+
+/*
+ *	Data private to one worker thread, allocated by each subsystem the first time a worker needs it
+ */
+typedef struct sWorkerData {
+	
+	// Frames above hotpixADC since this worker last updated the shared hot pixel mask
+	uint16_t	*hotpixCount;
+	long		hotpixFrames;
+	
+	// Non-hits summed since this worker last published the persistent background
+	float		*bgSum;
+	double		bgGMD;
+	long		bgFrames;
+	
+	// Powder sums of the frames processed by this worker since the last mergePowders()
+	pthread_mutex_t	powder_mutex;		// only contended while the sums are being merged
+	double		*powderRaw;
+	double		*powderAssembled;
+	double		*powderVariance;
+	double		*iceRaw;
+	double		*iceAssembled;
+	double		*waterRaw;
+	double		*waterAssembled;
+	long		npowder;
+	long		nice;
+	long		nwater;
+	tXCCASum	*powderCorrelation;
+	tXCCASum	*iceCorrelation;
+	tXCCASum	*waterCorrelation;
+	
+	// Pixels above threshold and pixels of recorded peaks (hitfinder, one bit per pixel)
+	uint64_t	*hitBitmap;
+	uint64_t	*peakBitmap;
+	uint64_t	*adcBitmap[NHITFINDERS];	// shared by the hitfinders, one per distinct hitfinderADC
+	
+	// Peak labelling of one ASIC (hitfinder algorithm 3)
+	int			*peakLabel;
+	int			*peakParent;
+	int			*peakSize;
+	int			*peakNumber;
+	int			*peakOrder;
+	
+	// Polar grid, FFT buffers and ring averages of the angular correlation
+	tXCCAWork	*xcca;
+	
+} tWorkerData;
+
+/*
+ *	Function prototypes
+ */
+void startWorkerThreads(cGlobal*);
+void queueWorkerJob(tThreadInfo*, cGlobal*);
+void waitForWorkerThreads(cGlobal*);
+void stopWorkerThreads(cGlobal*);
+void freeWorkerData(cGlobal*);
+void *workerThread(void*);
+void startWriterThread(cGlobal*);
+void queueWriterJob(tThreadInfo*, cGlobal*);
+void waitForWriterThread(cGlobal*);
+void stopWriterThread(cGlobal*);
+void allocateFrameBuffers(cGlobal*);
+tThreadInfo *getFrameBuffer(cGlobal*);
+void releaseFrameBuffer(tThreadInfo*, cGlobal*);
+void freeFrameBuffers(cGlobal*);
+
+#endif
@@ -42,53 +42,39 @@ using std::string;
 #include "commonmode.h"
 #include "background.h"
 #include "correlation.h"
+#include "threadpool.h"
+#include "calibration.h"
+#include "geometry.h"
+#include "hdf5writer.h"
+#include "framelog.h"
+#include "statistics.h"
+#include "xcca.h"
 #include "arrayclasses.h"
 #include "arraydataIO.h"
 #include "util.h"
 
 
 /*
- *	Worker thread function for processing each cspad data frame
+ *	Process one cspad data frame
+ *	(called by the worker threads in threadpool.cpp for each frame taken from the queue)
  */
-void *worker(void *threadarg) {
+void worker(tThreadInfo *threadInfo) {
 
-	/*
-	 *	Turn threadarg into a more useful form
-	 */
 	cGlobal			*global;
-	tThreadInfo		*threadInfo;
 	cHit 			hit;
 
-	threadInfo = (tThreadInfo*) threadarg; 	
 	global = threadInfo->pGlobal;
 	
 	
-	
 	/*
-	 *	Assemble data from all four quadrants into one large array (rawdata format)
+	 *	Raw data from all four quadrants has already been unpacked into corrected_data (rawdata format) by event()
+	 *	All other analysis arrays are preallocated in the frame buffer pool (see allocateFrameBuffers)
 	 */
-	threadInfo->corrected_data = (float*) calloc(RAW_DATA_LENGTH,sizeof(float));
-	for(int quadrant=0; quadrant<4; quadrant++) {
-		long	i,j,ii;
-		for(long k=0; k<2*ROWS*8*COLS; k++) {
-			i = k % (2*ROWS) + quadrant*(2*ROWS);
-			j = k / (2*ROWS);
-			ii  = i+(8*ROWS)*j;
-			threadInfo->corrected_data[ii] = (float) threadInfo->quad_data[quadrant][k];
-		}
-	}
-	
-	
-	/*
-	 *	Initialize pointers to analysis arrays to NULL
-	 */
-	threadInfo->angularAvg = NULL;
-	threadInfo->angularAvgQ = NULL;
-	threadInfo->correlation = NULL;
-	threadInfo->image = NULL;
-	threadInfo->theta = NULL;
-	threadInfo->pix_qx = NULL;
-	threadInfo->pix_qy = NULL;
+	threadInfo->correlated = 0;
+	threadInfo->geometry = NULL;
+	threadInfo->writeFlags = 0;
+	threadInfo->nPeakList = 0;
+	threadInfo->nPeakPixels = 0;
 	
 	
 	/*
@@ -101,41 +87,49 @@ void *worker(void *threadarg) {
 	 *	Create a unique name for this event
 	 */
 	nameEvent(threadInfo, global);
-		
-
+	
+	
 	/*
-	 *	Subtract darkcal image (static electronic offsets)
+	 *	Energy calibration: keep photon energy and wavelength of every frame
 	 */
-	if(global->useDarkcalSubtraction) {
-		subtractDarkcal(threadInfo, global);
+	if (global->useEnergyCalibration && threadInfo->photonEnergyeV == threadInfo->photonEnergyeV) { // Check if photonEnergyeV is NAN
+		setStatistic(global, threadInfo->threadNum, STAT_PHOTONENERGY, threadInfo->photonEnergyeV);
+		setStatistic(global, threadInfo->threadNum, STAT_WAVELENGTH, threadInfo->wavelengthA);
 	}
+		
 
-	
 	/*
-	 *	Subtract common mode offsets (electronic offsets)
+	 *	Pre-screen on the raw data: frames that cannot be hits only get the corrections needed for the
+	 *	running background, hot pixel and intensity statistics. A fraction (prescreenSample) of the 
+	 *	rejected frames is processed in full anyway, to count how many hits the pre-screen misses.
 	 */
-	if(global->cmModule) {
-		cmModuleSubtract(threadInfo, global);
-	}
-	else if(global->cmSubModule) {
-		cmSubModuleSubtract(threadInfo, global);
+	int rejected = 0;
+	int checked = 0;
+	if (global->prescreen && threadInfo->threadNum >= global->startFrames && !prescreenFrame(threadInfo, global)) {
+		__sync_fetch_and_add(&global->nPrescreenRejected, 1);
+		rejected = 1;
+		checked = ((long) (threadInfo->threadNum*global->prescreenSample) != (long) ((threadInfo->threadNum+1)*global->prescreenSample));
 	}
+	int screened = rejected && !checked;
+	int correct = !screened || global->useSubtractPersistentBackground || global->useAutoHotpixel || global->useIntensityStatistics;
 	
 	
 	/*
-	 *	Apply gain correction
+	 *	Static corrections: darkcal, common mode, gain and bad pixel mask
+	 *	Common mode has to be estimated on dark-subtracted data, so in that case the 
+	 *	darkcal is applied in a separate pass, otherwise all stages are fused into one pass
 	 */
-	if(global->useGaincal) {
-		applyGainCorrection(threadInfo, global);
+	if(correct && (global->cmModule || global->cmSubModule)) {
+		applyStaticCorrections(threadInfo, global, CORRECT_DARKCAL);
+		if(global->cmModule)
+			cmModuleSubtract(threadInfo, global);
+		else
+			cmSubModuleSubtract(threadInfo, global);
+		applyStaticCorrections(threadInfo, global, CORRECT_GAIN | CORRECT_BADPIXEL);
+	}
+	else if(correct) {
+		applyStaticCorrections(threadInfo, global, CORRECT_DARKCAL | CORRECT_GAIN | CORRECT_BADPIXEL);
 	}
-	
-	
-	/*
-	 *	Apply bad pixel map
-	 */
-	if(global->useBadPixelMask) {
-		applyBadPixelMask(threadInfo, global);
-	} 
 	
 	
 	/*
@@ -155,48 +149,24 @@ void *worker(void *threadarg) {
 	
 	
 	/*
-	 *	Hitfinding
+	 *	Hitfinding: standard, water, ice, background and list hitfinders in one go
 	 */
-	hit.standard = 0;
-	if(global->hitfinder.use){
-		hit.standard = hitfinder(threadInfo, global, &(global->hitfinder));
-		hit.standardPeaks = threadInfo->nPeaks;
+	if (screened) {
+		hit.standard = 0;
+		hit.water = 0;
+		hit.ice = 0;
+		hit.background = 1;
+		hit.list = 0;
+		hit.standardPeaks = hit.waterPeaks = hit.icePeaks = hit.backgroundPeaks = hit.listPeaks = 0;
+		threadInfo->nPeaks = 0;
 	}
+	else
+		hitfinders(threadInfo, global, &hit);
 	
-	/*
-	 *	Hitfinding - Water
-	 */
-	hit.water = 0;
-	if(global->waterfinder.use){
-		hit.water = hitfinder(threadInfo, global, &(global->waterfinder));
-		hit.waterPeaks = threadInfo->nPeaks;
-	}
-
-	/*
-	 *	Hitfinding - Ice
-	 */
-	hit.ice = 0;
-	if(global->icefinder.use){
-		hit.ice = hitfinder(threadInfo, global, &(global->icefinder));
-		hit.icePeaks = threadInfo->nPeaks;
-	}
-	 
-	/*
-	 *	Hitfinding - Background
-	 */
-	hit.background = 1;
-	if(global->backgroundfinder.use){
-		hit.background = hitfinder(threadInfo, global, &(global->backgroundfinder));
-		hit.backgroundPeaks = threadInfo->nPeaks;
-	}
-	
-	/*
-	 *	Hitfinding - List
-	 */
-	hit.list = 0;
-	if(global->listfinder.use){
-		hit.list = hitfinder(threadInfo, global, &(global->listfinder));
-		hit.listPeaks = threadInfo->nPeaks;
+	if (checked) {
+		__sync_fetch_and_add(&global->nPrescreenChecked, 1);
+		if (hit.standard || hit.water || hit.ice)
+			__sync_fetch_and_add(&global->nPrescreenMissed, 1);
 	}
 	
 	/*
@@ -247,7 +217,8 @@ void *worker(void *threadarg) {
 	
 	
 	/*
-	 *	Calculate scattering angle (theta)
+	 *	Look up scattering angle (theta) and the combined polarization/solid angle correction 
+	 *	for this detector position, only recalculated when the detector moves
 	 */
 	if ((global->usePolarizationCorrection || global->useSolidAngleCorrection || global->useCorrelation) && (global->hdf5dump
 																			  || global->generateDarkcal
@@ -255,65 +226,50 @@ void *worker(void *threadarg) {
 																		      || hit.water
 																			  || hit.ice
 																			  || !hit.background )) {
-		calculateScatteringAngle(threadInfo, global);
+		pinGeometry(threadInfo, global);
 	}
 	
 	
 	/*
-	 *	Calculate polarization correction
-	 */
-	if (global->usePolarizationCorrection && (global->hdf5dump || global->generateDarkcal
-															   || hit.standard
-															   || hit.water
-															   || hit.ice
-															   || !hit.background )) {
-		calculatePolarizationCorrection(threadInfo, global);
-	}
-	
-	
-	/*
-	 *	Calculate solid angle correction
+	 *	Apply polarization and solid angle correction
 	 */
 	threadInfo->solidAngle = global->pixelSize*global->pixelSize/(threadInfo->detectorPosition/1000*threadInfo->detectorPosition/1000);
-	if (global->useSolidAngleCorrection && (global->hdf5dump || global->generateDarkcal
-															 || hit.standard
-															 || hit.water
-															 || hit.ice
-															 || !hit.background )) {
-		calculateSolidAngleCorrection(threadInfo, global);
+	if ((global->usePolarizationCorrection || global->useSolidAngleCorrection) && (global->hdf5dump || global->generateDarkcal
+																			   || hit.standard
+																			   || hit.water
+																			   || hit.ice
+																			   || !hit.background )) {
+		applyGeometryCorrection(threadInfo, global);
 	}
 	
 	
 	/*
 	 *	Apply attenuation correction
 	 */
-	if (global->useAttenuationCorrection > 0) {
+	if (global->useAttenuationCorrection > 0 && !(screened && !global->useIntensityStatistics)) {
 		applyAttenuationCorrection(threadInfo, global);
 	}
 	
 	
 	/*
-     *  Calculate intensity average
+     *  Calculate intensity average (left at 0 for frames rejected by the pre-screen unless intensity statistics are kept)
      */
-	calculateIntensityAvg(threadInfo, global);
+	if (screened && !global->useIntensityStatistics)
+		threadInfo->intensityAvg = 0;
+	else
+		calculateIntensityAvg(threadInfo, global);
 	if (global->useIntensityStatistics) {
-		pthread_mutex_lock(&global->intensities_mutex);
-		if (global->nIntensities >= global->intensityCapacity) global->expandIntensityCapacity();
-		if (global->hdf5dump || global->generateDarkcal
-							 || hit.standard
-							 || hit.water
-							 || hit.ice
-							 || !hit.background) {
-			global->hits[global->nIntensities] = true;
-		} else {
-			global->hits[global->nIntensities] = false;
-		}
-		// OBS: - the order of global->intensities will not be exactly the same as the event order, but close enough (within global->nThreads of events)
-		//      - if useSolidAngleCorrection and/or usePolarizationCorrection is enabled, they will only be calculated for hits/saved events
-		global->intensities[global->nIntensities++] = threadInfo->intensityAvg; 
-		if (threadInfo->intensityAvg > global->Imax) global->Imax = threadInfo->intensityAvg;
-		if (threadInfo->intensityAvg < global->Imin) global->Imin = threadInfo->intensityAvg;
-		pthread_mutex_unlock(&global->intensities_mutex);
+		int saved = (global->hdf5dump || global->generateDarkcal
+									  || hit.standard
+									  || hit.water
+									  || hit.ice
+									  || !hit.background);
+		// OBS: if useSolidAngleCorrection and/or usePolarizationCorrection is enabled, they will only be calculated for hits/saved events
+		setStatistic(global, threadInfo->threadNum, STAT_INTENSITY, threadInfo->intensityAvg);
+		setStatistic(global, threadInfo->threadNum, STAT_HIT, saved);
+		setStatistic(global, threadInfo->threadNum, STAT_NPEAKS, hit.standardPeaks);
+		setStatistic(global, threadInfo->threadNum, STAT_NHOT, threadInfo->nHot);
+		setStatistic(global, threadInfo->threadNum, STAT_GMD, (threadInfo->gmd21+threadInfo->gmd22)/2);
 	}
 	
 	
@@ -327,7 +283,7 @@ void *worker(void *threadarg) {
 												   || (!hit.background && global->backgroundfinder.savehits) )) {
 		calculateAngularAvg(threadInfo, global);
 		fail = makeQcalibration(threadInfo, global);
-		if (!fail) saveAngularAvg(threadInfo, global);
+		if (!fail) threadInfo->writeFlags |= WRITE_ANGULARAVG;
 		else cout << "Failed to calibrate Q for " << threadInfo->eventname << ", angular average NOT saved." << endl;
 	}
 	
@@ -340,7 +296,7 @@ void *worker(void *threadarg) {
 													|| hit.water
 													|| hit.ice
 													|| !hit.background )) {
-		fail = calculatePixelMaps(threadInfo, global);
+		fail = calculatePixelMaps(threadInfo);
 		if (!fail) correlate(threadInfo, global, &hit);
 		else cout << "Failed to make Q-calibrated pixel maps for " << threadInfo->eventname << ", correlation NOT saved." << endl;
 	}
@@ -355,10 +311,10 @@ void *worker(void *threadarg) {
 														|| (hit.ice && global->icefinder.savehits) 
 														|| (!hit.background && global->backgroundfinder.savehits) )) {
 		// save pixel intensities of hit without Q-scale (1D array)
-		//if (!global->useCorrelation) fail = calculatePixelMaps(threadInfo, global);
+		//if (!global->useCorrelation) fail = calculatePixelMaps(threadInfo);
 		//if (!fail) savePixelIntensities(threadInfo, global);
 		//else cout << "Failed to calibrate Q for " << threadInfo->eventname << ", pixel intensities NOT saved." << endl;
-		savePixelIntensities(threadInfo, global);
+		threadInfo->writeFlags |= WRITE_PIXELS;
 	}
 	
 	
@@ -388,28 +344,29 @@ void *worker(void *threadarg) {
 	
 	/*
 	 *	If this is a hit, write out to our favourite HDF5 format
+	 *	(done by the writer thread, see writeEvent)
 	 */
 	if(global->hdf5dump) 
-		writeHDF5(threadInfo, global, threadInfo->eventname);
+		threadInfo->writeFlags |= WRITE_HDF5;
 	else {
 		if(hit.standard && global->hitfinder.savehits) {
 			threadInfo->nPeaks = hit.standardPeaks;
-			writeHDF5(threadInfo, global, threadInfo->eventname);
+			threadInfo->writeFlags |= WRITE_HDF5;
 		}
 		
 		if(hit.water && global->waterfinder.savehits) {
 			threadInfo->nPeaks = hit.waterPeaks;
-			writeHDF5(threadInfo, global, threadInfo->eventname);
+			threadInfo->writeFlags |= WRITE_HDF5;
 		}
 		
 		if(hit.ice && global->icefinder.savehits) {
 			threadInfo->nPeaks = hit.icePeaks;
-			writeHDF5(threadInfo, global, threadInfo->eventname);			
+			threadInfo->writeFlags |= WRITE_HDF5;
 		}
 		
 		if(!hit.background && global->backgroundfinder.savehits) {
 			threadInfo->nPeaks = hit.backgroundPeaks;
-			writeHDF5(threadInfo, global, threadInfo->eventname);			
+			threadInfo->writeFlags |= WRITE_HDF5;
 		}
 		
 //		char eventname[1024];
@@ -432,7 +389,9 @@ void *worker(void *threadarg) {
 	/*
 	 *	Write out diagnostics to screen
 	 */	
-	if (global->useAutoHotpixel) {
+	if (screened) {
+		printf("r%04u:%i (%3.1f Hz): Rejected by pre-screen\n", (int)threadInfo->runNumber, (int)threadInfo->threadNum, global->datarate);
+	} else if (global->useAutoHotpixel) {
 		printf("r%04u:%i (%3.1f Hz): Processed (iavg=%4.2f, hot=%i", (int)threadInfo->runNumber, (int)threadInfo->threadNum, global->datarate, threadInfo->intensityAvg, threadInfo->nHot);
 		if (global->hitfinder.use) {
 			printf("; hit=%i, nat/npeaks=%i", hit.standard, hit.standardPeaks);
@@ -467,322 +426,164 @@ void *worker(void *threadarg) {
 		printf(")\n");
 	}
 	
-	/*
-	 *	Write out information on each frame to a log file
-	 */
-	pthread_mutex_lock(&global->framefp_mutex);
-	fprintf(global->framefp, "%i, %i, %s, %f", (int)threadInfo->threadNum, threadInfo->seconds, threadInfo->eventname, threadInfo->intensityAvg);
-	if (global->hitfinder.use) {
-		fprintf(global->framefp, ", %i", hit.standardPeaks);
-		if (hit.standard) fprintf(global->hitfinder.cleanedfp, "r%04u/%s, %f, %i\n", (int)threadInfo->runNumber, threadInfo->eventname, threadInfo->intensityAvg, hit.standardPeaks);
-	}
-	if (global->icefinder.use) {
-		fprintf(global->framefp, ", %i", hit.icePeaks);
-		if (hit.ice) fprintf(global->icefinder.cleanedfp, "r%04u/%s, %f, %i\n", (int)threadInfo->runNumber, threadInfo->eventname, threadInfo->intensityAvg, hit.icePeaks);
-	}
-	if (global->waterfinder.use) {
-		fprintf(global->framefp, ", %i", hit.waterPeaks);
-		if (hit.water) fprintf(global->waterfinder.cleanedfp, "r%04u/%s, %f, %i\n", (int)threadInfo->runNumber, threadInfo->eventname, threadInfo->intensityAvg, hit.waterPeaks);
-	}
-	if (global->backgroundfinder.use) {
-		fprintf(global->framefp, ", %i", hit.backgroundPeaks);
-		if (hit.background) fprintf(global->backgroundfinder.cleanedfp, "r%04u/%s, %f, %i\n", (int)threadInfo->runNumber, threadInfo->eventname, threadInfo->intensityAvg, hit.backgroundPeaks);
-	}
-	if (global->listfinder.use) {
-		fprintf(global->framefp, ", %i", hit.listPeaks);
-		fprintf(global->hitfinder.cleanedfp, "r%04u/%s, %f, %i\n", (int)threadInfo->runNumber, threadInfo->eventname, threadInfo->intensityAvg, hit.listPeaks);
-	}
-	fprintf(global->framefp, "\n");
-	pthread_mutex_unlock(&global->framefp_mutex);
-	
 	
 	/*
 	 *	Cleanup and exit
 	 */
 	cleanup:
-	// Decrement thread pool counter by one
-	pthread_mutex_lock(&global->nActiveThreads_mutex);
-	global->nActiveThreads -= 1;
-	pthread_mutex_unlock(&global->nActiveThreads_mutex);
-	
-	// Free memory
-	for(int quadrant=0; quadrant<4; quadrant++) 
-		free(threadInfo->quad_data[quadrant]);	
-	free(threadInfo->corrected_data);
-	free(threadInfo->image);
-	free(threadInfo->angularAvg);
-	free(threadInfo->angularAvgQ);
-	free(threadInfo->correlation);
-	delete[] threadInfo->theta;
-	delete[] threadInfo->pix_qx;
-	delete[] threadInfo->pix_qy;
-	free(threadInfo);
-	
-	// Exit thread
-	pthread_exit(NULL);
-}
-
-
-/*
- *	Subtract pre-loaded darkcal file
- */
-void subtractDarkcal(tThreadInfo *threadInfo, cGlobal *global){
+	// Let go of the geometry first, frames waiting in pinGeometry() must not wait for the frame log
+	unpinGeometry(threadInfo, global);
 	
+	// Hand this frame's entry to the frame log, in order of threadNum (see framelog.cpp)
+	logFrame(threadInfo, global, &hit);
 	
-	// Do darkcal subtraction
-	// Watch out for integer wraparound!
-	int32_t diff;
-	for(long i=0;i<global->pix_nn;i++) {
-		diff = (int32_t) threadInfo->corrected_data[i] - (int32_t) global->darkcal[i];	
-		if(diff < -32766) diff = -32767;
-		if(diff > 32766) diff = 32767;
-		threadInfo->corrected_data[i] = (int16_t) diff;
-	}
-	
-}
-
-/*
- *	Apply gain correction
- *	Assumes the gaincal array is appropriately 'prepared' when loaded so that all we do is a multiplication.
- *	All that checking for division by zero (and inverting when required) needs only be done once, right? 
- */
-void applyGainCorrection(tThreadInfo *threadInfo, cGlobal *global){
-	
-	for(long i=0;i<global->pix_nn;i++) 
-		threadInfo->corrected_data[i] *= global->gaincal[i];
-	
+	// Free memory and return the frame buffer to the pool (or pass it on to the writer thread)
+	if (threadInfo->writeFlags)
+		queueWriterJob(threadInfo, global);
+	else
+		releaseFrameBuffer(threadInfo, global);
 }
 
 
 /*
- *	Apply bad pixel mask
- *	Assumes that all we have to do here is a multiplication.
+ *	Write out everything the worker flagged for this frame, called by the writer thread
  */
-void applyBadPixelMask(tThreadInfo *threadInfo, cGlobal *global){
-	
-	for(long i=0;i<global->pix_nn;i++) 
-		threadInfo->corrected_data[i] *= global->badpixelmask[i];
+void writeEvent(tThreadInfo *threadInfo, cGlobal *global) {
 	
+	if (threadInfo->writeFlags & WRITE_HDF5)
+		writeHDF5(threadInfo, global, threadInfo->eventname);
+	if (threadInfo->writeFlags & WRITE_ANGULARAVG)
+		saveAngularAvg(threadInfo, global);
+	if (threadInfo->writeFlags & WRITE_PIXELS)
+		savePixelIntensities(threadInfo, global);
+	threadInfo->writeFlags = 0;
 }
 
 
 /*
  *	Identify and kill hot pixels
+ *	Pixels are killed according to the latest published hot pixel mask, which is read without locking.
+ *	Each worker counts how often every pixel is above hotpixADC in its own array and adds the counts
+ *	to the shared mask every hotpixRecalc frames.
  */
 void killHotpixels(tThreadInfo *threadInfo, cGlobal *global){
 	
 	int	nhot = 0;
-
-	pthread_mutex_lock(&global->hotpixel_mutex);
+	int	pinned;
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	
+	if (workerData->hotpixCount == NULL) 
+		workerData->hotpixCount = (uint16_t*) calloc(global->pix_nn, sizeof(uint16_t));
+	uint16_t	*count = workerData->hotpixCount;
+	float		*data = threadInfo->corrected_data;
+	
+	const char	*hot = (const char*) pinSnapshot(&global->hotpixelSnapshot, &pinned);
 	for(long i=0;i<global->pix_nn;i++){
-		global->hotpixelmask[i] = ( (global->hotpixMemory-1)*global->hotpixelmask[i] + ((threadInfo->corrected_data[i]>global->hotpixADC)?(1.0):(0.0))) / global->hotpixMemory;
-
-		if(global->hotpixelmask[i] > global->hotpixFreq) {
-			threadInfo->corrected_data[i] = 0;
+		count[i] += (data[i] > global->hotpixADC);
+		if(hot[i]) {
+			data[i] = 0;
 			nhot++;
 		}
 	}
-	pthread_mutex_unlock(&global->hotpixel_mutex);
+	unpinSnapshot(&global->hotpixelSnapshot, pinned);
 	threadInfo->nHot = nhot;
+	
+	// Update the shared mask from hotpixRecalc frames on (see snapshot.h)
+	workerData->hotpixFrames++;
+	if(workerData->hotpixFrames >= global->hotpixRecalc) 
+		updateHotpixelMask(workerData, global, workerData->hotpixFrames >= 2*global->hotpixRecalc);
 }
 
 
 /*
- *	Calculate array of scattering angle (theta)
+ *	Add the hot pixel counts of one worker to the shared hot pixel mask (M = hotpixMemory) and publish the new list of hot pixels
  */
-void calculateScatteringAngle(tThreadInfo *threadInfo, cGlobal *global) {
+void updateHotpixelMask(tWorkerData *workerData, cGlobal *global, int wait){
 	
-	// allocate scattering angle array
-	if (threadInfo->theta) {
-		delete[] threadInfo->theta;
-	}
-	threadInfo->theta = new double[global->pix_nn];
+	if(wait)
+		pthread_mutex_lock(&global->hotpixel_mutex);
+	else if(pthread_mutex_trylock(&global->hotpixel_mutex))
+		return;
+	
+	double	n = workerData->hotpixFrames;
+	float	decay = pow((global->hotpixMemory-1.0)/global->hotpixMemory, n);
+	float	*mask = global->hotpixelmask;
+	uint16_t	*count = workerData->hotpixCount;
 	
-	// calculate scattering angle (theta) for each pixel
-	for (int i = 0; i < global->pix_nn; i++) {
-		threadInfo->theta[i] = atan(global->pixelSize*global->pix_r[i]*1000/threadInfo->detectorPosition);
+	char	*hot = (char*) beginSnapshotUpdate(&global->hotpixelSnapshot);
+	for(long i=0;i<global->pix_nn;i++){
+		mask[i] = decay*mask[i] + (1-decay)*(count[i]/n);
+		hot[i] = (mask[i] > global->hotpixFreq);
+		count[i] = 0;
 	}
+	publishSnapshot(&global->hotpixelSnapshot);
+	workerData->hotpixFrames = 0;
+	
+	pthread_mutex_unlock(&global->hotpixel_mutex);
 }
 
 
 /*
- *	Calculate Q-calibrated pixel maps
+ *	Check that detector position and wavelength of this frame can be used for the correlation
+ *	(the pixels of each q ring are sorted out once per geometry in the polar map, see xcca.cpp)
  */
-int calculatePixelMaps(tThreadInfo *threadInfo, cGlobal *global) {
+int calculatePixelMaps(tThreadInfo *threadInfo) {
 	
 	// sanity check
 	if (threadInfo->detectorPosition > 60 && threadInfo->detectorPosition < 600 && threadInfo->wavelengthA == threadInfo->wavelengthA) {
-		// allocate arrays for Q-calibrated pixel maps (needs to be float precision for current CrossCorrelator)
-		if (threadInfo->pix_qx) {
-			delete[] threadInfo->pix_qx;
-		}
-		if (threadInfo->pix_qy) {
-			delete[] threadInfo->pix_qy;
-		}
-		threadInfo->pix_qx = new float[global->pix_nn];
-		threadInfo->pix_qy = new float[global->pix_nn];
-		
-		if (global->correlationQScale == 2) { // |q| [Å-1]
-			// calculate the magnitude of the q-vector [Å-1] and create the qx/qy pixel maps from that
-			for (int i = 0; i < global->pix_nn; i++) {
-				double pix_qperp = 4*M_PI*sin(threadInfo->theta[i]/2)/threadInfo->wavelengthA;
-				threadInfo->pix_qx[i] = (float) pix_qperp*sin(global->phi[i]); // phi=0 is defined in +Y direction
-				threadInfo->pix_qy[i] = (float) pix_qperp*cos(global->phi[i]);
-			}			
-		} else if (global->correlationQScale == 3) { // |q_perp|
-			// calculate the magnitude of the perpendicular q-component [Å-1] and create the qx/qy pixel maps from that
-			for (int i = 0; i < global->pix_nn; i++) {
-				double pix_qperp = 2*M_PI*sin(threadInfo->theta[i])/threadInfo->wavelengthA;
-				threadInfo->pix_qx[i] = (float) pix_qperp*sin(global->phi[i]); // phi=0 is defined in +Y direction
-				threadInfo->pix_qy[i] = (float) pix_qperp*cos(global->phi[i]);
-			}			
-		} else { // pixels
-			// use global->pix_x/global->pix_y as pixel maps
-			delete[] threadInfo->pix_qx;
-			delete[] threadInfo->pix_qy;
-			threadInfo->pix_qx = NULL;
-			threadInfo->pix_qy = NULL;
-		}
-		
 		return 0;
 	} else return 1;
 }
 
 
 /*
- *	Calculate polarization correction
+ *	Maintain running powder patterns
+ *	Each worker sums into its own arrays, which are only merged into the global powder patterns 
+ *	by mergePowders() when the result is needed, so hits never wait for each other here
  */
-void calculatePolarizationCorrection(tThreadInfo *threadInfo, cGlobal *global) {
-	
-	// calculate and apply polarization correction to corrected_data (from Hura et al JCP 2000)
-	for (int i = 0; i < global->pix_nn; i++) {
-		threadInfo->corrected_data[i] /= global->horizontalPolarization*(1 - sin(global->phi[i])*sin(global->phi[i])*sin(threadInfo->theta[i])*sin(threadInfo->theta[i])) + (1 - global->horizontalPolarization)*(1 - cos(global->phi[i])*cos(global->phi[i])*sin(threadInfo->theta[i])*sin(threadInfo->theta[i]));
-	}
+static void addToSum(double *&sum, float *data, long n) {
+	if (sum == NULL)
+		sum = (double*) calloc(n, sizeof(double));
+	for(long i=0; i<n; i++)
+		sum[i] += data[i];
 }
 
-
-/*
- *	Calculate solid angle correction
- */
-void calculateSolidAngleCorrection(tThreadInfo *threadInfo, cGlobal *global) {
-	
-	if (global->useSolidAngleCorrection == 2) {
-		
-		// Azimuthally symmetrical correction
-		for (int i = 0; i < global->pix_nn; i++) {
-			threadInfo->corrected_data[i] /= cos(threadInfo->theta[i])*cos(threadInfo->theta[i])*cos(threadInfo->theta[i]);
-		}
-		
-	} else {
-		
-		// Rigorous correction from solid angle of a plane triangle
-		for (int i = 0; i < global->pix_nn; i++) {
-			
-			// allocate local arrays
-			double corner_coordinates[4][3]; // array of vector coordinates of pixel corners, first index starts from upper left corner and goes around clock-wise, second index determines X=0/Y=1/Z=2 coordinate
-			double corner_distances[4]; // array of distances of pixel corners, index starts from upper left corner and goes around clock-wise
-			double determinant;
-			double denominator;
-			double solid_angle[2]; // array of solid angles of the two plane triangles that form the pixel
-			double total_solid_angle;
-			
-			// upper left corner
-			corner_coordinates[0][0] = global->pix_x[i]*global->pixelSize + global->pixelSize/2;
-			corner_coordinates[0][1] = global->pix_y[i]*global->pixelSize + global->pixelSize/2;
-			// upper right corner
-			corner_coordinates[1][0] = global->pix_x[i]*global->pixelSize - global->pixelSize/2;
-			corner_coordinates[1][1] = global->pix_y[i]*global->pixelSize + global->pixelSize/2;
-			// lower right corner
-			corner_coordinates[2][0] = global->pix_x[i]*global->pixelSize - global->pixelSize/2;
-			corner_coordinates[2][1] = global->pix_y[i]*global->pixelSize - global->pixelSize/2;
-			// lower left corner
-			corner_coordinates[3][0] = global->pix_x[i]*global->pixelSize + global->pixelSize/2;
-			corner_coordinates[3][1] = global->pix_y[i]*global->pixelSize - global->pixelSize/2;
-			// assign Z coordinate as detector distance and calculate length of the vectors to the pixel coordinates
-			for (int j = 0; j < 4; j++) {
-				corner_coordinates[j][2] = threadInfo->detectorPosition/1000;
-				corner_distances[j] = sqrt(corner_coordinates[j][0]*corner_coordinates[j][0] + corner_coordinates[j][1]*corner_coordinates[j][1] + corner_coordinates[j][2]*corner_coordinates[j][2]);
-			}
-			
-			// first triangle made up of upper left, upper right, and lower right corner
-			// nominator in expression for solid angle of a plane triangle - magnitude of triple product of first 3 corners
-			determinant = fabs( corner_coordinates[0][0]*(corner_coordinates[1][1]*corner_coordinates[2][2] - corner_coordinates[1][2]*corner_coordinates[2][1])
-							   - corner_coordinates[0][1]*(corner_coordinates[1][0]*corner_coordinates[2][2] - corner_coordinates[1][2]*corner_coordinates[2][0])
-							   + corner_coordinates[0][2]*(corner_coordinates[1][0]*corner_coordinates[2][1] - corner_coordinates[1][1]*corner_coordinates[2][0]) );
-			denominator = corner_distances[0]*corner_distances[1]*corner_distances[2] + corner_distances[2]*(corner_coordinates[0][0]*corner_coordinates[1][0] + corner_coordinates[0][1]*corner_coordinates[1][1] + corner_coordinates[0][2]*corner_coordinates[1][2])
-			+ corner_distances[1]*(corner_coordinates[0][0]*corner_coordinates[2][0] + corner_coordinates[0][1]*corner_coordinates[2][1] + corner_coordinates[0][2]*corner_coordinates[2][2])
-			+ corner_distances[0]*(corner_coordinates[1][0]*corner_coordinates[2][0] + corner_coordinates[1][1]*corner_coordinates[2][1] + corner_coordinates[1][2]*corner_coordinates[2][2]);
-			solid_angle[0] = atan2(determinant, denominator);
-			if (solid_angle[0] < 0)
-				solid_angle[0] += M_PI; // If det > 0 and denom < 0 arctan2 returns < 0, so add PI
-			
-			// second triangle made up of lower right, lower left, and upper left corner
-			// nominator in expression for solid angle of a plane triangle - magnitude of triple product of last 3 corners
-			determinant = fabs( corner_coordinates[0][0]*(corner_coordinates[3][1]*corner_coordinates[2][2] - corner_coordinates[3][2]*corner_coordinates[2][1])
-							   - corner_coordinates[0][1]*(corner_coordinates[3][0]*corner_coordinates[2][2] - corner_coordinates[3][2]*corner_coordinates[2][0])
-							   + corner_coordinates[0][2]*(corner_coordinates[3][0]*corner_coordinates[2][1] - corner_coordinates[3][1]*corner_coordinates[2][0]) );
-			denominator = corner_distances[2]*corner_distances[3]*corner_distances[0] + corner_distances[2]*(corner_coordinates[0][0]*corner_coordinates[3][0] + corner_coordinates[0][1]*corner_coordinates[3][1] + corner_coordinates[0][2]*corner_coordinates[3][2])
-			+ corner_distances[3]*(corner_coordinates[0][0]*corner_coordinates[2][0] + corner_coordinates[0][1]*corner_coordinates[2][1] + corner_coordinates[0][2]*corner_coordinates[2][2])
-			+ corner_distances[0]*(corner_coordinates[3][0]*corner_coordinates[2][0] + corner_coordinates[3][1]*corner_coordinates[2][1] + corner_coordinates[3][2]*corner_coordinates[2][2]);
-			solid_angle[1] = atan2(determinant, denominator);
-			if (solid_angle[1] < 0)
-				solid_angle[1] += M_PI; // If det > 0 and denom < 0 arctan2 returns < 0, so add PI
-			
-			total_solid_angle = 2*(solid_angle[0] + solid_angle[1]);
-			
-			threadInfo->corrected_data[i] /= total_solid_angle/threadInfo->solidAngle; // remove constant term to only get theta/phi dependent part of solid angle correction for 2D pattern
-		}
-	}
+static void addToThresholdedSum(double *&sum, float *data, long n, float threshold) {
+	if (sum == NULL)
+		sum = (double*) calloc(n, sizeof(double));
+	for(long i=0; i<n; i++)
+		if(data[i] > threshold)
+			sum[i] += data[i];
 }
 
+void addToPowder(tThreadInfo *threadInfo, cGlobal *global, cHit *hit){
 
-/*
- *	Apply attenuation correction
- */
-void applyAttenuationCorrection(tThreadInfo *threadInfo, cGlobal *global){
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	float		*data = threadInfo->corrected_data;
 	
-	for(long i=0; i<global->pix_nn; i++) 
-		threadInfo->corrected_data[i] *= threadInfo->attenuation;
+	pthread_mutex_lock(&workerData->powder_mutex);
 	
-}
-
-
-/*
- *	Maintain running powder patterns
- */
-void addToPowder(tThreadInfo *threadInfo, cGlobal *global, cHit *hit){
-
     if (global->generateDarkcal){
 		// Sum raw format data
-		pthread_mutex_lock(&global->powdersumraw_mutex);
-		global->npowder += 1;
-		for(long i=0; i<global->pix_nn; i++)
-			global->powderRaw[i] += threadInfo->corrected_data[i];
-		pthread_mutex_unlock(&global->powdersumraw_mutex);
+		workerData->npowder += 1;
+		addToSum(workerData->powderRaw, data, global->pix_nn);
         
 		// Sum variance data
-		pthread_mutex_lock(&global->powdersumvariance_mutex);
+		if (workerData->powderVariance == NULL)
+			workerData->powderVariance = (double*) calloc(global->pix_nn, sizeof(double));
 		for(long i=0; i<global->pix_nn; i++)
-			global->powderVariance[i] += ((double) threadInfo->corrected_data[i]*threadInfo->corrected_data[i]);
-		pthread_mutex_unlock(&global->powdersumvariance_mutex);
+			workerData->powderVariance[i] += ((double) data[i]*data[i]);
 	}
 	
     //standard hit
 	if (hit->standard || global->listfinder.use){
 		if (global->powdersum) {
 			// Sum raw format data
-			pthread_mutex_lock(&global->powdersumraw_mutex);
-			for(long i=0; i<global->pix_nn; i++)
-				global->powderRaw[i] += threadInfo->corrected_data[i];
-			pthread_mutex_unlock(&global->powdersumraw_mutex);
+			addToSum(workerData->powderRaw, data, global->pix_nn);
 			
 			// Sum assembled data		
-			pthread_mutex_lock(&global->powdersumassembled_mutex);
-			global->npowder += 1;
-			for(long i=0; i<global->image_nn; i++)
-				if(threadInfo->image[i] > global->powderthresh)
-					global->powderAssembled[i] += threadInfo->image[i];
-			pthread_mutex_unlock(&global->powdersumassembled_mutex);
+			workerData->npowder += 1;
+			addToThresholdedSum(workerData->powderAssembled, threadInfo->image, global->image_nn, global->powderthresh);
 		}		
 	}
 	
@@ -790,18 +591,11 @@ void addToPowder(tThreadInfo *threadInfo, cGlobal *global, cHit *hit){
 	if (hit->ice){
 		if (global->powdersum) {
 			// Sum raw format data 	: ice
-			pthread_mutex_lock(&global->icesumraw_mutex);
-			for(long i=0; i<global->pix_nn; i++)
-				global->iceRaw[i] += threadInfo->corrected_data[i];
-			pthread_mutex_unlock(&global->icesumraw_mutex);
+			addToSum(workerData->iceRaw, data, global->pix_nn);
 			
 			// Sum assembled data	: ice
-			pthread_mutex_lock(&global->icesumassembled_mutex);
-			global->nice += 1;
-			for(long i=0; i<global->image_nn; i++)
-				if(threadInfo->image[i] > global->powderthresh)
-					global->iceAssembled[i] += threadInfo->image[i];
-			pthread_mutex_unlock(&global->icesumassembled_mutex);			
+			workerData->nice += 1;
+			addToThresholdedSum(workerData->iceAssembled, threadInfo->image, global->image_nn, global->powderthresh);
 		}
 	}
 	
@@ -809,230 +603,148 @@ void addToPowder(tThreadInfo *threadInfo, cGlobal *global, cHit *hit){
 	if (hit->water){
 		if (global->powdersum) {
 			// Sum raw format data  : water
-			pthread_mutex_lock(&global->watersumraw_mutex);
-			for(long i=0; i<global->pix_nn; i++)
-				global->waterRaw[i] += threadInfo->corrected_data[i];
-			pthread_mutex_unlock(&global->watersumraw_mutex);
+			addToSum(workerData->waterRaw, data, global->pix_nn);
 			
 			// Sum assembled data	: water
-			pthread_mutex_lock(&global->watersumassembled_mutex);
-			global->nwater += 1;
-			for(long i=0; i<global->image_nn; i++)
-				if(threadInfo->image[i] > global->powderthresh)
-					global->waterAssembled[i] += threadInfo->image[i];
-			pthread_mutex_unlock(&global->watersumassembled_mutex);
+			workerData->nwater += 1;
+			addToThresholdedSum(workerData->waterAssembled, threadInfo->image, global->image_nn, global->powderthresh);
 		}
 	}
+	
+	pthread_mutex_unlock(&workerData->powder_mutex);
 }
 
 
 /*
- *	Maintain running correlation sum
+ *	Add one worker's powder sum to the global one and clear it
  */
-void addToCorrelation(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+static void mergeSum(double *global, double *worker, long n, pthread_mutex_t *mutex) {
+	if (worker == NULL || global == NULL)
+		return;
+	pthread_mutex_lock(mutex);
+	for(long i=0; i<n; i++)
+		global[i] += worker[i];
+	pthread_mutex_unlock(mutex);
+	memset(worker, 0, n*sizeof(double));
+}
 
-	if (global->useCorrelation && global->sumCorrelation && threadInfo->correlation) {
+
+/*
+ *	Collect the powder sums of all worker threads into the global powder patterns
+ *	Must be called before anything reads powderRaw, powderAssembled etc. (saveRunningSums and endjob)
+ */
+void mergePowders(cGlobal *global) {
+	
+	if (global->workerData == NULL)
+		return;
+	
+	for(long n=0; n<global->nThreads; n++) {
+		tWorkerData	*workerData = &global->workerData[n];
 		
-		if (hit->standard || global->listfinder.use) {
-			// Sum correlation data
-			pthread_mutex_lock(&global->powdersumcorrelation_mutex);
-			if (!global->powdersum) global->npowder += 1;
-			for(long i=0; i<global->correlation_nn; i++)
-				global->powderCorrelation[i] += threadInfo->correlation[i];
-			pthread_mutex_unlock(&global->powdersumcorrelation_mutex);
-		}
+		pthread_mutex_lock(&workerData->powder_mutex);
 		
-		if (hit->ice) {
-			// Sum correlation data 	: ice
-			pthread_mutex_lock(&global->icesumcorrelation_mutex);
-			if (!global->powdersum) global->nice += 1;
-			for(long i=0; i<global->correlation_nn; i++)
-				global->iceCorrelation[i] += threadInfo->correlation[i];
-			pthread_mutex_unlock(&global->icesumcorrelation_mutex);
-		}
+		mergeSum(global->powderRaw, workerData->powderRaw, global->pix_nn, &global->powdersumraw_mutex);
+		mergeSum(global->powderVariance, workerData->powderVariance, global->pix_nn, &global->powdersumvariance_mutex);
+		mergeSum(global->powderAssembled, workerData->powderAssembled, global->image_nn, &global->powdersumassembled_mutex);
+		mergeSum(global->iceRaw, workerData->iceRaw, global->pix_nn, &global->icesumraw_mutex);
+		mergeSum(global->iceAssembled, workerData->iceAssembled, global->image_nn, &global->icesumassembled_mutex);
+		mergeSum(global->waterRaw, workerData->waterRaw, global->pix_nn, &global->watersumraw_mutex);
+		mergeSum(global->waterAssembled, workerData->waterAssembled, global->image_nn, &global->watersumassembled_mutex);
+		mergeCorrelationSum(global->powderCorrelation, workerData->powderCorrelation, global->correlation_nn);
+		mergeCorrelationSum(global->iceCorrelation, workerData->iceCorrelation, global->correlation_nn);
+		mergeCorrelationSum(global->waterCorrelation, workerData->waterCorrelation, global->correlation_nn);
 		
-		if (hit->water) {
-			// Sum correlation data  : water
-			pthread_mutex_lock(&global->watersumcorrelation_mutex);
-			if (!global->powdersum) global->nwater += 1;
-			for(long i=0; i<global->correlation_nn; i++)
-				global->waterCorrelation[i] += threadInfo->correlation[i];
-			pthread_mutex_unlock(&global->watersumcorrelation_mutex);
-		}
+		pthread_mutex_lock(&global->powdersumassembled_mutex);
+		global->npowder += workerData->npowder;
+		global->nice += workerData->nice;
+		global->nwater += workerData->nwater;
+		pthread_mutex_unlock(&global->powdersumassembled_mutex);
+		workerData->npowder = 0;
+		workerData->nice = 0;
+		workerData->nwater = 0;
+		
+		pthread_mutex_unlock(&workerData->powder_mutex);
 	}
 }
 
 
 /*
- *	Interpolate raw (corrected) cspad data into a physical 2D image
- *	using pre-defined pixel mapping (as loaded from .h5 file)
- *  This function is used for powder averages
+ *	Maintain running correlation sum
+ *	Like the powder sums, each worker adds to its own running mean and variance (see xcca.cpp),
+ *	they are merged by mergePowders()
  */
-void assemble2Dimage(double corrected_data[], double *&image, cGlobal *global){
-	
-	// Allocate temporary arrays for pixel interpolation (needs to be floating point)
-	double	*data = (double*) calloc(global->image_nn,sizeof(double));
-	double	*weight = (double*) calloc(global->image_nn,sizeof(double));	
+void addToCorrelation(tThreadInfo *threadInfo, cGlobal *global, cHit *hit) {
+
+	if (global->useCorrelation && global->sumCorrelation && threadInfo->correlated)
+		addToCorrelationSums(global, threadInfo->workerNum, hit, threadInfo->correlation);
+}
+
+void addToCorrelationSums(cGlobal *global, long workerNum, cHit *hit, double *correlation) {
 	
-	// Loop through all pixels and interpolate onto regular grid
-	float	x, y;
-	double	pixel_value, w;
-	long	ix, iy;
-	float	fx, fy;
-	long	image_index;
+	tWorkerData	*workerData = &global->workerData[workerNum];
 	
-	for(long i=0;i<global->pix_nn;i++){
-		// Pixel location with (0,0) at array element (0,0) in bottom left corner
-		x = global->pix_x[i] + global->image_nx/2;
-		y = global->pix_y[i] + global->image_nx/2;
-		pixel_value = corrected_data[i];
-		
-		// Split coordinate into integer and fractional parts
-		ix = (long) floor(x);
-		iy = (long) floor(y);
-		fx = x - ix;
-		fy = y - iy;
-		
-		// Interpolate intensity over adjacent 4 pixels using fractional overlap as the weighting factor
-		// (0,0)
-		if(ix>=0 && iy>=0 && ix<global->image_nx && iy<global->image_nx) {
-			w = (double) (1-fx)*(1-fy);
-			image_index = ix + global->image_nx*iy;
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (+1,0)
-		if((ix+1)>=0 && iy>=0 && (ix+1)<global->image_nx && iy<global->image_nx) {
-			w = (double) (fx)*(1-fy);
-			image_index = (ix+1) + global->image_nx*iy;
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (0,+1)
-		if(ix>=0 && (iy+1)>=0 && ix<global->image_nx && (iy+1)<global->image_nx) {
-			w = (double) (1-fx)*(fy);
-			image_index = ix + global->image_nx*(iy+1);
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (+1,+1)
-		if((ix+1)>=0 && (iy+1)>=0 && (ix+1)<global->image_nx && (iy+1)<global->image_nx) {
-			w = (double) (fx)*(fy);
-			image_index = (ix+1) + global->image_nx*(iy+1);
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-	}
+	pthread_mutex_lock(&workerData->powder_mutex);
 	
+	// Sum correlation data
+	if (hit->standard || global->listfinder.use)
+		addToCorrelationSum(workerData->powderCorrelation, correlation, global->correlation_nn);
 	
-	// Reweight pixel interpolation
-	for(long i=0; i<global->image_nn; i++){
-		if(weight[i] < 0.05)
-			data[i] = 0;
-		else
-			data[i] /= weight[i];
-	}
+	// Sum correlation data 	: ice
+	if (hit->ice)
+		addToCorrelationSum(workerData->iceCorrelation, correlation, global->correlation_nn);
 	
+	// Sum correlation data  : water
+	if (hit->water)
+		addToCorrelationSum(workerData->waterCorrelation, correlation, global->correlation_nn);
 	
-	// Allocate memory for output image
-	if (image)
-		free(image);
-	image = (double*) calloc(global->image_nn, sizeof(double));
-	
-	// Copy interpolated image across into image array
-	for(long i=0;i<global->image_nn;i++){
-		image[i] = data[i];
-	}
-	
-	// Free temporary arrays
-	free(data);
-	free(weight);
-	
+	pthread_mutex_unlock(&workerData->powder_mutex);
 }
 
 
 /*
  *	Interpolate raw (corrected) cspad data into a physical 2D image
- *	using pre-defined pixel mapping (as loaded from .h5 file)
- *  This function is used for individual shots
+ *	using the assembly map compiled by cGlobal::createAssemblyMap()
+ *	Every image pixel is a weighted sum over its own entries, so rows can be done independently
  */
-void assemble2Dimage(tThreadInfo *threadInfo, cGlobal *global){
+template <typename T>
+static inline void applyAssemblyMap(const T *data, T *image, cGlobal *global, long start, long end){
 	
-	// Allocate temporary arrays for pixel interpolation (needs to be floating point)
-	float	*data = (float*) calloc(global->image_nn,sizeof(float));
-	float	*weight = (float*) calloc(global->image_nn,sizeof(float));	
+	const long	*first = global->assemblyStart;
+	const int	*source = global->assemblySource;
+	const float	*weight = global->assemblyWeight;
 	
-	// Loop through all pixels and interpolate onto regular grid
-	float	x, y;
-	float	pixel_value, w;
-	long	ix, iy;
-	float	fx, fy;
-	long	image_index;
-	
-	for(long i=0;i<global->pix_nn;i++){
-		// Pixel location with (0,0) at array element (0,0) in bottom left corner
-		x = global->pix_x[i] + global->image_nx/2;
-		y = global->pix_y[i] + global->image_nx/2;
-		pixel_value = threadInfo->corrected_data[i];
-		
-		// Split coordinate into integer and fractional parts
-		ix = (long) floor(x);
-		iy = (long) floor(y);
-		fx = x - ix;
-		fy = y - iy;
-		
-		// Interpolate intensity over adjacent 4 pixels using fractional overlap as the weighting factor
-		// (0,0)
-		if(ix>=0 && iy>=0 && ix<global->image_nx && iy<global->image_nx) {
-			w = (1-fx)*(1-fy);
-			image_index = ix + global->image_nx*iy;
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (+1,0)
-		if((ix+1)>=0 && iy>=0 && (ix+1)<global->image_nx && iy<global->image_nx) {
-			w = (fx)*(1-fy);
-			image_index = (ix+1) + global->image_nx*iy;
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (0,+1)
-		if(ix>=0 && (iy+1)>=0 && ix<global->image_nx && (iy+1)<global->image_nx) {
-			w = (1-fx)*(fy);
-			image_index = ix + global->image_nx*(iy+1);
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-		// (+1,+1)
-		if((ix+1)>=0 && (iy+1)>=0 && (ix+1)<global->image_nx && (iy+1)<global->image_nx) {
-			w = (fx)*(fy);
-			image_index = (ix+1) + global->image_nx*(iy+1);
-			data[image_index] += w*pixel_value;
-			weight[image_index] += w;
-		}
-	}
-	
-	
-	// Reweight pixel interpolation
-	for(long i=0; i<global->image_nn; i++){
-		if(weight[i] < 0.05)
-			data[i] = 0;
-		else
-			data[i] /= weight[i];
+	for(long i=start; i<end; i++){
+		T	sum = 0;
+		for(long j=first[i]; j<first[i+1]; j++)
+			sum += weight[j]*data[source[j]];
+		image[i] = sum;
 	}
+}
+
+
+/*
+ *  This function is used for powder averages
+ */
+void assemble2Dimage(double corrected_data[], double *&image, cGlobal *global){
 	
+	// Output image size may have changed since the last call
+	if (image)
+		free(image);
+	image = (double*) calloc(global->image_nn, sizeof(double));
 	
-	// Allocate memory for output image
-	threadInfo->image = (float*) calloc(global->image_nn,sizeof(float));
+	#pragma omp parallel for schedule(static)
+	for(long row=0; row<global->image_nx; row++)
+		applyAssemblyMap<double>(corrected_data, image, global, row*global->image_nx, (row+1)*global->image_nx);
 	
-	// Copy interpolated image across into image array
-	for(long i=0;i<global->image_nn;i++){
-		threadInfo->image[i] = data[i];
-	}
+}
+
+
+/*
+ *  This function is used for individual shots (frames are already spread over the worker threads)
+ */
+void assemble2Dimage(tThreadInfo *threadInfo, cGlobal *global){
 	
-	// Free temporary arrays
-	free(data);
-	free(weight);
+	applyAssemblyMap<float>(threadInfo->corrected_data, threadInfo->image, global, 0, global->image_nn);
 	
 }
 
@@ -1071,7 +783,7 @@ bool containsEvent(string event, cGlobal *global) {
 /*
  *	Write out processed data to our 'standard' HDF5 format
  */
-void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
+static void writeEventHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 	/*
 	 *	Create filename based on date, time and fiducial for this image
 	 */
@@ -1101,7 +813,9 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 	hid_t		datatype;
 	hsize_t 	size[2],max_size[2];
 	herr_t		hdf_error;
-	hid_t   	gid;
+	hid_t   	gid, plist;
+	double		imageBytes, storedBytes;
+	double		tstart = hdf5Clock();
 //	char 		fieldname[100]; 
 	
 	
@@ -1130,11 +844,12 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 	max_size[0] = global->image_nx;
 	max_size[1] = global->image_nx;
 	int16_t *buffer1 = (int16_t*) calloc(global->image_nn, sizeof(int16_t));
-	for(long i=0; i<global->image_nn; i++){
-		buffer1[i] = (int16_t) info->image[i];
-	}
+	convertImage(info->image, buffer1, global->image_nn, global);
 	dataspace_id = H5Screate_simple(2, size, max_size);
-	dataset_id = H5Dcreate(gid, "data", H5T_STD_I16LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+	plist = imageCreatePlist(global, 2, size);
+	dataset_id = H5Dcreate(gid, "data", H5T_STD_I16LE, dataspace_id, H5P_DEFAULT, plist, H5P_DEFAULT);
+	if (plist != H5P_DEFAULT)
+		H5Pclose(plist);
 	if ( dataset_id < 0 ) {
 		ERROR("%i: Couldn't create dataset\n", (int)info->threadNum);
 		H5Fclose(hdf_fileID);
@@ -1147,6 +862,8 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 		H5Fclose(hdf_fileID);
 		return;
 	}
+	imageBytes = global->image_nn*sizeof(int16_t);
+	storedBytes = H5Dget_storage_size(dataset_id);
 	H5Dclose(dataset_id);
 	H5Sclose(dataspace_id);
 	free(buffer1);	
@@ -1158,11 +875,12 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 		max_size[0] = 8*COLS;
 		max_size[1] = 8*ROWS;
 		int16_t *buffer2 = (int16_t*) calloc(RAW_DATA_LENGTH, sizeof(int16_t));
-		for(long i=0; i<RAW_DATA_LENGTH; i++){
-			buffer2[i] = (int16_t) info->corrected_data[i];
-		}
+		convertImage(info->corrected_data, buffer2, RAW_DATA_LENGTH, global);
 		dataspace_id = H5Screate_simple(2, size, max_size);
-		dataset_id = H5Dcreate(gid, "rawdata", H5T_STD_I16LE, dataspace_id, H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+		plist = imageCreatePlist(global, 2, size);
+		dataset_id = H5Dcreate(gid, "rawdata", H5T_STD_I16LE, dataspace_id, H5P_DEFAULT, plist, H5P_DEFAULT);
+		if (plist != H5P_DEFAULT)
+			H5Pclose(plist);
 		if ( dataset_id < 0 ) {
 			ERROR("%i: Couldn't create dataset\n", (int)info->threadNum);
 			H5Fclose(hdf_fileID);
@@ -1175,10 +893,13 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 			H5Fclose(hdf_fileID);
 			return;
 		}
+		imageBytes += RAW_DATA_LENGTH*sizeof(int16_t);
+		storedBytes += H5Dget_storage_size(dataset_id);
 		H5Dclose(dataset_id);
 		H5Sclose(dataspace_id);
 		free(buffer2);
 	}
+	addHDF5Statistics(global, imageBytes, storedBytes, hdf5Clock() - tstart);
 
 	
 	// Done with this group
@@ -1350,6 +1071,19 @@ void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
 	H5Fclose(hdf_fileID); 
 }
 
+void writeHDF5(tThreadInfo *info, cGlobal *global, char *eventname){
+	
+	// Append to the run file instead? (peak lists only go there)
+	if (global->hdf5Aggregate || global->savePeaks) {
+		appendHDF5(info, global, eventname);
+		return;
+	}
+	
+	lockHDF5();
+	writeEventHDF5(info, global, eventname);
+	unlockHDF5();
+}
+
 
 
 
@@ -1365,6 +1099,7 @@ void writeSimpleHDF5(const char *filename, const void *data, int width, int heig
 	hsize_t size[2];
 	hsize_t max_size[2];
 	
+	lockHDF5();
 	fh = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 	if ( fh < 0 ) {
 		ERROR("Couldn't create file: %s\n", filename);
@@ -1403,6 +1138,7 @@ void writeSimpleHDF5(const char *filename, const void *data, int width, int heig
 	H5Gclose(gh);
 	H5Dclose(dh);
 	H5Fclose(fh);
+	unlockHDF5();
 }
 
 void writeSimpleHDF5(const char *filename, const void *data, int width, int height, int depth, int type) 
@@ -1412,6 +1148,7 @@ void writeSimpleHDF5(const char *filename, const void *data, int width, int heig
 	hsize_t size[3];
 	hsize_t max_size[3];
 	
+	lockHDF5();
 	fh = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
 	if ( fh < 0 ) {
 		ERROR("Couldn't create file: %s\n", filename);
@@ -1452,15 +1189,21 @@ void writeSimpleHDF5(const char *filename, const void *data, int width, int heig
 	H5Gclose(gh);
 	H5Dclose(dh);
 	H5Fclose(fh);
+	unlockHDF5();
 }
 
 
-void flushHDF5() {
+void flushHDF5(cGlobal *global) {
 	herr_t fail;
 	
 	// Flush all HDF5 data to disk, close all open identifies, and clean up memory
 	cout << "Flushing HDF5 data and memory..." << endl;
+	closeHDF5RunFile(global);
+	printHDF5Statistics(global);
+	lockHDF5();
+	closeFrameTable(global);		// reopened by the logger thread with the next records
 	fail = H5close();
+	unlockHDF5();
 	if (fail < 0) cout << "\tError flushing HDF5 data and memory" << endl;
 	else cout << "\tFlushing finished successfully!" << endl;
 }
@@ -1468,6 +1211,10 @@ void flushHDF5() {
 
 void saveRunningSums(cGlobal *global) {
 	char	filename[1024];
+	
+	// Collect what the worker threads have summed since last time
+	flushCorrelationBatches(global);
+	mergePowders(global);
 
 	if(global->generateDarkcal) {
 		/*
@@ -1517,7 +1264,9 @@ void saveRunningSums(cGlobal *global) {
 			printf("Saving assembled darkcal image to file\n");
 			sprintf(filename,"r%04u-AssembledSum.h5",global->runNumber);
 			ns_cspad_util::createAssembledImageCSPAD( oneDark, oneX, oneY, two );		
+			lockHDF5();
 			io->writeToFile( filename, two );
+			unlockHDF5();
 			
 			/*
 			 *	Save assembled variance of darkcal
@@ -1525,7 +1274,9 @@ void saveRunningSums(cGlobal *global) {
 			printf("Saving assembled variance image to file\n");
 			sprintf(filename,"r%04u-AssembledVariance.h5",global->runNumber);
 			ns_cspad_util::createAssembledImageCSPAD( oneDarkVariance, oneX, oneY, two );
+			lockHDF5();
 			io->writeToFile( filename, two );
+			unlockHDF5();
 			
 			delete oneX;
 			delete oneY;
@@ -1580,18 +1331,10 @@ void saveRunningSums(cGlobal *global) {
 			if (global->useCorrelation && global->sumCorrelation) {
 				
 				/*
-				 *	Save correlation sum
+				 *	Save correlation sum (mean and standard error)
 				 */
 				printf("Saving correlation sum data to file\n");
-				sprintf(filename,"r%04u-CorrelationSum.h5",global->runNumber);
-				double *buffer8 = (double*) calloc(global->correlation_nn, sizeof(double));
-				pthread_mutex_lock(&global->powdersumcorrelation_mutex);
-				for(long i=0; i<global->correlation_nn; i++)
-					buffer8[i] = global->powderCorrelation[i]/global->npowder;
-				pthread_mutex_unlock(&global->powdersumcorrelation_mutex);
-				if (global->autoCorrelateOnly) writeSimpleHDF5(filename, buffer8, global->correlationNumDelta, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				else writeSimpleHDF5(filename, buffer8, global->correlationNumDelta, global->correlationNumQ, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				free(buffer8);
+				saveCorrelationSum(global, global->powderCorrelation, "");
 				
 			}
 		}
@@ -1641,15 +1384,7 @@ void saveRunningSums(cGlobal *global) {
 				 *	Save correlation sum : ice
 				 */
 				printf("Saving correlation sum data of ice to file\n");
-				sprintf(filename,"r%04u-CorrelationSum_ice.h5",global->runNumber);
-				double *buffer9 = (double*) calloc(global->correlation_nn, sizeof(double));
-				pthread_mutex_lock(&global->icesumcorrelation_mutex);
-				for(long i=0; i<global->correlation_nn; i++)
-					buffer9[i] = global->iceCorrelation[i]/global->nice;
-				pthread_mutex_unlock(&global->icesumcorrelation_mutex);
-				if (global->autoCorrelateOnly) writeSimpleHDF5(filename, buffer9, global->correlationNumDelta, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				else writeSimpleHDF5(filename, buffer9, global->correlationNumDelta, global->correlationNumQ, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				free(buffer9);
+				saveCorrelationSum(global, global->iceCorrelation, "_ice");
 				
 			}
 		}		
@@ -1698,20 +1433,17 @@ void saveRunningSums(cGlobal *global) {
 				 *	Save correlation sum : water
 				 */
 				printf("Saving correlation sum data of water to file\n");
-				sprintf(filename,"r%04u-CorrelationSum_water.h5",global->runNumber);
-				double *buffer10 = (double*) calloc(global->correlation_nn, sizeof(double));
-				pthread_mutex_lock(&global->watersumcorrelation_mutex);
-				for(long i=0; i<global->correlation_nn; i++)
-					buffer10[i] = global->waterCorrelation[i]/global->nwater;
-				pthread_mutex_unlock(&global->watersumcorrelation_mutex);
-				if (global->autoCorrelateOnly) writeSimpleHDF5(filename, buffer10, global->correlationNumDelta, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				else writeSimpleHDF5(filename, buffer10, global->correlationNumDelta, global->correlationNumQ, global->correlationNumQ, H5T_NATIVE_DOUBLE);
-				free(buffer10);
+				saveCorrelationSum(global, global->waterCorrelation, "_water");
 				
 			}
 		}
 		
 		
+		/*
+		 *	How far the correlation sums have converged
+		 */
+		if (global->useCorrelation && global->sumCorrelation)
+			reportCorrelationConvergence(global);
 	}
 
 	
@@ -1937,12 +1669,10 @@ void calculateQuadAngularAvg(cGlobal *global, int quad) {
 
 void calculateAngularAvg(tThreadInfo *threadInfo, cGlobal *global) {
 	
-	// allocate local & threadInfo arrays
-	unsigned *counter = (unsigned*) calloc(global->angularAvg_nn, sizeof(unsigned));
-	if (threadInfo->angularAvg) {
-		free(threadInfo->angularAvg);
-	}
-	threadInfo->angularAvg = (double*) calloc(global->angularAvg_nn, sizeof(double));
+	// reset arrays (preallocated in the frame buffer pool)
+	unsigned *counter = threadInfo->angularAvgCounter;
+	memset(counter, 0, global->angularAvg_nn*sizeof(unsigned));
+	memset(threadInfo->angularAvg, 0, global->angularAvg_nn*sizeof(double));
 	
 	// angular average for each |q|
 	for (int i=0; i<global->pix_nn; i++) {
@@ -1962,9 +1692,6 @@ void calculateAngularAvg(tThreadInfo *threadInfo, cGlobal *global) {
 		}
 	}
 	
-	// free memory of local variables
-	free(counter);
-	
 }
 
 
@@ -2008,12 +1735,19 @@ void saveIntensities(cGlobal *global) {
 	if (global->useIntensityStatistics) {
 		
 		char	filename[1024];
-		double *buffer = (double*) calloc(global->nIntensities, sizeof(double));
+		long	n = gatherStatistic(global, STAT_INTENSITY, STAT_INTENSITY, NULL);
+		double *buffer = (double*) calloc(STAT_NCOLUMNS*n+1, sizeof(double));
 		printf("Saving average intensities to file\n");
 		sprintf(filename,"r%04u-intensities.h5",global->runNumber);
-		for(long i=0; i<global->nIntensities; i++)
-			buffer[i] = global->intensities[i];
-		writeSimpleHDF5(filename, buffer, global->nIntensities, 1, H5T_NATIVE_DOUBLE);
+		gatherStatistic(global, STAT_INTENSITY, STAT_INTENSITY, buffer);
+		writeSimpleHDF5(filename, buffer, n, 1, H5T_NATIVE_DOUBLE);
+		
+		// All per-event values of the same frames, one row per column of statistics.h (NaN where not known)
+		printf("Saving per-event statistics to file\n");
+		sprintf(filename,"r%04u-statistics.h5",global->runNumber);
+		for(int c=0; c<STAT_NCOLUMNS; c++)
+			gatherStatistic(global, c, STAT_INTENSITY, buffer+c*n);
+		writeSimpleHDF5(filename, buffer, n, STAT_NCOLUMNS, H5T_NATIVE_DOUBLE);
 		free(buffer);
 		
 	}
@@ -2023,6 +1757,16 @@ void saveIntensities(cGlobal *global) {
 
 void makeIntensityHistograms(cGlobal *global) {
 	
+	long	nIntensities = gatherStatistic(global, STAT_INTENSITY, STAT_INTENSITY, NULL);
+	double	*intensities = (double*) calloc(nIntensities+1, sizeof(double));
+	double	*hits = (double*) calloc(nIntensities+1, sizeof(double));
+	gatherStatistic(global, STAT_INTENSITY, STAT_INTENSITY, intensities);
+	gatherStatistic(global, STAT_HIT, STAT_INTENSITY, hits);
+	for (long i=0; i<nIntensities; i++) {
+		if (intensities[i] > global->Imax) global->Imax = intensities[i];
+		if (intensities[i] < global->Imin) global->Imin = intensities[i];
+	}
+	
 	double deltaI = 0.1; // 0.1 ADU steps
 	unsigned Ibins = (unsigned) ceil((global->Imax-global->Imin)/deltaI)+1;
 	unsigned nHits = 0;
@@ -2030,11 +1774,11 @@ void makeIntensityHistograms(cGlobal *global) {
 	if (Ibins > 1) {
 		global->Ihist = (unsigned*) calloc(Ibins, sizeof(unsigned));
 		global->IHhist = (unsigned*) calloc(Ibins, sizeof(unsigned));
-		for (long i=0; i<global->nIntensities; i++) {
-			global->Ihist[int(round((global->intensities[i]-global->Imin)/deltaI))]++;
-			if (global->hits[i]) {
-				global->IHhist[int(round((global->intensities[i]-global->Imin)/deltaI))]++;
-				global->Imean += global->intensities[i];
+		for (long i=0; i<nIntensities; i++) {
+			global->Ihist[int(round((intensities[i]-global->Imin)/deltaI))]++;
+			if (hits[i]) {
+				global->IHhist[int(round((intensities[i]-global->Imin)/deltaI))]++;
+				global->Imean += intensities[i];
 				nHits++;
 			}
 		}
@@ -2060,6 +1804,8 @@ void makeIntensityHistograms(cGlobal *global) {
 		// disable intensity if not enough bins
 		global->useIntensityStatistics = 0;
 	}
+	free(intensities);
+	free(hits);
 	
 }
 
@@ -2090,15 +1836,18 @@ void saveEnergies(cGlobal *global) {
 	if (global->useEnergyCalibration) {
 		
 		char	filename[1024];
-		float *buffer = (float*) calloc(2*global->nEnergies, sizeof(float));
+		long	nEnergies = gatherStatistic(global, STAT_PHOTONENERGY, STAT_PHOTONENERGY, NULL);
+		double *values = (double*) calloc(2*nEnergies+1, sizeof(double));
+		float *buffer = (float*) calloc(2*nEnergies+1, sizeof(float));
 		printf("Saving energies and wavelengths to file\n");
 		sprintf(filename,"r%04u-energies.h5",global->runNumber);
-		for(long i=0; i<global->nEnergies; i++)
-			buffer[i] = (float) global->energies[i];
-		for(long i=0; i<global->nEnergies; i++)
-			buffer[global->nEnergies+i] = (float) global->wavelengths[i];
-		writeSimpleHDF5(filename, buffer, global->nEnergies, 2, H5T_NATIVE_FLOAT);
+		gatherStatistic(global, STAT_PHOTONENERGY, STAT_PHOTONENERGY, values);
+		gatherStatistic(global, STAT_WAVELENGTH, STAT_PHOTONENERGY, values+nEnergies);
+		for(long i=0; i<2*nEnergies; i++)
+			buffer[i] = (float) values[i];
+		writeSimpleHDF5(filename, buffer, nEnergies, 2, H5T_NATIVE_FLOAT);
 		free(buffer);
+		free(values);
 		
 	}
 	
@@ -2107,6 +1856,18 @@ void saveEnergies(cGlobal *global) {
 
 void makeEnergyHistograms(cGlobal *global) {
 
+	long	nEnergies = gatherStatistic(global, STAT_PHOTONENERGY, STAT_PHOTONENERGY, NULL);
+	double	*energies = (double*) calloc(nEnergies+1, sizeof(double));
+	double	*wavelengths = (double*) calloc(nEnergies+1, sizeof(double));
+	gatherStatistic(global, STAT_PHOTONENERGY, STAT_PHOTONENERGY, energies);
+	gatherStatistic(global, STAT_WAVELENGTH, STAT_PHOTONENERGY, wavelengths);
+	for (long i=0; i<nEnergies; i++) {
+		if (energies[i] > global->Emax) global->Emax = energies[i];
+		if (energies[i] < global->Emin) global->Emin = energies[i];
+		if (wavelengths[i] > global->Lmax) global->Lmax = wavelengths[i];
+		if (wavelengths[i] < global->Lmin) global->Lmin = wavelengths[i];
+	}
+	
 	double deltaE = 1; // 1 eV steps
 	//double deltaL = 14e-6; // Equivalence of 1 eV steps at 9385 eV
 	unsigned Ebins = (unsigned) ceil((global->Emax-global->Emin)/deltaE)+1;
@@ -2115,14 +1876,14 @@ void makeEnergyHistograms(cGlobal *global) {
 	if (Ebins > 1) {
 		global->Ehist = (unsigned*) calloc(Ebins, sizeof(unsigned));
 		global->Lhist = (unsigned*) calloc(Ebins, sizeof(unsigned));
-		for (long i=0; i<global->nEnergies; i++) {
-			global->Ehist[int(round((global->energies[i]-global->Emin)/deltaE))]++;
-			global->Lhist[int(round((global->wavelengths[i]-global->Lmin)/deltaL))]++;
-			global->Emean += global->energies[i];
-			global->Lmean += global->wavelengths[i];
-		}
-		global->Emean /= global->nEnergies;
-		global->Lmean /= global->nEnergies;
+		for (long i=0; i<nEnergies; i++) {
+			global->Ehist[int(round((energies[i]-global->Emin)/deltaE))]++;
+			global->Lhist[int(round((wavelengths[i]-global->Lmin)/deltaL))]++;
+			global->Emean += energies[i];
+			global->Lmean += wavelengths[i];
+		}
+		global->Emean /= nEnergies;
+		global->Lmean /= nEnergies;
 		char	filename[1024];
 		float *buffer = (float*) calloc(4*Ebins, sizeof(float));
 		printf("Saving histograms of energies and wavelengths to file\n");
@@ -2146,6 +1907,8 @@ void makeEnergyHistograms(cGlobal *global) {
 		// disable energy calibration if not enough bins
 		global->useEnergyCalibration = 0;
 	}
+	free(energies);
+	free(wavelengths);
 	
 }
 
@@ -2185,11 +1948,6 @@ int makeQcalibration(tThreadInfo *threadInfo, cGlobal *global) {
 	
 	// sanity check
 	if (threadInfo->detectorPosition > 60 && threadInfo->detectorPosition < 600 && threadInfo->wavelengthA == threadInfo->wavelengthA) {
-		// allocate arrays
-		if (threadInfo->angularAvgQ) {
-			free(threadInfo->angularAvgQ);
-		}
-		threadInfo->angularAvgQ = (double*) calloc(global->angularAvg_nn, sizeof(double));
 		// calculate Q-calibration (using the detector position and energy from the current event)
 		for (int i=0; i<global->angularAvg_nn; i++) {
 			threadInfo->angularAvgQ[i] = 4*M_PI*sin(atan(global->pixelSize*global->angularAvgQ[i]*1000/threadInfo->detectorPosition)/2)/threadInfo->wavelengthA;
@@ -2484,6 +2242,7 @@ void updatePixelArrays(cGlobal *global) {
 		}
 		
 	}
+	global->geometryVersion++;
 	pthread_mutex_unlock(&global->pixelcenter_mutex);	
 	
 }
@@ -2506,6 +2265,7 @@ void updatePixelArrays(tThreadInfo *info, cGlobal *global) {
 	global->pix_ymin -= deltaY;
 	global->pixelCenterX = info->pixelCenterX;
 	global->pixelCenterY = info->pixelCenterY;
+	global->geometryVersion++;
 	pthread_mutex_unlock(&global->pixelcenter_mutex);
 	
 }
@@ -2543,6 +2303,7 @@ void updateImageArrays(cGlobal *global) {
 	pthread_mutex_lock(&global->image_mutex);
 	global->image_nx = image_nx;
 	global->image_nn = image_nn;
+	global->createAssemblyMap();
 	
 	// update image arrays from raw data
 	if (global->generateDarkcal) {
@@ -2679,6 +2440,7 @@ void updateImageArrays(cGlobal *global, cHit *hit) {
 		pthread_mutex_lock(&global->image_mutex);
 		global->image_nx = image_nx;
 		global->image_nn = image_nn;
+		global->createAssemblyMap();
 		pthread_mutex_unlock(&global->image_mutex);
 		
 	} else DEBUGL1_ONLY cout << "\tSize of image output array is unchanged." << endl;
@@ -29,6 +29,7 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <string>
 
 #include "setup.h"
@@ -51,28 +52,64 @@ public:
 };
 
 
+struct sGeometryCache;
+typedef struct sGeometryCache tGeometryCache;	// defined in geometry.h
+
+
 /*
- *	Structure used for passing information to worker threads
+ *	Peak list of a frame (savePeaks), in raw data coordinates (fs = x within the 8*ROWS wide raw image, ss = y)
+ *	Pixels belonging to a peak are stored consecutively in peak order, followed by the sparse pixels outside peaks
+ *	event and firstPixel are filled in by the writer (rows in the run file)
  */
 typedef struct {
+	int			event;
+	int			nPixels;
+	int64_t		firstPixel;
+	float		fs;					// intensity weighted centroid
+	float		ss;
+	float		total;				// summed intensity
+} tPeak;
+
+typedef struct {
+	int			event;
+	int			peak;				// index into the peak list of the frame, -1 for sparse pixels above sparseADC
+	int16_t		fs;
+	int16_t		ss;
+	float		value;
+} tPeakPixel;
+
+
+/*
+ *	Structure used for passing information to worker threads
+ */
+typedef struct sThreadInfo {
 	
 	// Reference to common global structure
 	cGlobal		*pGlobal;
 	int			busy;
 	long		threadNum;
+	long		workerNum;			// index of the worker thread processing this frame (global->workerData)
 	
 	// CSPAD data
 	int			cspad_fail;
 	float		quad_temperature[4];
-	uint16_t	*quad_data[4];
 	float		*corrected_data;
 	float		*image;
 	double		*angularAvg;
 	double		*angularAvgQ;
-	double		*correlation;
+	unsigned	*angularAvgCounter;	// number of pixels in each bin of angularAvg
+	double		*correlation;		// angular correlation of this frame (correlation_nn values), valid if correlated is set
+	int			correlated;
 	double		intensityAvg;
 	int			nPeaks;
 	int			nHot;
+	int			writeFlags;			// output still to be written by the writer thread (WRITE_*)
+	tPeak		*peakList;			// peaks found by the hitfinder (savePeaks only)
+	long		nPeakList;
+	long		peakListSize;		// allocated entries
+	tPeakPixel	*peakPixels;
+	long		nPeakPixels;
+	long		peakPixelsSize;
 	
 	
 	// Beamline data, etc
@@ -113,9 +150,8 @@ typedef struct {
 	// Metrology data
 	float		pixelCenterX;
 	float		pixelCenterY;
-	float		*pix_qx;
-	float		*pix_qy;
-	double		*theta;
+	const tGeometryCache	*geometry;	// theta and polarization/solid angle correction for this frame (see pinGeometry)
+	int			geometryPinned;
 	
 } tThreadInfo;
 
@@ -147,24 +183,26 @@ static uint32_t nevents = 0;
 #define ERROR(...) fprintf(stderr, __VA_ARGS__)
 #define STATUS(...) fprintf(stderr, __VA_ARGS__)
 
+// Output done by the writer thread (tThreadInfo::writeFlags)
+#define WRITE_HDF5			1
+#define WRITE_ANGULARAVG	2
+#define WRITE_PIXELS		4
+
 #define DEBUGL1_ONLY if(global->debugLevel >= 1)
 #define DEBUGL2_ONLY if(global->debugLevel >= 2)
 
 /*
  *	Function prototypes
  */
-void *worker(void *);
-void subtractDarkcal(tThreadInfo*, cGlobal*);
-void applyGainCorrection(tThreadInfo*, cGlobal*);
-void applyBadPixelMask(tThreadInfo*, cGlobal*);
+void worker(tThreadInfo*);
+void writeEvent(tThreadInfo*, cGlobal*);
 void killHotpixels(tThreadInfo*, cGlobal*);
-void calculateScatteringAngle(tThreadInfo*, cGlobal*);
-int calculatePixelMaps(tThreadInfo*, cGlobal*);
-void calculatePolarizationCorrection(tThreadInfo*, cGlobal*);
-void calculateSolidAngleCorrection(tThreadInfo*, cGlobal*);
-void applyAttenuationCorrection(tThreadInfo*, cGlobal*);
+void updateHotpixelMask(tWorkerData*, cGlobal*, int);
+int calculatePixelMaps(tThreadInfo*);
 void addToPowder(tThreadInfo*, cGlobal*, cHit*);
+void mergePowders(cGlobal*);
 void addToCorrelation(tThreadInfo *threadInfo, cGlobal *global, cHit *hit);
+void addToCorrelationSums(cGlobal *global, long workerNum, cHit *hit, double *correlation);
 void assemble2Dimage(double corrected_data[], double *&image, cGlobal *global);
 void assemble2Dimage(tThreadInfo*, cGlobal*);
 void nameEvent(tThreadInfo*, cGlobal*);
@@ -172,7 +210,7 @@ bool containsEvent(std::string, cGlobal*);
 void writeHDF5(tThreadInfo *threadInfo, cGlobal *global, char *eventname);
 void writeSimpleHDF5(const char*, const void*, int, int, int);
 void writeSimpleHDF5(const char *filename, const void *data, int width, int height, int depth, int type);
-void flushHDF5();
+void flushHDF5(cGlobal*);
 void saveRunningSums(cGlobal*);
 void calculatePowderAngularAvg(cGlobal *global);
 void savePowderAngularAvg(cGlobal *global);
@@ -0,0 +1,877 @@
+/*
+ *  xcca.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <hdf5.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "threadpool.h"
+#include "geometry.h"
+#include "snapshot.h"
+#include "xcca.h"
+
+
+/*
+ *	Running correlation sums
+ *	Every worker adds its frames to its own sums (workerData->powderCorrelation etc., under the
+ *	uncontended powder_mutex), mergePowders() folds them into the global sums before they are saved.
+ */
+tXCCASum *createCorrelationSum(long nn) {
+
+	tXCCASum	*sum = (tXCCASum*) calloc(1, sizeof(tXCCASum));
+	sum->mean = (double*) calloc(nn, sizeof(double));
+	sum->m2 = (double*) calloc(nn, sizeof(double));
+	return sum;
+}
+
+void freeCorrelationSum(tXCCASum *sum) {
+
+	if (sum == NULL)
+		return;
+	free(sum->mean);
+	free(sum->m2);
+	free(sum->lastMean);
+	free(sum);
+}
+
+
+/*
+ *	Add the correlation of one frame (Welford)
+ */
+void addToCorrelationSum(tXCCASum *&sum, const double *data, long nn) {
+
+	if (sum == NULL)
+		sum = createCorrelationSum(nn);
+
+	sum->n += 1;
+	double	scale = 1./sum->n;
+	double	*mean = sum->mean;
+	double	*m2 = sum->m2;
+	for(long i=0; i<nn; i++) {
+		double	delta = data[i] - mean[i];
+		mean[i] += delta*scale;
+		m2[i] += delta*(data[i] - mean[i]);
+	}
+}
+
+
+/*
+ *	Add the frames of one worker to the global sum (Chan et al.) and clear the worker's sum
+ */
+void mergeCorrelationSum(tXCCASum *global, tXCCASum *worker, long nn) {
+
+	if (global == NULL || worker == NULL || worker->n == 0)
+		return;
+
+	double	nA = global->n;
+	double	nB = worker->n;
+	double	n = nA + nB;
+	for(long i=0; i<nn; i++) {
+		double	delta = worker->mean[i] - global->mean[i];
+		global->mean[i] += delta*nB/n;
+		global->m2[i] += worker->m2[i] + delta*delta*nA*nB/n;
+	}
+	global->n += worker->n;
+
+	worker->n = 0;
+	memset(worker->mean, 0, nn*sizeof(double));
+	memset(worker->m2, 0, nn*sizeof(double));
+}
+
+
+/*
+ *	Save the mean correlation (r0123-CorrelationSum<suffix>.h5) and its standard error (r0123-CorrelationError<suffix>.h5)
+ */
+static void writeCorrelation(cGlobal *global, const char *filename, const double *data) {
+	if (global->autoCorrelateOnly)
+		writeSimpleHDF5(filename, data, global->correlationNumDelta, global->correlationNumQ, H5T_NATIVE_DOUBLE);
+	else
+		writeSimpleHDF5(filename, data, global->correlationNumDelta, global->correlationNumQ, global->correlationNumQ, H5T_NATIVE_DOUBLE);
+}
+
+void saveCorrelationSum(cGlobal *global, tXCCASum *sum, const char *suffix) {
+
+	char	filename[1024];
+	long	nn = global->correlation_nn;
+
+	if (sum == NULL)
+		return;
+
+	sprintf(filename,"r%04u-CorrelationSum%s.h5",global->runNumber,suffix);
+	writeCorrelation(global, filename, sum->mean);
+
+	double	*error = (double*) calloc(nn, sizeof(double));
+	if (sum->n > 1)
+		for(long i=0; i<nn; i++)
+			error[i] = sqrt(sum->m2[i]/((sum->n-1.)*sum->n));
+	sprintf(filename,"r%04u-CorrelationError%s.h5",global->runNumber,suffix);
+	writeCorrelation(global, filename, error);
+	free(error);
+}
+
+
+/*
+ *	One line of the convergence report: RMS over all q and lags > 0 (lag 0 is the normalised variance)
+ *	of the mean, of its standard error and of its change since the last report
+ */
+static void reportCorrelationSum(FILE *fp, cGlobal *global, tXCCASum *sum, const char *name) {
+
+	long	nn = global->correlation_nn;
+	int		nLag = global->correlationNumDelta;
+	double	sumMean = 0;
+	double	sumError = 0;
+	double	sumChange = 0;
+	long	n = 0;
+
+	if (sum == NULL)
+		return;
+
+	for(long i=0; i<nn; i++) {
+		if (i % nLag == 0)
+			continue;
+		sumMean += sum->mean[i]*sum->mean[i];
+		if (sum->n > 1)
+			sumError += sum->m2[i]/((sum->n-1.)*sum->n);
+		if (sum->lastMean)
+			sumChange += (sum->mean[i] - sum->lastMean[i])*(sum->mean[i] - sum->lastMean[i]);
+		n++;
+	}
+	double	rmsMean = n ? sqrt(sumMean/n) : 0;
+	double	rmsError = n ? sqrt(sumError/n) : 0;
+	double	rmsChange = n ? sqrt(sumChange/n) : 0;
+	double	relativeError = (rmsMean > 0) ? rmsError/rmsMean : 0;
+	double	relativeChange = (rmsMean > 0 && sum->lastMean) ? rmsChange/rmsMean : 0;
+
+	fprintf(fp, "%li, %s, %li, %g, %g, %g, %g\n", global->nprocessedframes, name, sum->n, rmsMean, rmsError, relativeError, relativeChange);
+	printf("Correlation sum (%s): %li frames, relative error %g, relative change %g\n", name, sum->n, relativeError, relativeChange);
+
+	if (sum->lastMean == NULL)
+		sum->lastMean = (double*) malloc(nn*sizeof(double));
+	memcpy(sum->lastMean, sum->mean, nn*sizeof(double));
+}
+
+
+/*
+ *	Append the state of the correlation sums to r0123-correlation.txt (each time the sums are saved),
+ *	the run can be stopped once the relative error and change are small enough
+ */
+void reportCorrelationConvergence(cGlobal *global) {
+
+	char	filename[1024];
+	FILE	*fp;
+	tXCCASum	*sums[3] = {global->powderCorrelation, global->iceCorrelation, global->waterCorrelation};
+	int		first = 1;
+
+	for(int k=0; k<3; k++)
+		if (sums[k] && sums[k]->lastMean)
+			first = 0;
+
+	sprintf(filename,"r%04u-correlation.txt",global->runNumber);
+	fp = fopen(filename, first ? "w" : "a");
+	if (fp == NULL) {
+		printf("Error: could not open %s\n", filename);
+		return;
+	}
+	if (first)
+		fprintf(fp, "# nFrames, Class, nCorrelated, RmsMean, RmsError, RelativeError, RelativeChange\n");
+	reportCorrelationSum(fp, global, global->powderCorrelation, "standard");
+	reportCorrelationSum(fp, global, global->iceCorrelation, "ice");
+	reportCorrelationSum(fp, global, global->waterCorrelation, "water");
+	fclose(fp);
+}
+
+
+#ifdef CORRELATION_ENABLED
+
+/*
+ *	Plan the ring transforms for the correlation shape of this job (in beginjob, before the workers start)
+ */
+void createXCCAPlans(cGlobal *global) {
+
+	tXCCAPlans	*plans = (tXCCAPlans*) calloc(1, sizeof(tXCCAPlans));
+
+	plans->nQ = global->correlationNumQ;
+	plans->nPhi = global->correlationNumPhi;
+	plans->nLag = global->correlationNumDelta;
+	plans->nFreq = plans->nPhi/2 + 1;
+
+	// Planned on scratch arrays; arrays the plans are executed on must also come from fftw_malloc (same alignment)
+	double			*ring = (double*) fftw_malloc(plans->nPhi*sizeof(double));
+	fftw_complex	*spectrum = (fftw_complex*) fftw_malloc(plans->nFreq*sizeof(fftw_complex));
+
+	pthread_mutex_lock(&global->correlationFFT_mutex);
+	plans->forward = fftw_plan_dft_r2c_1d(plans->nPhi, ring, spectrum, FFTW_MEASURE);
+	plans->backward = fftw_plan_dft_c2r_1d(plans->nPhi, spectrum, ring, FFTW_MEASURE);
+	pthread_mutex_unlock(&global->correlationFFT_mutex);
+
+	fftw_free(ring);
+	fftw_free(spectrum);
+
+	// One transform over the rings of correlationBatch frames (advanced interface: ring after ring, contiguous)
+	plans->nBatch = 1;
+	if (global->autoCorrelateOnly && global->correlationBatch > 1) {
+		plans->nBatch = global->correlationBatch;
+		int		nRings = plans->nBatch*plans->nQ;
+		double			*rings = (double*) fftw_malloc((long) nRings*plans->nPhi*sizeof(double));
+		fftw_complex	*spectra = (fftw_complex*) fftw_malloc((long) nRings*plans->nFreq*sizeof(fftw_complex));
+
+		pthread_mutex_lock(&global->correlationFFT_mutex);
+		plans->batchForward = fftw_plan_many_dft_r2c(1, &plans->nPhi, nRings, rings, NULL, 1, plans->nPhi,
+													 spectra, NULL, 1, plans->nFreq, FFTW_MEASURE);
+		plans->batchBackward = fftw_plan_many_dft_c2r(1, &plans->nPhi, nRings, spectra, NULL, 1, plans->nFreq,
+													  rings, NULL, 1, plans->nPhi, FFTW_MEASURE);
+		pthread_mutex_unlock(&global->correlationFFT_mutex);
+
+		fftw_free(rings);
+		fftw_free(spectra);
+	}
+
+	global->xccaPlans = plans;
+	printf("Planned correlation FFTs for %i rings of %i angles", plans->nQ, plans->nPhi);
+	if (plans->nBatch > 1)
+		printf(", autocorrelated in batches of %i frames", plans->nBatch);
+	printf("\n");
+}
+
+
+void destroyXCCAPlans(cGlobal *global) {
+
+	tXCCAPlans	*plans = global->xccaPlans;
+
+	if (plans == NULL)
+		return;
+
+	pthread_mutex_lock(&global->correlationFFT_mutex);
+	fftw_destroy_plan(plans->forward);
+	fftw_destroy_plan(plans->backward);
+	if (plans->nBatch > 1) {
+		fftw_destroy_plan(plans->batchForward);
+		fftw_destroy_plan(plans->batchBackward);
+	}
+	pthread_mutex_unlock(&global->correlationFFT_mutex);
+	free(plans);
+	global->xccaPlans = NULL;
+}
+
+
+/*
+ *	Set up the (empty) polar map, it is built by the first frame that is correlated
+ */
+void initPolarMap(cGlobal *global) {
+	initSnapshot(&global->polarSnapshot, calloc(1, sizeof(tPolarMap)), calloc(1, sizeof(tPolarMap)));
+}
+
+void freePolarMap(cGlobal *global) {
+	for(int n=0; n<2; n++) {
+		tPolarMap *map = (tPolarMap*) global->polarSnapshot.buffer[n];
+		free(map->start);
+		free(map->pixel);
+		free(map->weight);
+		free(map->occupancy);
+		free(map->qAvg);
+	}
+	freeSnapshot(&global->polarSnapshot);
+}
+
+
+/*
+ *	Spacing of the rings and of the bins on a ring
+ */
+static double ringSpacing(cGlobal *global) {
+	if (global->correlationNumQ > 1)
+		return (global->correlationStopQ - global->correlationStartQ)/(global->correlationNumQ-1);
+	return 1;
+}
+
+static double binSpacing(cGlobal *global) {
+	return (global->correlationStopPhi - global->correlationStartPhi)/global->correlationNumPhi;
+}
+
+
+/*
+ *	Sort the pixels into the (q, phi) bins of the correlation
+ *	Pixels go to the nearest ring and to the bin whose angular range they fall in, bad pixels
+ *	and pixels outside the rings or angles are left out. Two passes: count, then fill.
+ */
+static void buildPolarMap(tPolarMap *map, tThreadInfo *threadInfo, cGlobal *global) {
+
+	const int	nQ = global->correlationNumQ;
+	const int	nPhi = global->correlationNumPhi;
+	const long	nBins = (long) nQ*nPhi;
+	double		deltaQ = ringSpacing(global);
+	double		deltaPhi = binSpacing(global);
+	double		wavelengthA = threadInfo->wavelengthA;
+	const double	*theta = threadInfo->geometry->theta;
+
+	if (map->start == NULL) {
+		map->start = (long*) malloc((nBins+1)*sizeof(long));
+		map->pixel = (int*) malloc(global->pix_nn*sizeof(int));
+		map->weight = (float*) malloc(global->pix_nn*sizeof(float));
+		map->occupancy = (float*) malloc(nBins*sizeof(float));
+		map->qAvg = (double*) malloc(nQ*sizeof(double));
+	}
+
+	int		*bin = (int*) malloc(global->pix_nn*sizeof(int));
+	long	*count = (long*) calloc(nBins+1, sizeof(long));
+	double	*qSum = (double*) calloc(nQ, sizeof(double));
+	long	*qCount = (long*) calloc(nQ, sizeof(long));
+
+	pthread_mutex_lock(&global->pixelcenter_mutex);
+	for(long i=0; i<global->pix_nn; i++) {
+		bin[i] = -1;
+		if (global->useBadPixelMask && !global->badpixelmask[i])
+			continue;
+
+		// Radius in pixels, |q| or |q_perp| in Å-1
+		double	x = global->pix_x[i];
+		double	y = global->pix_y[i];
+		double	v;
+		if (global->correlationQScale == 2)
+			v = 4*M_PI*sin(theta[i]/2)/wavelengthA;
+		else if (global->correlationQScale == 3)
+			v = 2*M_PI*sin(theta[i])/wavelengthA;
+		else
+			v = sqrt(x*x + y*y);
+		long	q = (long) floor((v - global->correlationStartQ)/deltaQ + 0.5);
+		if (q < 0 || q >= nQ)
+			continue;
+
+		// Angle in degrees from +Y, counted from correlationStartPhi
+		double	phi = atan2(x, y)*180/M_PI - global->correlationStartPhi;
+		phi = fmod(phi, 360.);
+		if (phi < 0)
+			phi += 360;
+		long	j = (long) floor(phi/deltaPhi);
+		if (j < 0 || j >= nPhi)
+			continue;
+
+		bin[i] = (int) (q*nPhi + j);
+		count[bin[i]+1]++;
+		qSum[q] += v;
+		qCount[q]++;
+	}
+	pthread_mutex_unlock(&global->pixelcenter_mutex);
+
+	// Offsets of the bins, then the pixels of each bin in pixel order
+	map->start[0] = 0;
+	for(long b=0; b<nBins; b++) {
+		map->occupancy[b] = (count[b+1] > 0);
+		count[b+1] += count[b];
+		map->start[b+1] = count[b+1];
+	}
+	for(long i=0; i<global->pix_nn; i++) {
+		if (bin[i] < 0)
+			continue;
+		long	b = bin[i];
+		long	n = map->start[b+1] - map->start[b];
+		map->pixel[count[b]] = (int) i;
+		map->weight[count[b]] = 1./n;
+		count[b]++;
+	}
+
+	for(int q=0; q<nQ; q++)
+		map->qAvg[q] = qCount[q] ? qSum[q]/qCount[q] : global->correlationStartQ + q*deltaQ;
+
+	map->geometryVersion = global->geometryVersion;
+	map->detectorZ = threadInfo->geometry->detectorZ;
+	map->pixelCenterX = threadInfo->geometry->pixelCenterX;
+	map->pixelCenterY = threadInfo->geometry->pixelCenterY;
+	map->wavelengthA = wavelengthA;
+	map->valid = 1;
+
+	free(bin);
+	free(count);
+	free(qSum);
+	free(qCount);
+}
+
+
+/*
+ *	Is the map right for this frame?
+ *	In pixels the map only depends on the pixel maps. In q it also depends on the detector position
+ *	and the wavelength, which jitters from shot to shot: the map is only rebuilt once the outermost
+ *	ring would move by more than a tenth of the ring spacing.
+ */
+static int polarMapMatches(const tPolarMap *map, tThreadInfo *threadInfo, cGlobal *global) {
+
+	if (!map->valid || map->geometryVersion != global->geometryVersion)
+		return 0;
+	if (global->correlationQScale == 1)
+		return 1;
+	if (map->detectorZ != threadInfo->geometry->detectorZ || map->pixelCenterX != threadInfo->geometry->pixelCenterX
+		|| map->pixelCenterY != threadInfo->geometry->pixelCenterY)
+		return 0;
+	return fabs(threadInfo->wavelengthA - map->wavelengthA)*fabs(global->correlationStopQ) <= 0.1*ringSpacing(global)*map->wavelengthA;
+}
+
+
+/*
+ *	Get the polar map for this frame, rebuilt by the first thread that finds it out of date (as pinGeometry)
+ */
+static const tPolarMap *pinPolarMap(tThreadInfo *threadInfo, cGlobal *global, int *pinned) {
+
+	const tPolarMap	*map = (const tPolarMap*) pinSnapshot(&global->polarSnapshot, pinned);
+
+	if (!polarMapMatches(map, threadInfo, global)) {
+		unpinSnapshot(&global->polarSnapshot, *pinned);
+
+		pthread_mutex_lock(&global->correlation_mutex);
+		map = (const tPolarMap*) pinSnapshot(&global->polarSnapshot, pinned);
+		if (!polarMapMatches(map, threadInfo, global)) {
+			unpinSnapshot(&global->polarSnapshot, *pinned);
+			DEBUGL1_ONLY printf("r%04u:%i Updating polar map of the correlation\n", (int)threadInfo->runNumber, (int)threadInfo->threadNum);
+			tPolarMap *update = (tPolarMap*) beginSnapshotUpdate(&global->polarSnapshot);
+			buildPolarMap(update, threadInfo, global);
+			publishSnapshot(&global->polarSnapshot);
+			map = (const tPolarMap*) pinSnapshot(&global->polarSnapshot, pinned);
+		}
+		pthread_mutex_unlock(&global->correlation_mutex);
+	}
+	return map;
+}
+
+
+/*
+ *	Polar bins and ring averages of one frame
+ */
+static tXCCAWork *createXCCAFrame(cGlobal *global) {
+
+	const int	nQ = global->correlationNumQ;
+	const int	nPhi = global->correlationNumPhi;
+
+	tXCCAWork	*work = (tXCCAWork*) calloc(1, sizeof(tXCCAWork));
+	work->polar = (double*) malloc(nQ*nPhi*sizeof(double));
+	work->occupancy = (float*) malloc(nQ*nPhi*sizeof(float));
+	work->fluct = (double*) malloc(nQ*nPhi*sizeof(double));
+	work->full = (int*) malloc(nQ*sizeof(int));
+	work->qAvg = (double*) malloc(nQ*sizeof(double));
+	work->phiAvg = (double*) malloc(nPhi*sizeof(double));
+	work->iAvg = (double*) calloc(nQ, sizeof(double));
+	work->norm = (double*) malloc(nQ*sizeof(double));
+
+	for(int j=0; j<nPhi; j++)
+		work->phiAvg[j] = global->correlationStartPhi + (j+0.5)*binSpacing(global);
+
+	return work;
+}
+
+static void freeXCCAFrame(tXCCAWork *work) {
+
+	free(work->polar);
+	free(work->occupancy);
+	free(work->fluct);
+	free(work->full);
+	free(work->qAvg);
+	free(work->phiAvg);
+	free(work->iAvg);
+	free(work->norm);
+	fftw_free(work->ring);
+	fftw_free(work->spectra);
+	fftw_free(work->maskSpectra);
+	fftw_free(work->product);
+	free(work);
+}
+
+
+/*
+ *	Workspace of the worker processing this frame, allocated the first time the worker correlates
+ */
+tXCCAWork *getXCCAWork(tThreadInfo *threadInfo, cGlobal *global) {
+
+	tWorkerData	*workerData = &global->workerData[threadInfo->workerNum];
+	tXCCAPlans	*plans = global->xccaPlans;
+
+	if (workerData->xcca)
+		return workerData->xcca;
+
+	tXCCAWork	*work = createXCCAFrame(global);
+
+	if (plans && plans->nBatch > 1) {
+		tXCCABatch	*batch = (tXCCABatch*) calloc(1, sizeof(tXCCABatch));
+		long		nRings = (long) plans->nBatch*plans->nQ;
+		pthread_mutex_init(&batch->mutex, NULL);
+		batch->workerNum = threadInfo->workerNum;
+		batch->size = plans->nBatch;
+		batch->frames = (tXCCAWork**) calloc(plans->nBatch, sizeof(tXCCAWork*));
+		batch->correlation = (double**) calloc(plans->nBatch, sizeof(double*));
+		for(int f=0; f<plans->nBatch; f++) {
+			batch->frames[f] = createXCCAFrame(global);
+			batch->correlation[f] = (double*) calloc(global->correlation_nn, sizeof(double));
+		}
+		batch->eventname = (char(*)[1024]) calloc(plans->nBatch, 1024);
+		batch->hit = (cHit*) calloc(plans->nBatch, sizeof(cHit));
+		batch->rings = (double*) fftw_malloc(nRings*plans->nPhi*sizeof(double));
+		memset(batch->rings, 0, nRings*plans->nPhi*sizeof(double));
+		batch->spectra = (fftw_complex*) fftw_malloc(nRings*plans->nFreq*sizeof(fftw_complex));
+		batch->ring = (double*) fftw_malloc(plans->nPhi*sizeof(double));
+		batch->product = (fftw_complex*) fftw_malloc(plans->nFreq*sizeof(fftw_complex));
+		work->batch = batch;
+	}
+	else if (plans) {
+		work->ring = (double*) fftw_malloc(plans->nPhi*sizeof(double));
+		work->spectra = (fftw_complex*) fftw_malloc(plans->nQ*plans->nFreq*sizeof(fftw_complex));
+		work->maskSpectra = (fftw_complex*) fftw_malloc(plans->nQ*plans->nFreq*sizeof(fftw_complex));
+		work->product = (fftw_complex*) fftw_malloc(plans->nFreq*sizeof(fftw_complex));
+	}
+
+	// flushCorrelationBatches() looks at the workspace from the main thread
+	__sync_synchronize();
+	workerData->xcca = work;
+	return work;
+}
+
+
+/*
+ *	Resample the corrected data of this frame onto the polar bins (bin averages of all pixels in a bin)
+ *	and take the fluctuations around the ring means. Empty bins have zero occupancy and fluctuation.
+ */
+void xccaPolar(tThreadInfo *threadInfo, cGlobal *global, tXCCAWork *work) {
+
+	const int		nQ = global->correlationNumQ;
+	const int		nPhi = global->correlationNumPhi;
+	const long		nBins = (long) nQ*nPhi;
+	const float		*data = threadInfo->corrected_data;
+	int				pinned;
+
+	const tPolarMap	*map = pinPolarMap(threadInfo, global, &pinned);
+	const long		*start = map->start;
+	const int		*pixel = map->pixel;
+	const float		*weight = map->weight;
+
+	for(long b=0; b<nBins; b++) {
+		double	sum = 0;
+		for(long e=start[b]; e<start[b+1]; e++)
+			sum += weight[e]*data[pixel[e]];
+		work->polar[b] = sum;
+	}
+	memcpy(work->occupancy, map->occupancy, nBins*sizeof(float));
+	memcpy(work->qAvg, map->qAvg, nQ*sizeof(double));
+	unpinSnapshot(&global->polarSnapshot, pinned);
+
+	for(int q=0; q<nQ; q++) {
+		const double	*polar = work->polar + (long) q*nPhi;
+		const float		*occupancy = work->occupancy + (long) q*nPhi;
+		double			*fluct = work->fluct + (long) q*nPhi;
+		double			sum = 0;
+		int				n = 0;
+
+		for(int j=0; j<nPhi; j++) {
+			sum += occupancy[j]*polar[j];
+			n += (occupancy[j] != 0);
+		}
+		work->iAvg[q] = n ? sum/n : 0;
+		work->full[q] = (n == nPhi);
+
+		double	var = 0;
+		for(int j=0; j<nPhi; j++) {
+			fluct[j] = occupancy[j]*(polar[j] - work->iAvg[q]);
+			var += fluct[j]*fluct[j];
+		}
+		work->norm[q] = (global->correlationNormalization == 2) ? (n ? sqrt(var/n) : 0) : work->iAvg[q];
+	}
+}
+
+
+/*
+ *	Where the correlation of rings q1 and q2 goes in the result
+ */
+static double *resultRow(cGlobal *global, double *result, int q1, int q2) {
+	if (global->autoCorrelateOnly)
+		return result + (long) q1*global->correlationNumDelta;
+	return result + ((long) q1*global->correlationNumQ + q2)*global->correlationNumDelta;
+}
+
+
+/*
+ *	Angular correlation of the intensity fluctuations on the nQ rings of the workspace
+ *		C(q1,q2,k) = sum_phi dI(q1,phi) dI(q2,phi+k) / sum_phi m(q1,phi) m(q2,phi+k) / norm(q1) norm(q2)
+ *	m being the occupancy of the bins, i.e. the mean over the pairs of bins that both have pixels,
+ *	and norm the mean ring intensity (correlationNormalization 1) or its standard deviation (2).
+ *	result holds nQ x nLag values (autoCorrelateOnly) or nQ x nQ x nLag values.
+ *	Fast algorithm: numerator and denominator are circular correlations, done through the FFT.
+ *	Only touches the workspace and the shared plans, so all workers can run it at the same time.
+ */
+void xccaCorrelate(cGlobal *global, tXCCAWork *work, double *result) {
+
+	tXCCAPlans		*plans = global->xccaPlans;
+	const int		nQ = plans->nQ;
+	const int		nPhi = plans->nPhi;
+	const int		nLag = plans->nLag;
+	const int		nFreq = plans->nFreq;
+	double			*ring = work->ring;
+	fftw_complex	*product = work->product;
+	double			*norm = work->norm;
+
+	// Spectra of the fluctuations, and of the occupancy of rings with empty bins
+	for(int q=0; q<nQ; q++) {
+		memcpy(ring, work->fluct + (long) q*nPhi, nPhi*sizeof(double));
+		fftw_execute_dft_r2c(plans->forward, ring, work->spectra + (long) q*nFreq);
+		if (!work->full[q]) {
+			for(int j=0; j<nPhi; j++)
+				ring[j] = work->occupancy[(long) q*nPhi + j];
+			fftw_execute_dft_r2c(plans->forward, ring, work->maskSpectra + (long) q*nFreq);
+		}
+	}
+
+	for(int q1=0; q1<nQ; q1++) {
+		for(int q2=0; q2<nQ; q2++) {
+			if (global->autoCorrelateOnly && q2 != q1)
+				continue;
+			double	*out = resultRow(global, result, q1, q2);
+
+			// Number of bin pairs at each lag; nPhi for two complete rings
+			if (!work->full[q1] || !work->full[q2]) {
+				const fftw_complex	*m1 = work->maskSpectra + (long) q1*nFreq;
+				const fftw_complex	*m2 = work->maskSpectra + (long) q2*nFreq;
+				if (work->full[q1])
+					m1 = NULL;
+				if (work->full[q2])
+					m2 = NULL;
+				for(int k=0; k<nFreq; k++) {
+					// the spectrum of a complete ring is nPhi at k=0 and 0 elsewhere
+					double	re1 = m1 ? m1[k][0] : (k ? 0 : nPhi);
+					double	im1 = m1 ? m1[k][1] : 0;
+					double	re2 = m2 ? m2[k][0] : (k ? 0 : nPhi);
+					double	im2 = m2 ? m2[k][1] : 0;
+					product[k][0] = re1*re2 + im1*im2;
+					product[k][1] = re1*im2 - im1*re2;
+				}
+				fftw_execute_dft_c2r(plans->backward, product, ring);
+				for(int k=0; k<nLag; k++)
+					out[k] = floor(ring[k % nPhi]/nPhi + 0.5);
+			}
+			else {
+				for(int k=0; k<nLag; k++)
+					out[k] = nPhi;
+			}
+
+			// Inverse transform of conj(F1)*F2, divided by the number of pairs
+			const fftw_complex	*f1 = work->spectra + (long) q1*nFreq;
+			const fftw_complex	*f2 = work->spectra + (long) q2*nFreq;
+			for(int k=0; k<nFreq; k++) {
+				product[k][0] = f1[k][0]*f2[k][0] + f1[k][1]*f2[k][1];
+				product[k][1] = f1[k][0]*f2[k][1] - f1[k][1]*f2[k][0];
+			}
+			fftw_execute_dft_c2r(plans->backward, product, ring);
+
+			double	scale = 0;
+			if (norm[q1] != 0 && norm[q2] != 0)
+				scale = 1./((double) nPhi*norm[q1]*norm[q2]);
+			for(int k=0; k<nLag; k++)
+				out[k] = (out[k] > 0) ? ring[k % nPhi]*scale/out[k] : 0;
+		}
+	}
+}
+
+
+/*
+ *	Same correlation as xccaCorrelate() summed directly over phi (regular algorithm, no FFTW plans needed)
+ */
+void xccaCorrelateDirect(cGlobal *global, tXCCAWork *work, double *result) {
+
+	const int	nQ = global->correlationNumQ;
+	const int	nPhi = global->correlationNumPhi;
+	const int	nLag = global->correlationNumDelta;
+	double		*norm = work->norm;
+
+	for(int q1=0; q1<nQ; q1++) {
+		const double	*f1 = work->fluct + (long) q1*nPhi;
+		const float		*m1 = work->occupancy + (long) q1*nPhi;
+
+		for(int q2=0; q2<nQ; q2++) {
+			if (global->autoCorrelateOnly && q2 != q1)
+				continue;
+			const double	*f2 = work->fluct + (long) q2*nPhi;
+			const float		*m2 = work->occupancy + (long) q2*nPhi;
+			double			*out = resultRow(global, result, q1, q2);
+
+			double	scale = 0;
+			if (norm[q1] != 0 && norm[q2] != 0)
+				scale = 1./(norm[q1]*norm[q2]);
+
+			for(int k=0; k<nLag; k++) {
+				int		lag = k % nPhi;
+				double	sum = 0;
+				double	pairs = 0;
+				for(int j=0; j<nPhi; j++) {
+					int	j2 = (j + lag < nPhi) ? j + lag : j + lag - nPhi;
+					sum += f1[j]*f2[j2];
+					pairs += m1[j]*m2[j2];
+				}
+				out[k] = (pairs > 0) ? sum*scale/pairs : 0;
+			}
+		}
+	}
+}
+
+
+/*
+ *	Put the frame just resampled by xccaPolar() into the batch of this worker (holding batch->mutex)
+ *	Returns 1 once the batch is full and has to be correlated.
+ */
+int xccaQueue(cGlobal *global, tXCCAWork *work, const char *eventname, cHit *hit) {
+
+	tXCCABatch	*batch = work->batch;
+	const int	nQ = global->correlationNumQ;
+	const long	nBins = (long) nQ*global->correlationNumPhi;
+	int			f = batch->count++;
+	tXCCAWork	*frame = batch->frames[f];
+
+	memcpy(frame->polar, work->polar, nBins*sizeof(double));
+	memcpy(frame->occupancy, work->occupancy, nBins*sizeof(float));
+	memcpy(frame->full, work->full, nQ*sizeof(int));
+	memcpy(frame->qAvg, work->qAvg, nQ*sizeof(double));
+	memcpy(frame->iAvg, work->iAvg, nQ*sizeof(double));
+	memcpy(frame->norm, work->norm, nQ*sizeof(double));
+	memcpy(batch->rings + f*nBins, work->fluct, nBins*sizeof(double));
+	strncpy(batch->eventname[f], eventname, 1023);
+	batch->eventname[f][1023] = 0;
+	batch->hit[f] = *hit;
+
+	return (batch->count == batch->size);
+}
+
+
+/*
+ *	Autocorrelation of all frames in the batch (holding batch->mutex), same result as xccaCorrelate()
+ *	The rings of a full batch are transformed to power spectra and back in one call each; only the
+ *	occupancy of incomplete rings still goes through the single ring plans. A partial batch (flushed by
+ *	saveRunningSums or endjob) transforms only the rings of the frames waiting, one at a time.
+ */
+void xccaCorrelateBatch(cGlobal *global, tXCCABatch *batch) {
+
+	tXCCAPlans		*plans = global->xccaPlans;
+	const int		nQ = plans->nQ;
+	const int		nPhi = plans->nPhi;
+	const int		nLag = plans->nLag;
+	const int		nFreq = plans->nFreq;
+	const long		nRings = (long) batch->count*nQ;
+	fftw_complex	*spectra = batch->spectra;
+	fftw_complex	*product = batch->product;
+
+	if (batch->count == 0)
+		return;
+
+	if (batch->count == batch->size) {
+		fftw_execute_dft_r2c(plans->batchForward, batch->rings, spectra);
+		for(long r=0; r<nRings*nFreq; r++) {
+			spectra[r][0] = spectra[r][0]*spectra[r][0] + spectra[r][1]*spectra[r][1];
+			spectra[r][1] = 0;
+		}
+		fftw_execute_dft_c2r(plans->batchBackward, spectra, batch->rings);
+	}
+	else {
+		// Through the aligned scratch ring, rings in the block are only aligned for the batch plans
+		for(long r=0; r<nRings; r++) {
+			double	*ring = batch->rings + r*nPhi;
+			memcpy(batch->ring, ring, nPhi*sizeof(double));
+			fftw_execute_dft_r2c(plans->forward, batch->ring, product);
+			for(int k=0; k<nFreq; k++) {
+				product[k][0] = product[k][0]*product[k][0] + product[k][1]*product[k][1];
+				product[k][1] = 0;
+			}
+			fftw_execute_dft_c2r(plans->backward, product, batch->ring);
+			memcpy(ring, batch->ring, nPhi*sizeof(double));
+		}
+	}
+
+	for(int f=0; f<batch->count; f++) {
+		tXCCAWork	*frame = batch->frames[f];
+
+		for(int q=0; q<nQ; q++) {
+			const double	*ring = batch->rings + ((long) f*nQ + q)*nPhi;
+			double			*out = batch->correlation[f] + (long) q*nLag;
+
+			// Number of bin pairs at each lag
+			if (frame->full[q]) {
+				for(int k=0; k<nLag; k++)
+					out[k] = nPhi;
+			}
+			else {
+				for(int j=0; j<nPhi; j++)
+					batch->ring[j] = frame->occupancy[(long) q*nPhi + j];
+				fftw_execute_dft_r2c(plans->forward, batch->ring, product);
+				for(int k=0; k<nFreq; k++) {
+					product[k][0] = product[k][0]*product[k][0] + product[k][1]*product[k][1];
+					product[k][1] = 0;
+				}
+				fftw_execute_dft_c2r(plans->backward, product, batch->ring);
+				for(int k=0; k<nLag; k++)
+					out[k] = floor(batch->ring[k % nPhi]/nPhi + 0.5);
+			}
+
+			double	scale = 0;
+			if (frame->norm[q] != 0)
+				scale = 1./((double) nPhi*frame->norm[q]*frame->norm[q]);
+			for(int k=0; k<nLag; k++)
+				out[k] = (out[k] > 0) ? ring[k % nPhi]*scale/out[k] : 0;
+		}
+	}
+}
+
+
+void freeXCCAWork(tWorkerData *workerData) {
+
+	tXCCAWork	*work = workerData->xcca;
+
+	if (work == NULL)
+		return;
+
+	tXCCABatch	*batch = work->batch;
+	if (batch) {
+		for(int f=0; f<batch->size; f++) {
+			freeXCCAFrame(batch->frames[f]);
+			free(batch->correlation[f]);
+		}
+		free(batch->frames);
+		free(batch->correlation);
+		free(batch->eventname);
+		free(batch->hit);
+		fftw_free(batch->rings);
+		fftw_free(batch->spectra);
+		fftw_free(batch->ring);
+		fftw_free(batch->product);
+		pthread_mutex_destroy(&batch->mutex);
+		free(batch);
+	}
+	freeXCCAFrame(work);
+	workerData->xcca = NULL;
+}
+
+#else
+
+void initPolarMap(cGlobal *global) {
+}
+
+void freePolarMap(cGlobal *global) {
+}
+
+void createXCCAPlans(cGlobal *global) {
+}
+
+void destroyXCCAPlans(cGlobal *global) {
+}
+
+void freeXCCAWork(tWorkerData *workerData) {
+}
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ *  xcca.h
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _xcca_h
+#define _xcca_h
+
+#include "setup.h"
+#include "worker.h"
+#include "threadpool.h"
+
+
+//  Angular correlation of polar rings
+//
+//  The detector is resampled onto nQ rings of nPhi bins by a sparse operator (tPolarMap) that
+//  lists, for every bin, the pixels falling into it. It is shared by all workers through
+//  global->polarSnapshot and only rebuilt when the geometry changes, like the geometry cache.
+//  Bins without pixels are masked out of the correlation.
+//
+//  The FFTW planner is not thread-safe, executing a plan is. The plans are therefore made
+//  once in beginjob (under correlationFFT_mutex) and afterwards only read: every worker runs
+//  them on the arrays of its own workspace with the new-array execute functions, so frames
+//  are correlated in parallel. Only built with CORRELATION_ENABLED (needs fftw3).
+//
+#ifdef CORRELATION_ENABLED
+
+	#include <fftw3.h>
+
+	typedef struct sXCCAPlans {
+
+		int			nQ;			// number of rings
+		int			nPhi;		// samples per ring
+		int			nLag;		// angular lags in the result (correlationNumDelta)
+		int			nFreq;		// nPhi/2+1 complex values per ring spectrum
+
+		fftw_plan	forward;	// one ring -> half spectrum
+		fftw_plan	backward;	// one half spectrum -> circular correlation
+
+		// Autocorrelation of several frames at once (correlationBatch)
+		int			nBatch;			// frames per batch, 1 if frames are correlated one by one
+		fftw_plan	batchForward;	// nBatch*nQ rings -> half spectra
+		fftw_plan	batchBackward;	// nBatch*nQ power spectra -> circular autocorrelations
+
+	} tXCCAPlans;
+
+	/*
+	 *	Pixels of each (q, phi) bin in compressed sparse row form: bin b = q*nPhi + phi averages
+	 *	pixel[start[b]] .. pixel[start[b+1]-1], each with weight 1/(number of pixels in the bin)
+	 */
+	typedef struct sPolarMap {
+
+		int			valid;
+		long		geometryVersion;	// value of global->geometryVersion the map was built for
+		double		detectorZ;			// detector position, pixel center and wavelength the map was
+		float		pixelCenterX;		// built for (only matter for q scales)
+		float		pixelCenterY;
+		double		wavelengthA;
+
+		long		*start;				// nQ*nPhi+1 offsets
+		int			*pixel;
+		float		*weight;
+		float		*occupancy;			// nQ*nPhi, 1 for bins with pixels, 0 for empty ones
+		double		*qAvg;				// mean q (or radius) of the pixels on each ring
+
+	} tPolarMap;
+
+	/*
+	 *	Correlation workspace of one worker thread (workerData->xcca), kept from frame to frame
+	 */
+	typedef struct sXCCAWork {
+
+		double			*polar;		// nQ x nPhi bin averages of the current frame
+		float			*occupancy;	// nQ x nPhi, copied from the polar map
+		double			*fluct;		// nQ x nPhi deviations from the ring means, 0 in empty bins
+		int				*full;		// rings without empty bins
+		double			*qAvg;		// q of each ring (pixels or Å-1, see correlationQScale)
+		double			*phiAvg;	// angle of each bin on a ring (degrees)
+		double			*iAvg;		// mean intensity of each ring
+		double			*norm;		// normalisation of each ring
+
+		// FFT buffers (fftw_malloc, fast algorithm only)
+		double			*ring;
+		fftw_complex	*spectra;		// nQ half spectra of the fluctuations
+		fftw_complex	*maskSpectra;	// nQ half spectra of the occupancy
+		fftw_complex	*product;
+
+		struct sXCCABatch	*batch;	// frames waiting for the batched autocorrelation, NULL without batching
+
+	} tXCCAWork;
+
+	/*
+	 *	Frames of one worker waiting to be autocorrelated together (correlationBatch > 1)
+	 *	The fluctuations of all rings of all frames are in one contiguous block, so a single
+	 *	FFTW call transforms them. The batch is done when it is full, or when the sums are saved.
+	 */
+	typedef struct sXCCABatch {
+
+		pthread_mutex_t	mutex;			// taken by the worker adding frames and by flushCorrelationBatches()
+		long			workerNum;		// worker whose sums the frames go to
+		int				size;			// correlationBatch
+		int				count;			// frames waiting
+		tXCCAWork		**frames;		// polar bins and ring averages of each frame (no FFT buffers)
+		double			**correlation;	// nQ x nLag autocorrelation of each frame
+		char			(*eventname)[1024];
+		cHit			*hit;
+
+		double			*rings;			// nBatch x nQ x nPhi fluctuations, then autocorrelations
+		fftw_complex	*spectra;		// nBatch x nQ x nFreq
+		double			*ring;			// scratch for the occupancy of incomplete rings
+		fftw_complex	*product;
+
+	} tXCCABatch;
+
+	tXCCAWork *getXCCAWork(tThreadInfo *threadInfo, cGlobal *global);
+	void xccaPolar(tThreadInfo *threadInfo, cGlobal *global, tXCCAWork *work);
+	void xccaCorrelate(cGlobal *global, tXCCAWork *work, double *result);
+	void xccaCorrelateDirect(cGlobal *global, tXCCAWork *work, double *result);
+	int xccaQueue(cGlobal *global, tXCCAWork *work, const char *eventname, cHit *hit);
+	void xccaCorrelateBatch(cGlobal *global, tXCCABatch *batch);
+
+#endif
+
+/*
+ *	Running mean and variance of the correlation over the frames of one class of hits
+ *	(Welford's update per frame, Chan's formula to merge the sums of different workers)
+ */
+typedef struct sXCCASum {
+
+	long		n;				// number of frames
+	double		*mean;			// correlation_nn values
+	double		*m2;			// sum of squared deviations from the mean
+	double		*lastMean;		// mean at the last convergence report (global sums only)
+
+} tXCCASum;
+
+tXCCASum *createCorrelationSum(long nn);
+void freeCorrelationSum(tXCCASum *sum);
+void addToCorrelationSum(tXCCASum *&sum, const double *data, long nn);
+void mergeCorrelationSum(tXCCASum *global, tXCCASum *worker, long nn);
+void saveCorrelationSum(cGlobal *global, tXCCASum *sum, const char *suffix);
+void reportCorrelationConvergence(cGlobal *global);
+
+void initPolarMap(cGlobal *global);
+void freePolarMap(cGlobal *global);
+void createXCCAPlans(cGlobal *global);
+void destroyXCCAPlans(cGlobal *global);
+void freeXCCAWork(tWorkerData *workerData);
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ *  xcca_bench.cpp
+ *  cheetah
+ *
+ *	You can modify this software under the terms of the GNU General Public License
+ *	as published by the Free Software Foundation, either version 3 of the License, or
+ *	(at your option) any later version.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ *	Standalone benchmark of the fast correlation against the number of threads (make xcca_bench)
+ *	Runs xccaCorrelate() on synthetic rings from 1, 2, 4, ... threads that all share the plans in
+ *	global->xccaPlans, each with its own workspace as a worker would, and reports frames/s
+ *
+ *	Usage: xcca_bench [maxThreads] [-c] [-l]
+ *		maxThreads	defaults to the number of CPUs
+ *		-c			cross-correlation of all pairs of rings instead of autoCorrelateOnly
+ *		-l			hold correlationFFT_mutex around each frame, as before the plans were shared
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "setup.h"
+#include "worker.h"
+#include "xcca.h"
+
+#define NFRAMES		4000		// frames per measurement, shared out among the threads (autocorrelation)
+
+
+typedef struct {
+	cGlobal		*global;
+	tThreadInfo	threadInfo;
+	long		nFrames;
+	int			serialize;
+} tBenchThread;
+
+
+/*
+ *	xcca.o saves the correlation sums through these, which are never called here
+ *	(the real ones are in worker.cpp, with the rest of the event processing)
+ */
+void writeSimpleHDF5(const char *filename, const void *data, int width, int height, int type) {
+}
+
+void writeSimpleHDF5(const char *filename, const void *data, int width, int height, int depth, int type) {
+}
+
+
+static double wallClock(void) {
+	struct timeval	tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec*1e-6;
+}
+
+
+/*
+ *	Fluctuations with a few angular harmonics on each ring, every third ring with a gap
+ *	of empty bins (like the ASIC gaps) so the occupancy spectra are exercised too
+ */
+static void makeRings(cGlobal *global, tXCCAWork *work, unsigned int seed) {
+
+	const int	nQ = global->correlationNumQ;
+	const int	nPhi = global->correlationNumPhi;
+
+	for(int q=0; q<nQ; q++) {
+		double	sum = 0;
+		long	n = 0;
+		work->full[q] = (q % 3 != 0);
+		for(int j=0; j<nPhi; j++) {
+			long	b = (long) q*nPhi + j;
+			double	phi = 2*M_PI*j/nPhi;
+			work->occupancy[b] = (work->full[q] || j % 32 >= 4) ? 1 : 0;
+			work->polar[b] = 100 + 10*cos(2*phi + q) + 5*cos(6*phi) + rand_r(&seed)%100/10.;
+			if (work->occupancy[b]) {
+				sum += work->polar[b];
+				n++;
+			}
+		}
+		work->iAvg[q] = sum/n;
+		work->norm[q] = work->iAvg[q];
+		for(int j=0; j<nPhi; j++) {
+			long	b = (long) q*nPhi + j;
+			work->fluct[b] = work->occupancy[b] ? work->polar[b] - work->iAvg[q] : 0;
+		}
+	}
+}
+
+
+static void *benchThread(void *arg) {
+
+	tBenchThread	*bench = (tBenchThread*) arg;
+	cGlobal			*global = bench->global;
+	tXCCAWork		*work = getXCCAWork(&bench->threadInfo, global);
+	double			*result = (double*) calloc(global->correlation_nn, sizeof(double));
+
+	makeRings(global, work, (unsigned int) bench->threadInfo.workerNum + 1);
+
+	for(long n=0; n<bench->nFrames; n++) {
+		if (bench->serialize)
+			pthread_mutex_lock(&global->correlationFFT_mutex);
+		xccaCorrelate(global, work, result);
+		if (bench->serialize)
+			pthread_mutex_unlock(&global->correlationFFT_mutex);
+	}
+
+	free(result);
+	return NULL;
+}
+
+
+int main(int argc, char **argv) {
+
+	cGlobal		*global = new cGlobal();
+	int			maxThreads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+	int			serialize = 0;
+
+	global->autoCorrelateOnly = 1;
+	for(int a=1; a<argc; a++) {
+		if (!strcmp(argv[a], "-c"))
+			global->autoCorrelateOnly = 0;
+		else if (!strcmp(argv[a], "-l"))
+			serialize = 1;
+		else
+			maxThreads = atoi(argv[a]);
+	}
+	if (maxThreads < 1)
+		maxThreads = 1;
+
+	// Correlation shape of the defaults (defaultConfiguration(), which is in setup.o with the rest of the setup)
+	global->useCorrelation = 2;
+	global->correlationBatch = 0;
+	global->correlationNumQ = 51;
+	global->correlationStartPhi = 0;
+	global->correlationStopPhi = 360;
+	global->correlationNumPhi = 256;
+	global->correlationNumDelta = (int) ceil(global->correlationNumPhi/2.0+1);
+	if (global->autoCorrelateOnly)
+		global->correlation_nn = global->correlationNumQ*global->correlationNumDelta;
+	else
+		global->correlation_nn = global->correlationNumQ*global->correlationNumQ*global->correlationNumDelta;
+	pthread_mutex_init(&global->correlationFFT_mutex, NULL);
+	createXCCAPlans(global);
+
+	global->nThreads = maxThreads;
+	global->workerData = (tWorkerData*) calloc(maxThreads, sizeof(tWorkerData));
+
+	long	nFrames = global->autoCorrelateOnly ? NFRAMES : NFRAMES/global->correlationNumQ;
+	printf("%li frames of %i rings x %i angles, %s%s\n", nFrames, global->correlationNumQ, global->correlationNumPhi,
+		   global->autoCorrelateOnly ? "autocorrelation" : "cross-correlation", serialize ? ", one frame at a time" : "");
+	printf("threads    frames/s   speedup\n");
+
+	tBenchThread	*bench = (tBenchThread*) calloc(maxThreads, sizeof(tBenchThread));
+	pthread_t		*threads = (pthread_t*) calloc(maxThreads, sizeof(pthread_t));
+	double			rate1 = 0;
+
+	for(int nThreads=1; ; nThreads*=2) {
+		if (nThreads > maxThreads)
+			nThreads = maxThreads;
+
+		double	tstart = wallClock();
+		for(int t=0; t<nThreads; t++) {
+			bench[t].global = global;
+			bench[t].threadInfo.workerNum = t;
+			bench[t].threadInfo.pGlobal = global;
+			bench[t].nFrames = nFrames/nThreads + (t < nFrames % nThreads);
+			bench[t].serialize = serialize;
+			pthread_create(&threads[t], NULL, benchThread, &bench[t]);
+		}
+		for(int t=0; t<nThreads; t++)
+			pthread_join(threads[t], NULL);
+		double	rate = nFrames/(wallClock() - tstart);
+
+		if (nThreads == 1)
+			rate1 = rate;
+		printf("%7i %11.1f %9.2f\n", nThreads, rate, rate/rate1);
+
+		for(int t=0; t<nThreads; t++)
+			freeXCCAWork(&global->workerData[t]);
+		if (nThreads == maxThreads)
+			break;
+	}
+
+	destroyXCCAPlans(global);
+	pthread_mutex_destroy(&global->correlationFFT_mutex);
+	free(bench);
+	free(threads);
+	return 0;
+}